@@ -0,0 +1,153 @@
+/* bench-download-hash.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs ViewerInstallerDownload against the stand-in CDN with and
+ * without a SHA-256 to check, at one and at several connections. With
+ * several, the hash catches up on the segments that arrived ahead of
+ * it, so the difference is what hashing costs the shipped download path,
+ * read-back included, relative to the time the bytes take to arrive. */
+
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+
+#include "bench-stand-in.h"
+#include "viewer-installer-download.h"
+
+static gint size_mb = 64;
+static gint rounds = 3;
+static gint connections = 4;
+
+static GOptionEntry entries[] =
+{
+    { "size", 's', 0, G_OPTION_ARG_INT, &size_mb, "Size of the synthetic package, in MiB", "MIB" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Rounds per mode, the best one counts", "N" },
+    { "connections", 'c', 0, G_OPTION_ARG_INT, &connections, "Range segments of the parallel mode", "N" },
+    { NULL }
+};
+
+typedef struct
+{
+    ViewerInstallerDownload *download;
+    GMainLoop               *loop;
+    GError                  *error;
+} Run;
+
+static void
+run_done (GObject *source,
+          GAsyncResult *result,
+          gpointer user_data)
+{
+    Run *run = user_data;
+
+    viewer_installer_download_run_finish (run->download, result, &run->error);
+    g_main_loop_quit (run->loop);
+}
+
+/* One download of the package into @dir, in seconds */
+static gdouble
+run_download (StandIn *cdn, const gchar *dir, guint count, gboolean hash)
+{
+    ViewerInstallerDownload *download;
+    g_autofree gchar *uri = g_strdup_printf ("http://127.0.0.1:%u/%s", cdn->port, cdn->file_name);
+    g_autofree gchar *out_file = g_build_filename (dir, "download.deb", NULL);
+    Run run = { 0, };
+    gint64 start;
+    gdouble elapsed;
+
+    run.loop = g_main_loop_new (NULL, FALSE);
+
+    download = viewer_installer_download_new (uri, out_file);
+    run.download = download;
+    viewer_installer_download_set_size (download, cdn->size, TRUE);
+    viewer_installer_download_set_connections (download, count);
+    if (hash)
+        viewer_installer_download_set_sha256 (download, cdn->sha256);
+
+    start = g_get_monotonic_time ();
+    viewer_installer_download_run_async (download, NULL, run_done, &run);
+    g_main_loop_run (run.loop);
+    elapsed = (gdouble) (g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+    if (run.error)
+        g_error ("%s", run.error->message);
+
+    viewer_installer_download_free (download);
+    g_main_loop_unref (run.loop);
+    g_unlink (out_file);
+
+    return elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+    StandIn cdn = { 0, };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autofree gchar *dir = NULL;
+    guint counts[2];
+    gint i, j;
+
+    context = g_option_context_new ("- benchmark hashing in the download path");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    curl_global_init (CURL_GLOBAL_DEFAULT);
+
+    dir = g_dir_make_tmp ("bench-download-hash-XXXXXX", &error);
+    if (!dir)
+        g_error ("%s", error->message);
+
+    stand_in_make_package (&cdn, dir, (goffset) size_mb * 1024 * 1024);
+    stand_in_start (&cdn);
+
+    counts[0] = 1;
+    counts[1] = MAX (connections, 2);
+
+    g_print ("package:          %d MiB\n", size_mb);
+
+    for (i = 0; i < 2; i++)
+    {
+        gdouble plain = G_MAXDOUBLE;
+        gdouble hashed = G_MAXDOUBLE;
+
+        /* Interleave the modes so page cache and CPU clocks affect both alike */
+        for (j = 0; j < rounds; j++)
+        {
+            plain = MIN (plain, run_download (&cdn, dir, counts[i], FALSE));
+            hashed = MIN (hashed, run_download (&cdn, dir, counts[i], TRUE));
+        }
+
+        g_print ("%u connection(s):\n", counts[i]);
+        g_print ("  download:         %.3f s (%.1f MiB/s)\n", plain, size_mb / plain);
+        g_print ("  download + check: %.3f s (%.1f MiB/s)\n", hashed, size_mb / hashed);
+        g_print ("  hash / wire time: %.2f %%\n", MAX (0, hashed - plain) * 100 / plain);
+    }
+
+    stand_in_stop (&cdn);
+    stand_in_clear (&cdn);
+    g_rmdir (dir);
+
+    curl_global_cleanup ();
+
+    return 0;
+}
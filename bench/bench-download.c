@@ -0,0 +1,224 @@
+/* bench-download.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs the download and verify pipeline of the view model against a
+ * stand-in for the CDN on the loopback interface, so it needs no network,
+ * see bench-stand-in.c. Plain libcurl requests against it give the HEAD
+ * latency and time to first byte the pipeline is built on. */
+
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+
+#include "define.h"
+#include "bench-stand-in.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-window-view-model.h"
+
+static gint size_mb = 64;
+static gint rounds = 3;
+static gint rtt_ms = 0;
+
+static GOptionEntry entries[] =
+{
+    { "size", 's', 0, G_OPTION_ARG_INT, &size_mb, "Size of the synthetic package, in MiB", "MIB" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Rounds per measurement, the median counts", "N" },
+    { "rtt", 't', 0, G_OPTION_ARG_INT, &rtt_ms, "Delay before every response, in ms", "MS" },
+    { NULL }
+};
+
+static size_t
+discard_cb (char *ptr, size_t size, size_t nmemb, void *user_data)
+{
+    return size * nmemb;
+}
+
+/* One request on @curl, or on a new handle when @curl is NULL */
+static CURL *
+request (CURL *curl, const gchar *url, gboolean head,
+         gdouble *total, gdouble *first_byte)
+{
+    if (!curl)
+        curl = curl_easy_init ();
+
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_NOBODY, head ? 1L : 0L);
+    curl_easy_setopt (curl, CURLOPT_HTTPGET, head ? 0L : 1L);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, discard_cb);
+
+    if (curl_easy_perform (curl) != CURLE_OK)
+        g_error ("%s: request failed", url);
+
+    curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME, total);
+    if (first_byte)
+        curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME, first_byte);
+
+    return curl;
+}
+
+static gint
+compare_double (gconstpointer a, gconstpointer b)
+{
+    gdouble x = *(const gdouble *) a;
+    gdouble y = *(const gdouble *) b;
+
+    return (x > y) - (x < y);
+}
+
+static gdouble
+median (GArray *samples)
+{
+    g_array_sort (samples, compare_double);
+    return g_array_index (samples, gdouble, samples->len / 2);
+}
+
+static void
+notify_status (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+    guint status;
+
+    g_object_get (object, "status", &status, NULL);
+
+    if (status == STATUS_DOWNLOADED || status == STATUS_ERROR || status == STATUS_CANCEL)
+        g_main_loop_quit (user_data);
+}
+
+/* HEAD check, segmented download and SHA-256 verify, as the window runs them */
+static gdouble
+run_pipeline (ViewerInstallerManifest *manifest, const gchar *file_name)
+{
+    ViewerInstallerWindowViewModel *view_model;
+    g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+    g_autofree gchar *out_file = g_build_filename ("/var/tmp", file_name, NULL);
+    gint64 start;
+    gdouble elapsed;
+    guint status;
+
+    view_model = viewer_installer_window_view_model_new_for_package (manifest, STAND_IN_PACKAGE);
+    g_signal_connect (view_model, "notify::status", G_CALLBACK (notify_status), loop);
+
+    start = g_get_monotonic_time ();
+    viewer_installer_window_view_model_download (view_model);
+
+    g_object_get (view_model, "status", &status, NULL);
+    if (status == STATUS_DOWNLOADING)
+        g_main_loop_run (loop);
+
+    elapsed = (gdouble) (g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+    g_object_get (view_model, "status", &status, NULL);
+    if (status != STATUS_DOWNLOADED)
+        g_error ("Pipeline failed: %s", viewer_installer_window_view_model_get_error (view_model));
+
+    g_signal_handlers_disconnect_by_data (view_model, loop);
+    g_object_unref (view_model);
+    g_unlink (out_file);
+
+    return elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+    StandIn cdn = { 0, };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(ViewerInstallerManifest) manifest = NULL;
+    g_autoptr(GArray) cold = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_autoptr(GArray) warm = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_autoptr(GArray) ttfb = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_autoptr(GArray) wire = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_autoptr(GArray) pipeline = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    g_autofree gchar *dir = NULL;
+    g_autofree gchar *base = NULL;
+    g_autofree gchar *url = NULL;
+    g_autofree gchar *json = NULL;
+    CURL *curl = NULL;
+    gdouble total, first_byte;
+    gint i;
+
+    context = g_option_context_new ("- benchmark the download pipeline against a local CDN");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    curl_global_init (CURL_GLOBAL_DEFAULT);
+
+    dir = g_dir_make_tmp ("bench-download-XXXXXX", &error);
+    if (!dir)
+        g_error ("%s", error->message);
+
+    cdn.rtt_ms = rtt_ms;
+    stand_in_make_package (&cdn, dir, (goffset) size_mb * 1024 * 1024);
+    stand_in_start (&cdn);
+
+    base = g_strdup_printf ("http://127.0.0.1:%u", cdn.port);
+    url = g_strdup_printf ("%s/%s", base, cdn.file_name);
+
+    /* Point the view model at the stand-in, and nowhere else */
+    g_setenv ("VIEWER_INSTALLER_URL", base, TRUE);
+    g_unsetenv ("VIEWER_INSTALLER_PEERS");
+
+    json = g_strdup_printf ("{ \"package\" : { \"name\" : \"%s\", \"file-name\" : \"%s\", \"SHA256\" : \"%s\" } }",
+                            STAND_IN_PACKAGE, cdn.file_name, cdn.sha256);
+    manifest = viewer_installer_manifest_new_from_data (json, -1, &error);
+    if (!manifest)
+        g_error ("%s", error->message);
+
+    for (i = 0; i < rounds; i++)
+    {
+        CURL *fresh = request (NULL, url, TRUE, &total, NULL);
+        g_array_append_val (cold, total);
+        curl_easy_cleanup (fresh);
+
+        curl = request (curl, url, TRUE, &total, NULL);
+        if (i)
+            g_array_append_val (warm, total);
+
+        fresh = request (NULL, url, FALSE, &total, &first_byte);
+        g_array_append_val (ttfb, first_byte);
+        g_array_append_val (wire, total);
+        curl_easy_cleanup (fresh);
+    }
+    curl_easy_cleanup (curl);
+
+    for (i = 0; i < rounds; i++)
+    {
+        total = run_pipeline (manifest, cdn.file_name);
+        g_array_append_val (pipeline, total);
+    }
+
+    g_print ("package:              %d MiB, %d ms added round trip\n", size_mb, rtt_ms);
+    g_print ("HEAD, new connection: %.2f ms\n", median (cold) * 1000);
+    if (warm->len)
+        g_print ("HEAD, reused:         %.2f ms\n", median (warm) * 1000);
+    g_print ("time to first byte:   %.2f ms\n", median (ttfb) * 1000);
+    g_print ("plain GET:            %.3f s (%.1f MiB/s)\n", median (wire), size_mb / median (wire));
+    g_print ("download + verify:    %.3f s (%.1f MiB/s)\n", median (pipeline), size_mb / median (pipeline));
+    g_print ("pipeline overhead:    %.3f s\n", median (pipeline) - median (wire));
+
+    stand_in_stop (&cdn);
+    stand_in_clear (&cdn);
+    g_rmdir (dir);
+
+    curl_global_cleanup ();
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+/* bench-dpkg-status.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the in-process dpkg status reader with the
+ * bash | dpkg-query | grep chain check_package used to spawn. */
+
+#include <glib.h>
+
+#include "viewer-installer-dpkg.h"
+
+static gchar *package = NULL;
+static gint native_rounds = 100000;
+static gint spawn_rounds = 50;
+
+static GOptionEntry entries[] =
+{
+    { "package", 'p', 0, G_OPTION_ARG_STRING, &package, "Package to query (default: dpkg)", "NAME" },
+    { "native", 'n', 0, G_OPTION_ARG_INT, &native_rounds, "Queries through the status reader", "N" },
+    { "spawn", 's', 0, G_OPTION_ARG_INT, &spawn_rounds, "Queries through dpkg-query", "N" },
+    { NULL }
+};
+
+static gboolean
+spawn_check (const gchar *name)
+{
+    gboolean res;
+    gchar *out = NULL;
+    const gchar *argv[] = { "bash", "-c", "dpkg-query -s \"$1\" | grep Version", "bash", name, NULL };
+
+    if (!g_spawn_sync (NULL, (gchar **) argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &out, NULL, NULL, NULL))
+        return FALSE;
+
+    res = g_str_has_prefix (out, "Version");
+    g_free (out);
+    return res;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gint i;
+    gint64 start;
+    gdouble cold, native, spawn;
+    gboolean installed;
+    g_autofree gchar *version = NULL;
+    g_autofree gchar *dpkg_query = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+
+    context = g_option_context_new ("- benchmark installed-package queries");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    if (!package)
+        package = g_strdup ("dpkg");
+
+    /* First query maps and indexes the status file */
+    start = g_get_monotonic_time ();
+    installed = viewer_installer_dpkg_is_installed (package);
+    cold = g_get_monotonic_time () - start;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < native_rounds; i++)
+        viewer_installer_dpkg_is_installed (package);
+    native = (gdouble) (g_get_monotonic_time () - start) / MAX (1, native_rounds);
+
+    version = viewer_installer_dpkg_get_version (package);
+
+    g_print ("package:          %s (%s)\n", package, installed ? version : "not installed");
+    g_print ("reader, cold:     %.1f us\n", cold);
+    g_print ("reader, warm:     %.3f us per query (%d queries)\n", native, native_rounds);
+
+    dpkg_query = g_find_program_in_path ("dpkg-query");
+    if (!dpkg_query)
+    {
+        g_print ("spawn:            skipped, dpkg-query not found\n");
+        return 0;
+    }
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < spawn_rounds; i++)
+    {
+        if (spawn_check (package) != installed)
+            g_printerr ("dpkg-query disagrees about %s\n", package);
+    }
+    spawn = (gdouble) (g_get_monotonic_time () - start) / MAX (1, spawn_rounds);
+
+    g_print ("spawn:            %.1f us per query (%d queries)\n", spawn, spawn_rounds);
+    g_print ("speedup:          %.0fx warm, %.0fx cold\n", spawn / MAX (native, 0.001), spawn / MAX (cold, 1));
+
+    return 0;
+}
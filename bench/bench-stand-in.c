@@ -0,0 +1,373 @@
+/* bench-stand-in.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A stand-in for the CDN on the loopback interface, shared by the
+ * benchmarks and the tests. It serves a synthetic package with the
+ * headers the real CDN sends, Checksum included, answers HEAD and single
+ * byte ranges on keep-alive connections and can add a round trip delay,
+ * or slow the body down. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "bench-stand-in.h"
+
+#define BUFFER_SIZE (64 * 1024)
+
+/* Answers @request; FALSE once the connection should be closed */
+static gboolean
+stand_in_respond (StandIn *cdn,
+                  int fd,
+                  gchar *request,
+                  GDataInputStream *in,
+                  GOutputStream *out)
+{
+    g_autofree gchar *target = NULL;
+    g_autofree gchar *headers = NULL;
+    g_auto(GStrv) tokens = NULL;
+    gchar *line;
+    goffset start = 0;
+    goffset end = cdn->size - 1;
+    gboolean ranged = FALSE;
+    gboolean head;
+    const gchar *status;
+
+    while ((line = g_data_input_stream_read_line (in, NULL, NULL, NULL)))
+    {
+        g_strchomp (line);
+        if (*line == '\0')
+        {
+            g_free (line);
+            break;
+        }
+
+        if (g_ascii_strncasecmp (line, "Range: bytes=", 13) == 0)
+        {
+            gchar *dash;
+
+            start = g_ascii_strtoll (line + 13, &dash, 10);
+            if (*dash == '-' && dash[1])
+                end = MIN (g_ascii_strtoll (dash + 1, NULL, 10), cdn->size - 1);
+            ranged = TRUE;
+        }
+        g_free (line);
+    }
+    if (!line)
+        return FALSE;
+
+    tokens = g_strsplit (g_strchomp (request), " ", 3);
+    if (g_strv_length (tokens) < 2)
+        return FALSE;
+
+    head = (g_strcmp0 (tokens[0], "HEAD") == 0);
+    target = g_strdup_printf ("/%s", cdn->file_name);
+
+    if (cdn->rtt_ms)
+        g_usleep (cdn->rtt_ms * 1000);
+
+    if (g_strcmp0 (tokens[1], target) != 0)
+    {
+        const gchar *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return g_output_stream_write_all (out, not_found, strlen (not_found), NULL, NULL, NULL);
+    }
+
+    if (end < start)
+    {
+        const gchar *unsatisfiable = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n";
+        return g_output_stream_write_all (out, unsatisfiable, strlen (unsatisfiable), NULL, NULL, NULL);
+    }
+
+    status = ranged ? "206 Partial Content" : "200 OK";
+    headers = g_strdup_printf ("HTTP/1.1 %s\r\n"
+                               "Content-Length: %" G_GOFFSET_FORMAT "\r\n"
+                               "Accept-Ranges: bytes\r\n"
+                               "ETag: \"%.16s\"\r\n"
+                               "Last-Modified: Thu, 01 Oct 2020 00:00:00 GMT\r\n"
+                               "Checksum: %s\r\n",
+                               status, end - start + 1, cdn->sha256, cdn->sha256);
+
+    if (ranged)
+    {
+        g_autofree gchar *range = g_strdup_printf ("Content-Range: bytes %" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT
+                                                   "/%" G_GOFFSET_FORMAT "\r\n", start, end, cdn->size);
+        gchar *tmp = g_strconcat (headers, range, NULL);
+        g_free (headers);
+        headers = tmp;
+    }
+
+    if (!g_output_stream_write_all (out, headers, strlen (headers), NULL, NULL, NULL) ||
+        !g_output_stream_write_all (out, "\r\n", 2, NULL, NULL, NULL))
+        return FALSE;
+
+    if (head)
+        return TRUE;
+
+    while (start <= end)
+    {
+        guchar buffer[BUFFER_SIZE];
+        ssize_t n = pread (fd, buffer, MIN (BUFFER_SIZE, end - start + 1), start);
+
+        if (n <= 0)
+            return FALSE;
+        if (!g_output_stream_write_all (out, buffer, n, NULL, NULL, NULL))
+            return FALSE;
+        start += n;
+
+        if (cdn->chunk_delay_ms)
+            g_usleep (cdn->chunk_delay_ms * 1000);
+    }
+
+    return TRUE;
+}
+
+/* Reads and answers one request. A client that gave up on it, as the
+ * cancel tests do, leaves it running until the delays are over */
+static gboolean
+stand_in_serve (StandIn *cdn,
+                int fd,
+                GDataInputStream *in,
+                GOutputStream *out)
+{
+    g_autofree gchar *request = NULL;
+    gboolean keep_alive;
+
+    request = g_data_input_stream_read_line (in, NULL, NULL, NULL);
+    if (!request)
+        return FALSE;
+
+    g_mutex_lock (&cdn->mutex);
+    cdn->busy++;
+    g_mutex_unlock (&cdn->mutex);
+
+    keep_alive = stand_in_respond (cdn, fd, request, in, out);
+
+    g_mutex_lock (&cdn->mutex);
+    cdn->busy--;
+    g_cond_broadcast (&cdn->cond);
+    g_mutex_unlock (&cdn->mutex);
+
+    return keep_alive;
+}
+
+static gboolean
+stand_in_run (GThreadedSocketService *service,
+              GSocketConnection *connection,
+              GObject *source_object,
+              gpointer user_data)
+{
+    StandIn *cdn = user_data;
+    g_autoptr(GDataInputStream) in = NULL;
+    GOutputStream *out;
+    int fd;
+
+    fd = g_open (cdn->path, O_RDONLY, 0);
+    if (fd < 0)
+        return TRUE;
+
+    in = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+    g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (in), FALSE);
+    g_data_input_stream_set_newline_type (in, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+    out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+    /* Keep-alive, as the CDN does */
+    while (stand_in_serve (cdn, fd, in, out))
+        ;
+
+    close (fd);
+    return TRUE;
+}
+
+/* The service dispatches accepts on the thread default context, which
+ * must keep running while the main thread blocks in libcurl */
+static gpointer
+stand_in_thread (gpointer user_data)
+{
+    StandIn *cdn = user_data;
+    g_autoptr(GMainContext) context = g_main_context_new ();
+    g_autoptr(GSocketService) service = NULL;
+    g_autoptr(GInetAddress) loopback = NULL;
+    g_autoptr(GSocketAddress) address = NULL;
+    g_autoptr(GSocketAddress) effective = NULL;
+    g_autoptr(GError) error = NULL;
+
+    g_main_context_push_thread_default (context);
+
+    service = g_threaded_socket_service_new (8);
+    loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+    address = g_inet_socket_address_new (loopback, 0);
+
+    if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+                                        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+                                        NULL, &effective, &error))
+        g_error ("Could not start the stand-in CDN: %s", error->message);
+
+    g_signal_connect (service, "run", G_CALLBACK (stand_in_run), cdn);
+    g_socket_service_start (service);
+
+    cdn->loop = g_main_loop_new (context, FALSE);
+
+    g_mutex_lock (&cdn->mutex);
+    cdn->port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective));
+    cdn->ready = TRUE;
+    g_cond_signal (&cdn->cond);
+    g_mutex_unlock (&cdn->mutex);
+
+    g_main_loop_run (cdn->loop);
+
+    g_socket_service_stop (service);
+    g_main_context_pop_thread_default (context);
+
+    return NULL;
+}
+
+void
+stand_in_start (StandIn *cdn)
+{
+    g_mutex_init (&cdn->mutex);
+    g_cond_init (&cdn->cond);
+
+    cdn->thread = g_thread_new ("stand-in-cdn", stand_in_thread, cdn);
+
+    g_mutex_lock (&cdn->mutex);
+    while (!cdn->ready)
+        g_cond_wait (&cdn->cond, &cdn->mutex);
+    g_mutex_unlock (&cdn->mutex);
+}
+
+/* Waits for the requests still being answered, they use @cdn */
+void
+stand_in_stop (StandIn *cdn)
+{
+    g_mutex_lock (&cdn->mutex);
+    while (cdn->busy)
+        g_cond_wait (&cdn->cond, &cdn->mutex);
+    g_mutex_unlock (&cdn->mutex);
+
+    g_main_loop_quit (cdn->loop);
+    g_thread_join (cdn->thread);
+    g_main_loop_unref (cdn->loop);
+    g_mutex_clear (&cdn->mutex);
+    g_cond_clear (&cdn->cond);
+}
+
+static void
+write_bytes (FILE *fp, GChecksum *checksum, const void *data, gsize len)
+{
+    fwrite (data, 1, len, fp);
+    g_checksum_update (checksum, data, len);
+}
+
+static void
+write_member_header (FILE *fp, GChecksum *checksum, const gchar *name, goffset size)
+{
+    g_autofree gchar *header = NULL;
+
+    header = g_strdup_printf ("%-16s%-12s%-6s%-6s%-8s%-10" G_GINT64_FORMAT "`\n",
+                              name, "0", "0", "0", "100644", size);
+    write_bytes (fp, checksum, header, 60);
+}
+
+/* A tar holding just ./control, as the installer checks while it downloads */
+static void
+write_control_tar (FILE *fp, GChecksum *checksum, const gchar *control)
+{
+    gchar block[1024 * 2] = { 0, };
+    guint sum = 0;
+    guint i;
+
+    strcpy (block, "./control");
+    strcpy (block + 100, "0000644");
+    strcpy (block + 108, "0000000");
+    strcpy (block + 116, "0000000");
+    g_snprintf (block + 124, 12, "%011o", (guint) strlen (control));
+    strcpy (block + 136, "00000000000");
+    memset (block + 148, ' ', 8);
+    block[156] = '0';
+    memcpy (block + 257, "ustar\0" "00", 8);
+
+    for (i = 0; i < 512; i++)
+        sum += (guchar) block[i];
+    g_snprintf (block + 148, 8, "%06o", sum);
+
+    /* The content in the second block, the end of archive after it */
+    memcpy (block + 512, control, strlen (control));
+    write_bytes (fp, checksum, block, 1024);
+    memset (block, 0, 1024);
+    write_bytes (fp, checksum, block, 1024);
+}
+
+/* A .deb of @size bytes whose data.tar is random, so nothing along the
+ * way can compress it */
+void
+stand_in_make_package (StandIn *cdn, const gchar *dir, goffset size)
+{
+    g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    guint32 buffer[BUFFER_SIZE / sizeof (guint32)];
+    g_autofree gchar *control = NULL;
+    goffset written, data_size;
+    FILE *fp;
+    guint i;
+
+    cdn->file_name = g_strdup_printf ("%s_%d.deb", STAND_IN_PACKAGE, getpid ());
+    cdn->path = g_build_filename (dir, cdn->file_name, NULL);
+    cdn->size = size;
+
+    fp = g_fopen (cdn->path, "wb");
+    if (!fp)
+        g_error ("%s: %s", cdn->path, g_strerror (errno));
+
+    control = g_strdup_printf ("Package: %s\nVersion: 1.0\nArchitecture: all\n"
+                               "Maintainer: Hancom Gooroom <gooroom@hancom.com>\n"
+                               "Description: benchmark package\n", STAND_IN_PACKAGE);
+
+    write_bytes (fp, checksum, "!<arch>\n", 8);
+    write_member_header (fp, checksum, "debian-binary", 4);
+    write_bytes (fp, checksum, "2.0\n", 4);
+    write_member_header (fp, checksum, "control.tar", 2048);
+    write_control_tar (fp, checksum, control);
+
+    /* Fills the file up to the requested size, which is even */
+    data_size = cdn->size - ftell (fp) - 60;
+    write_member_header (fp, checksum, "data.tar", data_size);
+
+    for (written = 0; written < data_size; written += sizeof (buffer))
+    {
+        for (i = 0; i < G_N_ELEMENTS (buffer); i++)
+            buffer[i] = g_random_int ();
+
+        write_bytes (fp, checksum, buffer, MIN ((goffset) sizeof (buffer), data_size - written));
+    }
+    fclose (fp);
+
+    cdn->sha256 = g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Also removes the package */
+void
+stand_in_clear (StandIn *cdn)
+{
+    if (cdn->path)
+        g_unlink (cdn->path);
+
+    g_clear_pointer (&cdn->path, g_free);
+    g_clear_pointer (&cdn->file_name, g_free);
+    g_clear_pointer (&cdn->sha256, g_free);
+}
@@ -0,0 +1,54 @@
+/* bench-stand-in.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define STAND_IN_PACKAGE "bench-viewer"
+
+typedef struct
+{
+    gchar        *path;
+    gchar        *file_name;
+    gchar        *sha256;
+    goffset       size;
+
+    /* Set before stand_in_start () */
+    guint         rtt_ms;          /* before every response */
+    guint         chunk_delay_ms;  /* after every 64 KiB of a body */
+
+    guint16       port;
+    GMainLoop    *loop;
+    GThread      *thread;
+    GMutex        mutex;
+    GCond         cond;
+    gboolean      ready;
+    guint         busy;            /* requests being answered */
+} StandIn;
+
+void stand_in_make_package (StandIn     *cdn,
+                            const gchar *dir,
+                            goffset      size);
+void stand_in_start        (StandIn     *cdn);
+void stand_in_stop         (StandIn     *cdn);
+void stand_in_clear        (StandIn     *cdn);
+
+G_END_DECLS
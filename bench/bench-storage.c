@@ -0,0 +1,303 @@
+/* bench-storage.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Feeds libcurl sized chunks at link rate into a file, once with a
+ * pwrite() per chunk as the download used to, and once through the
+ * write-behind storage with each sync policy. Reports how long the
+ * network side was held up by the disk.
+ *
+ * The storage is built with its pwrite() and fdatasync() replaced by the
+ * ones below, which do the real call and then take as long as the chosen
+ * device profile would: a fixed cost per request, the transfer at the
+ * profile's sequential rate, a sync cost, and a garbage collection pause
+ * every so many bytes as flash does. Use --profile none to measure the
+ * disk under --dir as it is. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "viewer-installer-storage.h"
+
+/* CURL_MAX_WRITE_SIZE, the largest chunk a write callback receives */
+#define CHUNK_SIZE (16 * 1024)
+
+/* As the download saves its resume state */
+#define SYNC_INTERVAL (4 * 1024 * 1024)
+
+typedef struct
+{
+    const gchar *name;
+    gdouble      rate;          /* MB/s, sequential */
+    gdouble      latency;       /* ms per request */
+    gdouble      sync;          /* ms per fdatasync */
+    goffset      stall_every;   /* bytes between garbage collection pauses */
+    gdouble      stall;         /* ms */
+} DeviceProfile;
+
+static const DeviceProfile profiles[] =
+{
+    { "ssd",  400, 0.05,  2,  0,                 0   },
+    { "emmc",  40, 0.3,  15, 32 * 1024 * 1024, 150 },
+    { "sd",    12, 1.0,  40, 16 * 1024 * 1024, 400 },
+};
+
+static gint size_mb = 32;
+static gint link_mbit = 200;
+static gchar *dir = NULL;
+static gchar *profile_name = NULL;
+
+static GOptionEntry entries[] =
+{
+    { "size", 's', 0, G_OPTION_ARG_INT, &size_mb, "Bytes to write per run, in MiB", "MIB" },
+    { "link", 'l', 0, G_OPTION_ARG_INT, &link_mbit, "Rate the chunks arrive at, in Mbit/s", "MBIT" },
+    { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &dir, "Directory to write in, /var/tmp by default", "DIR" },
+    { "profile", 'p', 0, G_OPTION_ARG_STRING, &profile_name, "ssd, emmc, sd or none, all modelled ones by default", "NAME" },
+    { NULL }
+};
+
+/* The device works on one request at a time */
+static const DeviceProfile *device;
+static GMutex device_mutex;
+static goffset device_since_stall;
+
+ssize_t bench_pwrite    (int fd, const void *buf, size_t count, off_t offset);
+int     bench_fdatasync (int fd);
+
+static void
+device_busy (gdouble ms)
+{
+    g_usleep (ms * 1000);
+}
+
+ssize_t
+bench_pwrite (int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t n = pwrite (fd, buf, count, offset);
+
+    if (n <= 0 || !device)
+        return n;
+
+    g_mutex_lock (&device_mutex);
+    device_busy (device->latency + n / (device->rate * 1000.0));
+
+    device_since_stall += n;
+    if (device->stall_every && device->stall_every <= device_since_stall)
+    {
+        device_since_stall = 0;
+        device_busy (device->stall);
+    }
+    g_mutex_unlock (&device_mutex);
+
+    return n;
+}
+
+int
+bench_fdatasync (int fd)
+{
+    int res = fdatasync (fd);
+
+    if (device)
+    {
+        g_mutex_lock (&device_mutex);
+        device_busy (device->sync);
+        g_mutex_unlock (&device_mutex);
+    }
+
+    return res;
+}
+
+typedef struct
+{
+    gdouble  wall;      /* first chunk to data on disk */
+    gdouble  blocked;   /* time spent inside the write calls */
+    gdouble  longest;   /* longest single write call */
+} RunResult;
+
+/* Sleeps until chunk @i would have arrived */
+static void
+pace (gint64 start, goffset i)
+{
+    gint64 due = start + (gint64) ((gdouble) i * CHUNK_SIZE * 8 / (link_mbit * 1e6) * G_USEC_PER_SEC);
+    gint64 now = g_get_monotonic_time ();
+
+    if (now < due)
+        g_usleep (due - now);
+}
+
+static void
+account (RunResult *result, gint64 before)
+{
+    gdouble spent = (gdouble) (g_get_monotonic_time () - before) / G_USEC_PER_SEC;
+
+    result->blocked += spent;
+    result->longest = MAX (result->longest, spent);
+}
+
+static int
+open_file (const gchar *path, goffset total)
+{
+    g_autoptr(GError) error = NULL;
+    int fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        g_error ("%s: %s", path, g_strerror (errno));
+
+    if (!viewer_installer_storage_reserve (fd, path, total, &error))
+        g_error ("%s", error->message);
+
+    return fd;
+}
+
+/* A pwrite() per chunk, synced once at the end */
+static RunResult
+run_direct (const gchar *path, const guchar *chunk)
+{
+    RunResult result = { 0, };
+    goffset total = (goffset) size_mb * 1024 * 1024;
+    goffset i, n = total / CHUNK_SIZE;
+    gint64 start, before;
+    int fd = open_file (path, total);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < n; i++)
+    {
+        pace (start, i);
+        before = g_get_monotonic_time ();
+        if (bench_pwrite (fd, chunk, CHUNK_SIZE, i * CHUNK_SIZE) != CHUNK_SIZE)
+            g_error ("%s: %s", path, g_strerror (errno));
+        account (&result, before);
+    }
+    bench_fdatasync (fd);
+    result.wall = (gdouble) (g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+    close (fd);
+    return result;
+}
+
+static RunResult
+run_storage (const gchar *path, const guchar *chunk, ViewerInstallerStorageSync sync)
+{
+    RunResult result = { 0, };
+    g_autoptr(GError) error = NULL;
+    goffset total = (goffset) size_mb * 1024 * 1024;
+    goffset i, n = total / CHUNK_SIZE;
+    gint64 start, before;
+    ViewerInstallerStorage *storage;
+    guint stream;
+    int fd = open_file (path, total);
+
+    storage = viewer_installer_storage_new (fd, sync == STORAGE_SYNC_CHECKPOINT ? SYNC_INTERVAL : 0);
+    stream = viewer_installer_storage_add_stream (storage, 0);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < n; i++)
+    {
+        pace (start, i);
+        before = g_get_monotonic_time ();
+        if (!viewer_installer_storage_write (storage, stream, i * CHUNK_SIZE, chunk, CHUNK_SIZE, &error))
+            g_error ("%s: %s", path, error->message);
+        account (&result, before);
+    }
+
+    if (sync == STORAGE_SYNC_NONE)
+        viewer_installer_storage_flush (storage, &error);
+    else
+        viewer_installer_storage_sync (storage, &error);
+    if (error)
+        g_error ("%s: %s", path, error->message);
+    result.wall = (gdouble) (g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+    viewer_installer_storage_free (storage);
+    close (fd);
+    return result;
+}
+
+static void
+report (const gchar *mode, RunResult *result, gdouble wire)
+{
+    g_print ("  %-24s wall %6.2f s (wire %5.2f s)  blocked %6.2f s  longest %7.1f ms\n",
+             mode, result->wall, wire, result->blocked, result->longest * 1000);
+}
+
+static void
+run_profile (const DeviceProfile *profile, const gchar *path, const guchar *chunk)
+{
+    gdouble wire = (gdouble) size_mb * 1024 * 1024 * 8 / (link_mbit * 1e6);
+    RunResult result;
+
+    device = profile;
+    device_since_stall = 0;
+
+    g_print ("%s:\n", profile ? profile->name : "none");
+
+    result = run_direct (path, chunk);
+    report ("pwrite per chunk", &result, wire);
+
+    result = run_storage (path, chunk, STORAGE_SYNC_NONE);
+    report ("write-behind, none", &result, wire);
+
+    result = run_storage (path, chunk, STORAGE_SYNC_FINISH);
+    report ("write-behind, finish", &result, wire);
+
+    result = run_storage (path, chunk, STORAGE_SYNC_CHECKPOINT);
+    report ("write-behind, checkpoint", &result, wire);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autofree gchar *path = NULL;
+    g_autofree guchar *chunk = NULL;
+    guint i;
+
+    context = g_option_context_new ("- benchmark the download write path on slow storage");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    path = g_build_filename (dir ? dir : "/var/tmp", "bench-storage.part", NULL);
+    chunk = g_malloc (CHUNK_SIZE);
+    for (i = 0; i < CHUNK_SIZE; i++)
+        chunk[i] = g_random_int_range (0, 256);
+
+    g_print ("%d MiB in %d byte chunks at %d Mbit/s, writing %s\n", size_mb, CHUNK_SIZE, link_mbit, path);
+
+    if (g_strcmp0 (profile_name, "none") == 0)
+        run_profile (NULL, path, chunk);
+
+    for (i = 0; i < G_N_ELEMENTS (profiles); i++)
+    {
+        if (!profile_name || g_strcmp0 (profile_name, profiles[i].name) == 0)
+            run_profile (&profiles[i], path, chunk);
+    }
+
+    g_unlink (path);
+    g_free (dir);
+    g_free (profile_name);
+
+    return 0;
+}
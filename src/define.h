@@ -1,3 +1,5 @@
+#pragma once
+
 typedef enum
 {
   STATUS_NORMAL = 0,
@@ -10,10 +12,25 @@ typedef enum
   N_STATUS
 } InstallStatus;
 
+/* What went wrong when the status is STATUS_ERROR */
+typedef enum
+{
+  INSTALL_ERROR_NONE = 0,
+  INSTALL_ERROR_NETWORK,
+  INSTALL_ERROR_DOWNLOAD,
+  INSTALL_ERROR_INVALID,
+  INSTALL_ERROR_INSTALL,
+  INSTALL_ERROR_CONFIG,
+  N_INSTALL_ERROR
+} InstallError;
+
 #define TOOLKIT_NAME "hancom-toolkit"
 
 #define VIEWER_NAME "hoffice-hwpviewer"
-#define VIEWER_CHECK "hancom-viewer-check"
 #define VIEWER_SCRIPT "hancom-viewer-install"
 #define VIEWER_REFERER  "https://www.hancom.com/cs_center"
 #define VIEWER_INSTALL_URL "https://cdn.hancom.com/pds/hnc/VIE"
+
+#define VIEWER_CACHE_PATH "/var/cache/hancom-viewer-installer"
+
+#define VIEWER_SCHEMA_ID "kr.hancom.viewer-installer"
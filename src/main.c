@@ -23,6 +23,10 @@
 #include "utils.h"
 #include "viewer-installer-config.h"
 #include "viewer-installer-application.h"
+#include "viewer-installer-batch.h"
+#include "viewer-installer-peer.h"
+#include "viewer-installer-state.h"
+#include "viewer-installer-trace.h"
 
 static gboolean
 check_live_installer ()
@@ -37,26 +41,64 @@ check_live_installer ()
     return res;
 }
 
+/* The live session is checked with the session's PATH; the package
+ * with one call to the state service when it runs */
+static gboolean
+check_installed (const gchar *package)
+{
+    gboolean installed;
+
+    if (check_live_installer ())
+        return TRUE;
+
+    if (viewer_installer_state_query (package, &installed))
+        return installed;
+
+    return check_package (package);
+}
+
 int
 main (int   argc,
       char *argv[])
 {
-    if (check_live_installer ())
+    gint64 span;
+    int status;
+
+    viewer_installer_trace_init ();
+
+    if (1 < argc && g_strcmp0 (argv[1], "--peer-cache") == 0)
     {
-        return 0;
+        return viewer_installer_peer_main (argc, argv);
+    }
+
+    if (1 < argc && g_strcmp0 (argv[1], "--state-service") == 0)
+    {
+        return viewer_installer_state_main (argc, argv);
+    }
+
+    /* No display needed, GTK is never initialised */
+    if (viewer_installer_batch_requested (argc, argv))
+    {
+        return viewer_installer_batch_main (argc, argv);
     }
 
+    span = viewer_installer_trace_begin ();
+
 #ifdef USE_HANCOM_TOOLKIT
-    if (check_package (TOOLKIT_NAME))
+    if (check_installed (TOOLKIT_NAME))
     {
+        viewer_installer_trace_end (span, "check-package", "installed");
         return 0;
     }
 #else
-    if (check_package (VIEWER_NAME))
+    if (check_installed (VIEWER_NAME))
     {
+        viewer_installer_trace_end (span, "check-package", "installed");
         return 0;
     }
 #endif
+    viewer_installer_trace_end (span, "check-package", NULL);
+
     g_autoptr(GtkApplication) app = NULL;
 
     /* Set up gettext translations */
@@ -65,5 +107,9 @@ main (int   argc,
     textdomain (GETTEXT_PACKAGE);
     app = GTK_APPLICATION(viewer_installer_application_new());
 
-    return g_application_run (G_APPLICATION (app), argc, argv);
+    span = viewer_installer_trace_begin ();
+    status = g_application_run (G_APPLICATION (app), argc, argv);
+    viewer_installer_trace_end (span, "run", NULL);
+
+    return status;
 }
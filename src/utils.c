@@ -17,70 +17,69 @@
  */
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "define.h"
 #include "viewer-installer-config.h"
+#include "viewer-installer-dpkg.h"
+
+GSettings *
+viewer_installer_settings_new (void)
+{
+    GSettings *settings;
+    GSettingsSchema *schema;
+    GSettingsSchemaSource *source;
+
+    /* g_settings_new() aborts on a missing schema, e.g. in an uninstalled build */
+    source = g_settings_schema_source_get_default ();
+    if (!source)
+        return NULL;
+
+    schema = g_settings_schema_source_lookup (source, VIEWER_SCHEMA_ID, TRUE);
+    if (!schema)
+        return NULL;
+
+    settings = g_settings_new_full (schema, NULL, NULL);
+    g_settings_schema_unref (schema);
+
+    return settings;
+}
 
 gboolean
 check_package (const gchar* package)
 {
-    g_autofree gchar *out;
-    g_autofree gchar *command;
-
     if (!package)
         return FALSE;
 
-    command = g_strdup_printf ("%s/%s/%s %s",LIBDIR, GETTEXT_PACKAGE,VIEWER_CHECK, package);
-    g_spawn_command_line_sync (command, &out, NULL, NULL, NULL);
-
-    if (g_str_has_prefix (out, "Version"))
-        return TRUE;
-
-    return FALSE;
+    return viewer_installer_dpkg_is_installed (package);
 }
 
 gboolean
 check_version (const gchar* package, const gchar* filename)
 {
-    g_autofree gchar *out;
-    g_autofree gchar *command;
+    g_autofree gchar *version = NULL;
 
-    gchar **version = NULL;
     gchar **file_version = NULL;
 
     gboolean res = FALSE;
 
-    if (!filename)
+    if (!filename || !package)
         goto out;
 
-    command = g_strdup_printf ("%s/%s/%s %s",LIBDIR, GETTEXT_PACKAGE,VIEWER_CHECK, package);
-    g_spawn_command_line_sync (command, &out, NULL, NULL, NULL);
+    version = viewer_installer_dpkg_get_version (package);
+    if (!version)
+        goto out;
 
-    if (g_str_has_prefix (out, "Version"))
+    file_version = g_strsplit (filename, "_", -1);
+    if (file_version && file_version[1])
     {
-        version = g_strsplit (out, " ", -1);
-        if (!version[1])
-            goto out;
-
-        gchar *ver;
-        ver = g_strchomp (version[1]);
-
-        file_version = g_strsplit (filename, "_", -1);
-        if (file_version && file_version[1])
+        if (g_strcmp0 (file_version[1], version) != 0)
         {
-            if (g_strcmp0 (file_version[1], ver) != 0)
-            {
-                res = TRUE;
-            }
+            res = TRUE;
         }
     }
 
 out:
-    if (version)
-    {
-        g_strfreev (version);
-    }
-
     if (file_version)
     {
         g_strfreev (file_version);
@@ -89,3 +88,21 @@ out:
     return res;
 }
 
+/* Short names for reports and metrics */
+const gchar *
+install_error_to_string (InstallError error_class)
+{
+    static const gchar *names[N_INSTALL_ERROR] =
+    {
+        [INSTALL_ERROR_NONE]     = "unknown",
+        [INSTALL_ERROR_NETWORK]  = "network",
+        [INSTALL_ERROR_DOWNLOAD] = "download",
+        [INSTALL_ERROR_INVALID]  = "invalid",
+        [INSTALL_ERROR_INSTALL]  = "install",
+        [INSTALL_ERROR_CONFIG]   = "config",
+    };
+
+    g_return_val_if_fail (error_class < N_INSTALL_ERROR, "unknown");
+
+    return names[error_class];
+}
@@ -19,7 +19,15 @@
 #ifndef __UTILS__H_
 #define __UTILS__H_
 
+#include <gio/gio.h>
+
+#include "define.h"
+
+GSettings *viewer_installer_settings_new (void);
+
 gboolean check_package (const gchar *package);
 gboolean check_version (const gchar *package, const gchar *filename);
 
+const gchar *install_error_to_string (InstallError error_class);
+
 #endif
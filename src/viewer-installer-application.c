@@ -23,9 +23,15 @@
 #include "define.h"
 #include "utils.h"
 #include "viewer-installer-config.h"
+#include "viewer-installer-trace.h"
 #include "viewer-installer-window.h"
 #include "viewer-installer-application.h"
 
+#ifdef USE_HANCOM_TOOLKIT
+/* Seconds to wait for the network at login before giving up */
+#define NETWORK_TIMEOUT 30
+#endif
+
 struct _ViewerInstallerApplicationPrivate
 {
     gchar          *msg;
@@ -33,6 +39,21 @@ struct _ViewerInstallerApplicationPrivate
 
     GtkWindow      *window;
     GtkCssProvider *provider;
+
+#ifdef USE_HANCOM_TOOLKIT
+    GtkWidget      *progress_window;
+    GtkWidget      *progress_bar;
+
+    guint           pulse_id;
+    guint           network_timeout_id;
+    gulong          network_changed_id;
+
+    GSubprocess    *install_process;
+
+    /* Trace spans of the network wait and the install */
+    gint64          network_span;
+    gint64          install_span;
+#endif
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (ViewerInstallerApplication, viewer_installer_application, GTK_TYPE_APPLICATION)
@@ -40,73 +61,266 @@ G_DEFINE_TYPE_WITH_PRIVATE (ViewerInstallerApplication, viewer_installer_applica
 static void
 viewer_installer_application_startup (GApplication *app)
 {
+    /* Mostly GTK connecting to the display */
+    gint64 span = viewer_installer_trace_begin ();
+
     G_APPLICATION_CLASS (viewer_installer_application_parent_class)->startup (app);
+
+    viewer_installer_trace_end (span, "gtk-startup", NULL);
 }
 
+#ifdef USE_HANCOM_TOOLKIT
 static void
-viewer_installer_application_activate (GApplication *app)
+viewer_installer_application_dialog_response (GtkDialog *dialog,
+                                              gint response_id,
+                                              gpointer user_data)
 {
     ViewerInstallerApplicationPrivate *priv;
-    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(app));
+    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(user_data));
 
-#ifdef USE_HANCOM_TOOLKIT
-    GNetworkMonitor *monitor = g_network_monitor_get_default();
-    gboolean is_connected = g_network_monitor_get_network_available (monitor);
+    gtk_widget_destroy (GTK_WIDGET (dialog));
+    priv->dialog = NULL;
+
+    g_application_release (G_APPLICATION (user_data));
+}
 
-    g_usleep (G_USEC_PER_SEC * 2);
+static void
+viewer_installer_application_toolkit_progress_done (ViewerInstallerApplication *app)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
 
-    if (!is_connected)
+    if (priv->pulse_id)
     {
-        priv->msg = g_strdup (_("Network is not active"));
-        priv->dialog = gtk_message_dialog_new  (NULL,
-                                          GTK_DIALOG_MODAL,
-                                          GTK_MESSAGE_ERROR,
-                                          GTK_BUTTONS_OK,
-                                          NULL);
-        gtk_window_set_title (GTK_WINDOW (priv->dialog), _("HancomToolkit"));
-        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (priv->dialog), "%s", priv->msg);
-        gtk_window_set_keep_above (GTK_WINDOW (priv->dialog), TRUE);
-
-        gtk_dialog_run (GTK_DIALOG (priv->dialog));
-
-        g_application_quit (G_APPLICATION (app));
-        return;
+        g_source_remove (priv->pulse_id);
+        priv->pulse_id = 0;
     }
 
-    gchar **args;
-    g_autofree gchar *command;
+    if (priv->progress_window)
+    {
+        gtk_widget_destroy (priv->progress_window);
+        priv->progress_window = NULL;
+        priv->progress_bar = NULL;
+    }
+}
 
-    command = g_strdup_printf ("pkexec %s/%s/%s %s", LIBDIR, GETTEXT_PACKAGE, VIEWER_SCRIPT, TOOLKIT_NAME);
+static void
+viewer_installer_application_toolkit_error (ViewerInstallerApplication *app,
+                                            const gchar *msg)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
+
+    viewer_installer_application_toolkit_progress_done (app);
+
+    g_free (priv->msg);
+    priv->msg = g_strdup (msg);
+    priv->dialog = gtk_message_dialog_new  (NULL,
+                                      GTK_DIALOG_MODAL,
+                                      GTK_MESSAGE_ERROR,
+                                      GTK_BUTTONS_OK,
+                                      NULL);
+    gtk_window_set_title (GTK_WINDOW (priv->dialog), _("HancomToolkit"));
+    gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (priv->dialog), "%s", priv->msg);
+    gtk_window_set_keep_above (GTK_WINDOW (priv->dialog), TRUE);
+
+    /* The hold taken in activate is released when the dialog is closed */
+    g_signal_connect (priv->dialog, "response",
+                      G_CALLBACK (viewer_installer_application_dialog_response), app);
+    gtk_widget_show (priv->dialog);
+}
+
+static gboolean
+viewer_installer_application_toolkit_pulse (gpointer user_data)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(user_data));
 
-    args = g_strsplit (command, " ", -1);
+    gtk_progress_bar_pulse (GTK_PROGRESS_BAR (priv->progress_bar));
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+viewer_installer_application_toolkit_progress (ViewerInstallerApplication *app)
+{
+    GtkWidget *box;
+    GtkWidget *label;
 
-    g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, NULL);
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
+
+    priv->progress_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title (GTK_WINDOW (priv->progress_window), _("HancomToolkit"));
+    gtk_window_set_position (GTK_WINDOW (priv->progress_window), GTK_WIN_POS_CENTER);
+    gtk_window_set_resizable (GTK_WINDOW (priv->progress_window), FALSE);
+    gtk_window_set_deletable (GTK_WINDOW (priv->progress_window), FALSE);
+    gtk_window_set_keep_above (GTK_WINDOW (priv->progress_window), TRUE);
+
+    box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 12);
+    gtk_container_set_border_width (GTK_CONTAINER (box), 18);
+    label = gtk_label_new (_("Installing HancomToolkit"));
+    priv->progress_bar = gtk_progress_bar_new ();
+    gtk_widget_set_size_request (priv->progress_bar, 320, -1);
+    gtk_container_add (GTK_CONTAINER (box), label);
+    gtk_container_add (GTK_CONTAINER (box), priv->progress_bar);
+    gtk_container_add (GTK_CONTAINER (priv->progress_window), box);
+
+    gtk_widget_show_all (priv->progress_window);
+
+    /* apt reports nothing we could turn into a fraction */
+    priv->pulse_id = g_timeout_add (100, viewer_installer_application_toolkit_pulse, app);
+}
 
-    g_strfreev (args);
+static void
+viewer_installer_application_toolkit_installed (GObject *source,
+                                                GAsyncResult *result,
+                                                gpointer user_data)
+{
+    GError *error = NULL;
+    ViewerInstallerApplication *app = user_data;
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
 
-    g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, NULL);
+    if (!g_subprocess_wait_finish (G_SUBPROCESS (source), result, &error))
+    {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+    g_clear_object (&priv->install_process);
+    viewer_installer_trace_end (priv->install_span, "install", TOOLKIT_NAME);
+    priv->install_span = 0;
 
     if (!check_package (TOOLKIT_NAME))
     {
-        priv->msg = g_strdup (_("Package is not installed properly.\nRestart is required."));
-        priv->dialog = gtk_message_dialog_new  (NULL,
-                                          GTK_DIALOG_MODAL,
-                                          GTK_MESSAGE_ERROR,
-                                          GTK_BUTTONS_OK,
-                                          NULL);
-        gtk_window_set_title (GTK_WINDOW (priv->dialog), _("HancomToolkit"));
-        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (priv->dialog), "%s", priv->msg);
-        gtk_window_set_keep_above (GTK_WINDOW (priv->dialog), TRUE);
-
-        gtk_dialog_run (GTK_DIALOG (priv->dialog));
-
-        g_application_quit (G_APPLICATION (app));
+        viewer_installer_application_toolkit_error (app, _("Package is not installed properly.\nRestart is required."));
+        g_object_unref (app);
+        return;
+    }
+
+    viewer_installer_application_toolkit_progress_done (app);
+
+    if (!g_spawn_command_line_async (TOOLKIT_NAME, &error))
+    {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+    }
+
+    g_application_release (G_APPLICATION (app));
+    g_object_unref (app);
+}
+
+static void
+viewer_installer_application_toolkit_install (ViewerInstallerApplication *app)
+{
+    GError *error = NULL;
+    g_autofree gchar *script = NULL;
+
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
+
+    viewer_installer_application_toolkit_progress (app);
+
+    script = g_strdup_printf ("%s/%s/%s", LIBDIR, GETTEXT_PACKAGE, VIEWER_SCRIPT);
+    priv->install_span = viewer_installer_trace_begin ();
+    priv->install_process = g_subprocess_new (G_SUBPROCESS_FLAGS_NONE, &error,
+                                              "pkexec", script, TOOLKIT_NAME, NULL);
+    if (!priv->install_process)
+    {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+        viewer_installer_application_toolkit_error (app, _("Package is not installed properly.\nRestart is required."));
         return;
     }
 
-    g_spawn_command_line_sync (TOOLKIT_NAME, NULL, NULL, NULL, NULL);
+    g_subprocess_wait_async (priv->install_process, NULL,
+                             viewer_installer_application_toolkit_installed, g_object_ref (app));
+}
+
+static void
+viewer_installer_application_network_stop (ViewerInstallerApplication *app)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (app);
+
+    if (priv->network_changed_id)
+    {
+        g_signal_handler_disconnect (g_network_monitor_get_default (), priv->network_changed_id);
+        priv->network_changed_id = 0;
+    }
+
+    if (priv->network_timeout_id)
+    {
+        g_source_remove (priv->network_timeout_id);
+        priv->network_timeout_id = 0;
+    }
+}
+
+static void
+viewer_installer_application_network_changed (GNetworkMonitor *monitor,
+                                              gboolean network_available,
+                                              gpointer user_data)
+{
+    ViewerInstallerApplicationPrivate *priv;
+
+    if (!network_available)
+        return;
+
+    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(user_data));
+    viewer_installer_trace_end (priv->network_span, "network-wait", NULL);
+    priv->network_span = 0;
+
+    viewer_installer_application_network_stop (user_data);
+    viewer_installer_application_toolkit_install (user_data);
+}
+
+static gboolean
+viewer_installer_application_network_timeout (gpointer user_data)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(user_data));
+
+    priv->network_timeout_id = 0;
+    viewer_installer_trace_end (priv->network_span, "network-wait", "timeout");
+    priv->network_span = 0;
+    viewer_installer_application_network_stop (user_data);
+    viewer_installer_application_toolkit_error (user_data, _("Network is not active"));
+
+    return G_SOURCE_REMOVE;
+}
+#endif
+
+static void
+viewer_installer_application_activate (GApplication *app)
+{
+    ViewerInstallerApplicationPrivate *priv;
+    priv = viewer_installer_application_get_instance_private (VIEWER_INSTALLER_APPLICATION(app));
+
+#ifdef USE_HANCOM_TOOLKIT
+    GNetworkMonitor *monitor = g_network_monitor_get_default();
+
+    /* Already bootstrapping */
+    if (priv->install_process || priv->network_changed_id || priv->dialog)
+        return;
+
+    /* Released when the toolkit is launched or the error is dismissed */
+    g_application_hold (app);
+
+    if (g_network_monitor_get_network_available (monitor))
+    {
+        viewer_installer_application_toolkit_install (VIEWER_INSTALLER_APPLICATION(app));
+        return;
+    }
+
+    /* At login the network usually comes up a little after the session */
+    priv->network_span = viewer_installer_trace_begin ();
+    priv->network_changed_id = g_signal_connect (monitor, "network-changed",
+                                                 G_CALLBACK (viewer_installer_application_network_changed), app);
+    priv->network_timeout_id = g_timeout_add_seconds (NETWORK_TIMEOUT,
+                                                      viewer_installer_application_network_timeout, app);
 #else
     GFile *file;
+    gint64 span = viewer_installer_trace_begin ();
+
     /* Get the current window or create one if necessary. */
     priv->window = gtk_application_get_active_window (GTK_APPLICATION(app));
     if (priv->window == NULL)
@@ -127,6 +341,8 @@ viewer_installer_application_activate (GApplication *app)
                                                GTK_STYLE_PROVIDER (priv->provider),
                                                GTK_STYLE_PROVIDER_PRIORITY_APPLICATION + 1);
     g_object_unref (file);
+
+    viewer_installer_trace_end (span, "window", NULL);
 #endif
 }
 
@@ -142,6 +358,15 @@ viewer_installer_application_dispose (GObject *object)
         priv->dialog = NULL;
     }
 
+#ifdef USE_HANCOM_TOOLKIT
+    if (priv)
+    {
+        viewer_installer_application_network_stop (app);
+        viewer_installer_application_toolkit_progress_done (app);
+        g_clear_object (&priv->install_process);
+    }
+#endif
+
     if (priv && priv->msg != NULL)
     {
         g_free (priv->msg);
@@ -177,6 +402,16 @@ viewer_installer_application_init (ViewerInstallerApplication *application)
     priv->provider = NULL;
     priv->dialog = NULL;
     priv->msg = NULL;
+#ifdef USE_HANCOM_TOOLKIT
+    priv->progress_window = NULL;
+    priv->progress_bar = NULL;
+    priv->pulse_id = 0;
+    priv->network_timeout_id = 0;
+    priv->network_changed_id = 0;
+    priv->install_process = NULL;
+    priv->network_span = 0;
+    priv->install_span = 0;
+#endif
 }
 
 static void
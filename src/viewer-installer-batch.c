@@ -0,0 +1,346 @@
+/* viewer-installer-batch.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Headless mode.
+ *
+ * Runs the window's download and install through the same scheduler, on
+ * a plain GMainLoop so GTK is never initialised. Every state change is one
+ * line of space separated key=value pairs on stdout, lines about a single
+ * package of the manifest carry its name:
+ *
+ *   status=downloading
+ *   progress=42 package=hoffice-hwpviewer received=12582912 total=29958144 rate=1048576 eta=16
+ *   status=installed package=hoffice-hwpviewer method=dpkg time=5120
+ *   status=error class=network message="Network is not active"
+ *   timing wall=41.2 download=30.5 install=18.0 overlap=7.3
+ *
+ * and the exit code tells the failure class apart, see BatchExit.
+ */
+
+#include <glib-unix.h>
+#include <glib/gprintf.h>
+
+#include "define.h"
+#include "utils.h"
+#include "viewer-installer-batch.h"
+#include "viewer-installer-scheduler.h"
+#include "viewer-installer-transfer.h"
+
+typedef struct
+{
+    GMainLoop *loop;
+    ViewerInstallerScheduler *scheduler;
+    BatchExit  exit_code;
+    gboolean   done;
+    gboolean   quiet;
+} ViewerInstallerBatch;
+
+static gboolean option_batch = FALSE;
+static gboolean option_quiet = FALSE;
+
+static GOptionEntry batch_entries[] =
+{
+    { "batch", 0, 0, G_OPTION_ARG_NONE, &option_batch, "Download and install without a window", NULL },
+    { "silent", 0, 0, G_OPTION_ARG_NONE, &option_batch, "Same as --batch", NULL },
+    { "quiet", 'q', 0, G_OPTION_ARG_NONE, &option_quiet, "Only report the result", NULL },
+    { NULL }
+};
+
+static BatchExit
+viewer_installer_batch_exit_code (InstallError error_class)
+{
+    switch (error_class)
+    {
+        case INSTALL_ERROR_NETWORK:
+            return BATCH_EXIT_NETWORK;
+        case INSTALL_ERROR_INVALID:
+            return BATCH_EXIT_INVALID;
+        case INSTALL_ERROR_INSTALL:
+            return BATCH_EXIT_INSTALL;
+        case INSTALL_ERROR_CONFIG:
+            return BATCH_EXIT_CONFIG;
+        default:
+            return BATCH_EXIT_DOWNLOAD;
+    }
+}
+
+static void
+viewer_installer_batch_print (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
+
+static void
+viewer_installer_batch_print (const gchar *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    g_vprintf (format, args);
+    va_end (args);
+
+    /* Whoever reads the pipe wants each line as it happens */
+    fflush (stdout);
+}
+
+static void
+viewer_installer_batch_finish (ViewerInstallerBatch *batch,
+                               BatchExit exit_code)
+{
+    batch->exit_code = exit_code;
+    batch->done = TRUE;
+    g_main_loop_quit (batch->loop);
+}
+
+static void
+viewer_installer_batch_notify_status (GObject *object,
+                                      GParamSpec *pspec,
+                                      gpointer user_data)
+{
+    ViewerInstallerBatch *batch = user_data;
+    guint status;
+
+    g_object_get (object, "status", &status, NULL);
+
+    switch (status)
+    {
+        case STATUS_DOWNLOADING:
+            if (!batch->quiet)
+                viewer_installer_batch_print ("status=downloading\n");
+            break;
+        case STATUS_INSTALLING:
+            if (!batch->quiet)
+                viewer_installer_batch_print ("status=installing\n");
+            break;
+        case STATUS_INSTALLED:
+        {
+            gchar *package = viewer_installer_scheduler_get_package (batch->scheduler);
+
+            if (!check_package (package))
+            {
+                viewer_installer_batch_print ("status=error class=install message=\"%s is not installed\"\n", package);
+                viewer_installer_batch_finish (batch, BATCH_EXIT_INSTALL);
+                break;
+            }
+
+            viewer_installer_batch_print ("status=installed\n");
+            viewer_installer_batch_finish (batch, BATCH_EXIT_OK);
+            break;
+        }
+        case STATUS_CANCEL:
+            viewer_installer_batch_print ("status=cancelled\n");
+            viewer_installer_batch_finish (batch, BATCH_EXIT_CANCELLED);
+            break;
+        case STATUS_ERROR:
+        {
+            InstallError error_class = viewer_installer_scheduler_get_error_class (batch->scheduler);
+            const gchar *error = viewer_installer_scheduler_get_error (batch->scheduler);
+            g_autofree gchar *message = g_strescape (error ? error : "", NULL);
+
+            viewer_installer_batch_print ("status=error class=%s message=\"%s\"\n",
+                                          install_error_to_string (error_class), message);
+            viewer_installer_batch_finish (batch, viewer_installer_batch_exit_code (error_class));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* A package of the manifest is downloaded or in place */
+static void
+viewer_installer_batch_notify_package_status (GObject *object,
+                                              GParamSpec *pspec,
+                                              gpointer user_data)
+{
+    ViewerInstallerWindowViewModel *view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object);
+    guint status;
+
+    g_object_get (object, "status", &status, NULL);
+
+    if (status == STATUS_DOWNLOADED)
+    {
+        viewer_installer_batch_print ("status=downloaded package=%s\n",
+                                      viewer_installer_window_view_model_get_package (view_model));
+        return;
+    }
+
+    if (status != STATUS_INSTALLED)
+        return;
+
+    viewer_installer_batch_print ("status=installed package=%s method=%s time=%" G_GINT64_FORMAT "\n",
+                                  viewer_installer_window_view_model_get_package (view_model),
+                                  viewer_installer_window_view_model_get_install_method (view_model),
+                                  viewer_installer_window_view_model_get_install_time (view_model));
+}
+
+static void
+viewer_installer_batch_notify_progress (GObject *object,
+                                        GParamSpec *pspec,
+                                        gpointer user_data)
+{
+    ViewerInstallerWindowViewModel *view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object);
+    guint progress;
+    gint64 received;
+    gint64 total;
+    gint64 eta;
+    gdouble rate;
+
+    g_object_get (object,
+                  "progress", &progress,
+                  "received-bytes", &received,
+                  "total-bytes", &total,
+                  "bytes-per-second", &rate,
+                  "eta", &eta,
+                  NULL);
+
+    viewer_installer_batch_print ("progress=%u package=%s received=%" G_GINT64_FORMAT " total=%" G_GINT64_FORMAT
+                                  " rate=%.0f eta=%" G_GINT64_FORMAT "\n",
+                                  progress, viewer_installer_window_view_model_get_package (view_model),
+                                  received, total, rate, eta);
+}
+
+/* Once the scheduler has its manifest, with the per package view models */
+static void
+viewer_installer_batch_connect_packages (ViewerInstallerBatch *batch)
+{
+    GPtrArray *view_models = viewer_installer_scheduler_get_view_models (batch->scheduler);
+    guint i;
+
+    for (i = 0; !batch->quiet && i < view_models->len; i++)
+    {
+        ViewerInstallerWindowViewModel *view_model = g_ptr_array_index (view_models, i);
+
+        if (view_model == NULL)
+            continue;
+
+        g_signal_connect (view_model, "notify::status",
+                          G_CALLBACK (viewer_installer_batch_notify_package_status), batch);
+        g_signal_connect (view_model, "notify::progress",
+                          G_CALLBACK (viewer_installer_batch_notify_progress), batch);
+    }
+}
+
+static void
+viewer_installer_batch_notify_manifest (GObject *object,
+                                        GParamSpec *pspec,
+                                        gpointer user_data)
+{
+    viewer_installer_batch_connect_packages (user_data);
+}
+
+static gboolean
+viewer_installer_batch_signal (gpointer user_data)
+{
+    ViewerInstallerBatch *batch = user_data;
+
+    /* Reported through STATUS_CANCEL once the job has stopped */
+    viewer_installer_scheduler_cancel (batch->scheduler);
+
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean
+viewer_installer_batch_requested (int   argc,
+                                  char *argv[])
+{
+    gint i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (g_strcmp0 (argv[i], "--batch") == 0 || g_strcmp0 (argv[i], "--silent") == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+int
+viewer_installer_batch_main (int   argc,
+                             char *argv[])
+{
+    ViewerInstallerBatch batch = { 0, };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    GPtrArray *view_models;
+    guint sigint_id;
+    guint sigterm_id;
+    guint i;
+
+    context = g_option_context_new ("- install the viewer without a window");
+    g_option_context_add_main_entries (context, batch_entries, GETTEXT_PACKAGE);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return BATCH_EXIT_USAGE;
+    }
+
+    batch.quiet = option_quiet;
+
+    /* Nobody is waiting in front of the screen */
+    g_autoptr(GSettings) settings = viewer_installer_settings_new ();
+    if (settings)
+        viewer_installer_transfer_set_limit (viewer_installer_transfer_get_default (),
+                                             (guint64) g_settings_get_uint (settings, "background-rate-limit") * 1024,
+                                             g_settings_get_uint (settings, "background-rate-share") / 100.0);
+
+    batch.loop = g_main_loop_new (NULL, FALSE);
+    batch.scheduler = viewer_installer_scheduler_new ();
+
+    g_signal_connect (batch.scheduler, "notify::status",
+                      G_CALLBACK (viewer_installer_batch_notify_status), &batch);
+
+    /* A fetched manifest comes in later */
+    if (viewer_installer_scheduler_get_manifest (batch.scheduler))
+        viewer_installer_batch_connect_packages (&batch);
+    else
+        g_signal_connect (batch.scheduler, "notify::manifest",
+                          G_CALLBACK (viewer_installer_batch_notify_manifest), &batch);
+
+    sigint_id = g_unix_signal_add (SIGINT, viewer_installer_batch_signal, &batch);
+    sigterm_id = g_unix_signal_add (SIGTERM, viewer_installer_batch_signal, &batch);
+
+    viewer_installer_scheduler_run (batch.scheduler);
+
+    /* The download may have failed before it started */
+    if (!batch.done)
+        g_main_loop_run (batch.loop);
+
+    if (!batch.quiet)
+    {
+        ViewerInstallerSchedulerTiming timing;
+
+        viewer_installer_scheduler_get_timing (batch.scheduler, &timing);
+        viewer_installer_batch_print ("timing wall=%.1f download=%.1f install=%.1f overlap=%.1f\n",
+                                      timing.wall, timing.download, timing.install, timing.overlap);
+    }
+
+    g_source_remove (sigint_id);
+    g_source_remove (sigterm_id);
+
+    view_models = viewer_installer_scheduler_get_view_models (batch.scheduler);
+    for (i = 0; i < view_models->len; i++)
+    {
+        if (g_ptr_array_index (view_models, i))
+            g_signal_handlers_disconnect_by_data (g_ptr_array_index (view_models, i), &batch);
+    }
+    g_signal_handlers_disconnect_by_data (batch.scheduler, &batch);
+    viewer_installer_scheduler_cancel (batch.scheduler);
+    g_object_unref (batch.scheduler);
+    g_main_loop_unref (batch.loop);
+
+    return batch.exit_code;
+}
@@ -0,0 +1,43 @@
+/* viewer-installer-batch.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Exit codes of a batch run */
+typedef enum
+{
+    BATCH_EXIT_OK = 0,
+    BATCH_EXIT_USAGE,
+    BATCH_EXIT_NETWORK,
+    BATCH_EXIT_DOWNLOAD,
+    BATCH_EXIT_INVALID,
+    BATCH_EXIT_INSTALL,
+    BATCH_EXIT_CONFIG,
+    BATCH_EXIT_CANCELLED,
+} BatchExit;
+
+gboolean viewer_installer_batch_requested (int   argc,
+                                           char *argv[]);
+int      viewer_installer_batch_main      (int   argc,
+                                           char *argv[]);
+
+G_END_DECLS
@@ -0,0 +1,129 @@
+/* viewer-installer-cache.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Packages are kept in VIEWER_CACHE_PATH as <sha256>.deb. Entries are
+ * only ever written by VIEWER_SCRIPT running as root, which hashes its
+ * own copy before storing it and prunes the least recently used ones,
+ * so an entry owned by root and writable only by root can be trusted
+ * without reading it again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <glib/gstdio.h>
+
+#include "define.h"
+#include "viewer-installer-cache.h"
+
+static gboolean
+viewer_installer_cache_is_key (const gchar *sha256)
+{
+    const gchar *p;
+
+    if (!sha256 || strlen (sha256) != 64)
+        return FALSE;
+
+    for (p = sha256; *p; p++)
+    {
+        if (!g_ascii_isxdigit (*p))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+gchar *
+viewer_installer_cache_get_path (const gchar *sha256)
+{
+    g_autofree gchar *key = NULL;
+    g_autofree gchar *name = NULL;
+
+    if (!viewer_installer_cache_is_key (sha256))
+        return NULL;
+
+    key = g_ascii_strdown (sha256, -1);
+    name = g_strdup_printf ("%s.deb", key);
+
+    return g_build_filename (VIEWER_CACHE_PATH, name, NULL);
+}
+
+gchar *
+viewer_installer_cache_lookup (const gchar *sha256)
+{
+    GStatBuf st;
+    g_autofree gchar *path = NULL;
+
+    path = viewer_installer_cache_get_path (sha256);
+    if (!path)
+        return NULL;
+
+    if (g_lstat (path, &st) != 0)
+        return NULL;
+
+    if (!S_ISREG (st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        g_warning ("Ignoring untrusted cache entry %s", path);
+        return NULL;
+    }
+
+    return g_steal_pointer (&path);
+}
+
+/* Give the installer its own name for a cache entry without copying the
+ * data. Entries belong to root, so unprivileged hardlinks are refused by
+ * fs.protected_hardlinks; a reflink on a CoW filesystem is the only
+ * link we can make. Returns FALSE when the entry has to be used in place. */
+gboolean
+viewer_installer_cache_checkout (const gchar *entry,
+                                 const gchar *dest)
+{
+    int src_fd, dest_fd;
+    gboolean res = FALSE;
+
+    src_fd = g_open (entry, O_RDONLY, 0);
+    if (src_fd < 0)
+        return FALSE;
+
+    g_unlink (dest);
+    dest_fd = g_open (dest, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (dest_fd < 0)
+    {
+        close (src_fd);
+        return FALSE;
+    }
+
+#ifdef FICLONE
+    res = (ioctl (dest_fd, FICLONE, src_fd) == 0);
+#endif
+
+    close (dest_fd);
+    close (src_fd);
+
+    if (!res)
+    {
+        g_unlink (dest);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,711 @@
+/* viewer-installer-deb.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks a .deb while it downloads.
+ *
+ * The archive is an ar(1) file holding debian-binary, control.tar.* and
+ * data.tar.*, in that order. The parser is fed the file from its first
+ * byte as it arrives and fails as soon as it stops looking like one, or
+ * when its control file names another package or version than expected.
+ * It is done once the data.tar header is in, a few kilobytes into the
+ * file; the payload after it is left to the checksum.
+ *
+ * A gzip or xz control.tar is unpacked on the fly to read the control
+ * file. Other compressions are only checked for their structure.
+ */
+
+#include <string.h>
+#include <lzma.h>
+
+#include "viewer-installer-deb.h"
+#include "viewer-installer-dpkg.h"
+
+#define AR_MAGIC        "!<arch>\n"
+#define AR_MAGIC_SIZE   8
+#define AR_HEADER_SIZE  60
+
+#define TAR_BLOCK_SIZE  512
+
+/* Far more than any control file, bounds what a bogus header can make us keep */
+#define CONTROL_MAX_SIZE (256 * 1024)
+
+#define INFLATE_BUFFER_SIZE (16 * 1024)
+
+typedef enum
+{
+    DEB_MAGIC,
+    DEB_HEADER,
+    DEB_MEMBER,
+    DEB_DONE,
+} DebState;
+
+typedef enum
+{
+    MEMBER_VERSION,     /* debian-binary */
+    MEMBER_CONTROL,
+    MEMBER_SKIP,        /* "_" extensions, which dpkg ignores */
+} DebMember;
+
+typedef enum
+{
+    INFLATE_NONE,
+    INFLATE_GZIP,
+    INFLATE_XZ,
+    INFLATE_UNKNOWN,    /* structure only */
+} DebInflate;
+
+struct _ViewerInstallerDeb
+{
+    gchar       *package;
+    gchar       *version;
+    goffset      size;
+
+    DebState     state;
+    goffset      offset;        /* archive bytes seen */
+    GByteArray  *header;        /* magic or member header being collected */
+    guint        n_members;     /* required ones seen */
+    DebMember    member;
+    goffset      member_left;
+    goffset      member_pad;
+    GString     *format;        /* contents of debian-binary */
+
+    /* control.tar */
+    DebInflate   inflate;
+    GConverter  *zlib;
+    lzma_stream  lzma;
+    gboolean     lzma_active;
+    gboolean     inflated;      /* the compressed stream ended */
+    GByteArray  *tar_block;
+    goffset      tar_left;      /* of the current entry, padded */
+    gboolean     tar_end;
+    goffset      control_left;
+    GString     *control;
+    gboolean     control_done;
+
+    GHashTable  *fields;
+    GError      *error;
+};
+
+static gboolean
+deb_fail (GError **error,
+          const gchar *format,
+          ...) G_GNUC_PRINTF (2, 3);
+
+static gboolean
+deb_fail (GError **error,
+          const gchar *format,
+          ...)
+{
+    g_autofree gchar *message = NULL;
+    va_list args;
+
+    va_start (args, format);
+    message = g_strdup_vprintf (format, args);
+    va_end (args);
+
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "not a valid package: %s", message);
+    return FALSE;
+}
+
+/* deb822 fields of the control file, continuation lines folded in */
+static void
+deb_parse_control (ViewerInstallerDeb *deb)
+{
+    g_auto(GStrv) lines = NULL;
+    const gchar *last = NULL;
+    guint i;
+
+    lines = g_strsplit (deb->control->str, "\n", -1);
+    for (i = 0; lines[i] && lines[i][0]; i++)
+    {
+        gchar *colon;
+
+        if ((lines[i][0] == ' ' || lines[i][0] == '\t') && last)
+        {
+            const gchar *value = g_hash_table_lookup (deb->fields, last);
+            g_hash_table_insert (deb->fields, g_strdup (last),
+                                 g_strconcat (value, " ", g_strstrip (lines[i]), NULL));
+            continue;
+        }
+
+        colon = strchr (lines[i], ':');
+        if (!colon)
+            continue;
+
+        *colon = '\0';
+        g_hash_table_insert (deb->fields, g_strdup (lines[i]), g_strdup (g_strstrip (colon + 1)));
+        last = lines[i];
+    }
+}
+
+static gboolean
+deb_check_control (ViewerInstallerDeb *deb,
+                   GError **error)
+{
+    const gchar *package;
+    const gchar *version;
+
+    deb_parse_control (deb);
+
+    package = g_hash_table_lookup (deb->fields, "Package");
+    version = g_hash_table_lookup (deb->fields, "Version");
+    if (!package || !version)
+        return deb_fail (error, "control file has no Package or Version");
+
+    if (deb->package && g_strcmp0 (package, deb->package) != 0)
+        return deb_fail (error, "contains %s %s instead of %s", package, version, deb->package);
+
+    if (deb->version && viewer_installer_dpkg_compare_versions (version, deb->version) != 0)
+        return deb_fail (error, "contains %s %s, the manifest lists %s", package, version, deb->version);
+
+    return TRUE;
+}
+
+static gboolean
+deb_tar_header (ViewerInstallerDeb *deb,
+                GError **error)
+{
+    const guchar *block = deb->tar_block->data;
+    gchar field[13];
+    gchar *end;
+    guint64 checksum, sum = 0;
+    guint64 size;
+    const gchar *name;
+    guint i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++);
+    if (i == TAR_BLOCK_SIZE)
+    {
+        deb->tar_end = TRUE;
+        return TRUE;
+    }
+
+    /* The checksum field counts as blanks */
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (148 <= i && i < 156) ? ' ' : block[i];
+
+    memcpy (field, block + 148, 8);
+    field[8] = '\0';
+    checksum = g_ascii_strtoull (field, &end, 8);
+    if (end == field || checksum != sum)
+        return deb_fail (error, "control.tar header checksum mismatch");
+
+    /* Control members are small, base-256 sizes are not expected */
+    memcpy (field, block + 124, 12);
+    field[12] = '\0';
+    size = g_ascii_strtoull (field, &end, 8);
+    if (end == field || (block[124] & 0x80))
+        return deb_fail (error, "control.tar entry size unreadable");
+
+    deb->tar_left = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    name = (const gchar *) block;
+    if (g_str_has_prefix (name, "./"))
+        name += 2;
+
+    if (strncmp (name, "control", 100 - (name - (const gchar *) block)) != 0 ||
+        (block[156] != '0' && block[156] != '\0'))
+        return TRUE;
+
+    if (CONTROL_MAX_SIZE < size)
+        return deb_fail (error, "control file of %" G_GUINT64_FORMAT " bytes", size);
+
+    deb->control_left = size;
+    if (size == 0)
+    {
+        deb->control_done = TRUE;
+        return deb_check_control (deb, error);
+    }
+
+    return TRUE;
+}
+
+/* Walks the unpacked control.tar up to the control file */
+static gboolean
+deb_tar_feed (ViewerInstallerDeb *deb,
+              const guchar *data,
+              gsize len,
+              GError **error)
+{
+    while (len > 0 && !deb->control_done && !deb->tar_end)
+    {
+        gsize n;
+
+        if (deb->tar_left == 0)
+        {
+            n = MIN (len, TAR_BLOCK_SIZE - deb->tar_block->len);
+            g_byte_array_append (deb->tar_block, data, n);
+
+            if (deb->tar_block->len == TAR_BLOCK_SIZE)
+            {
+                if (!deb_tar_header (deb, error))
+                    return FALSE;
+                g_byte_array_set_size (deb->tar_block, 0);
+            }
+        }
+        else
+        {
+            n = MIN (len, (gsize) deb->tar_left);
+            deb->tar_left -= n;
+
+            if (0 < deb->control_left)
+            {
+                gsize m = MIN (n, (gsize) deb->control_left);
+
+                g_string_append_len (deb->control, (const gchar *) data, m);
+                deb->control_left -= m;
+
+                if (deb->control_left == 0)
+                {
+                    deb->control_done = TRUE;
+                    return deb_check_control (deb, error);
+                }
+            }
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+deb_inflate_gzip (ViewerInstallerDeb *deb,
+                  const guchar *data,
+                  gsize len,
+                  gboolean finish,
+                  GError **error)
+{
+    guchar buffer[INFLATE_BUFFER_SIZE];
+
+    while (!deb->control_done && !deb->tar_end && !deb->inflated)
+    {
+        GConverterResult res;
+        gsize read = 0, written = 0;
+        GError *local_error = NULL;
+
+        res = g_converter_convert (deb->zlib, data, len, buffer, sizeof buffer,
+                                   finish ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                                   &read, &written, &local_error);
+        if (res == G_CONVERTER_ERROR)
+        {
+            /* The rest of the stream is in the next chunk */
+            if (!finish && g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+            {
+                g_error_free (local_error);
+                return TRUE;
+            }
+
+            deb_fail (error, "control.tar.gz: %s", local_error->message);
+            g_error_free (local_error);
+            return FALSE;
+        }
+
+        data += read;
+        len -= read;
+
+        if (!deb_tar_feed (deb, buffer, written, error))
+            return FALSE;
+
+        if (res == G_CONVERTER_FINISHED)
+            deb->inflated = TRUE;
+        else if (len == 0 && written < sizeof buffer && !finish)
+            break;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+deb_inflate_xz (ViewerInstallerDeb *deb,
+                const guchar *data,
+                gsize len,
+                gboolean finish,
+                GError **error)
+{
+    guchar buffer[INFLATE_BUFFER_SIZE];
+
+    deb->lzma.next_in = data;
+    deb->lzma.avail_in = len;
+
+    while (!deb->control_done && !deb->tar_end && !deb->inflated)
+    {
+        lzma_ret res;
+
+        deb->lzma.next_out = buffer;
+        deb->lzma.avail_out = sizeof buffer;
+
+        res = lzma_code (&deb->lzma, finish ? LZMA_FINISH : LZMA_RUN);
+        if (res == LZMA_BUF_ERROR && finish)
+            return deb_fail (error, "control.tar.xz is truncated");
+        if (res != LZMA_OK && res != LZMA_STREAM_END && res != LZMA_BUF_ERROR)
+            return deb_fail (error, "control.tar.xz is damaged (%d)", res);
+
+        if (!deb_tar_feed (deb, buffer, sizeof buffer - deb->lzma.avail_out, error))
+            return FALSE;
+
+        if (res == LZMA_STREAM_END)
+            deb->inflated = TRUE;
+        else if (res == LZMA_BUF_ERROR || (deb->lzma.avail_in == 0 && deb->lzma.avail_out != 0 && !finish))
+            break;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+deb_inflate (ViewerInstallerDeb *deb,
+             const guchar *data,
+             gsize len,
+             gboolean finish,
+             GError **error)
+{
+    switch (deb->inflate)
+    {
+        case INFLATE_NONE:
+            return deb_tar_feed (deb, data, len, error);
+        case INFLATE_GZIP:
+            return deb_inflate_gzip (deb, data, len, finish, error);
+        case INFLATE_XZ:
+            return deb_inflate_xz (deb, data, len, finish, error);
+        default:
+            return TRUE;
+    }
+}
+
+static gboolean
+deb_has_suffix (const gchar *name,
+                const gchar *base,
+                const gchar * const *suffixes)
+{
+    guint i;
+
+    if (!g_str_has_prefix (name, base))
+        return FALSE;
+
+    for (i = 0; suffixes[i]; i++)
+    {
+        if (g_strcmp0 (name + strlen (base), suffixes[i]) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+deb_begin_control (ViewerInstallerDeb *deb,
+                   const gchar *name,
+                   GError **error)
+{
+    static const gchar *suffixes[] = { "", ".gz", ".xz", ".zst", NULL };
+
+    if (!deb_has_suffix (name, "control.tar", suffixes))
+        return deb_fail (error, "%s where control.tar was expected", name);
+
+    deb->member = MEMBER_CONTROL;
+
+    if (g_str_has_suffix (name, ".gz"))
+    {
+        deb->inflate = INFLATE_GZIP;
+        deb->zlib = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+    }
+    else if (g_str_has_suffix (name, ".xz"))
+    {
+        lzma_stream init = LZMA_STREAM_INIT;
+
+        deb->inflate = INFLATE_XZ;
+        deb->lzma = init;
+        if (lzma_stream_decoder (&deb->lzma, UINT64_MAX, 0) != LZMA_OK)
+            return deb_fail (error, "no xz decoder");
+        deb->lzma_active = TRUE;
+    }
+    else if (g_str_has_suffix (name, ".zst"))
+    {
+        deb->inflate = INFLATE_UNKNOWN;
+    }
+    else
+    {
+        deb->inflate = INFLATE_NONE;
+    }
+
+    return TRUE;
+}
+
+/* The archive must end with data.tar, at the size the server gave */
+static gboolean
+deb_begin_data (ViewerInstallerDeb *deb,
+                const gchar *name,
+                goffset size,
+                GError **error)
+{
+    static const gchar *suffixes[] = { "", ".gz", ".xz", ".bz2", ".lzma", ".zst", NULL };
+    goffset end = deb->offset + size;
+
+    if (!deb_has_suffix (name, "data.tar", suffixes))
+        return deb_fail (error, "%s where data.tar was expected", name);
+
+    if (0 < deb->size && end != deb->size && end + (size & 1) != deb->size)
+        return deb_fail (error, "archive ends at %" G_GINT64_FORMAT " of %" G_GINT64_FORMAT " bytes",
+                         end, deb->size);
+
+    deb->state = DEB_DONE;
+    return TRUE;
+}
+
+static gboolean
+deb_begin_member (ViewerInstallerDeb *deb,
+                  GError **error)
+{
+    const gchar *header = (const gchar *) deb->header->data;
+    gchar name[17];
+    gchar field[11];
+    guint64 size;
+    gsize len;
+
+    if (memcmp (header + 58, "`\n", 2) != 0)
+        return deb_fail (error, "bad ar member header at %" G_GINT64_FORMAT,
+                         deb->offset - AR_HEADER_SIZE);
+
+    /* Space padded, GNU ar ends it with a slash */
+    memcpy (name, header, 16);
+    name[16] = '\0';
+    g_strchomp (name);
+    len = strlen (name);
+    if (len && name[len - 1] == '/')
+        name[len - 1] = '\0';
+
+    memcpy (field, header + 48, 10);
+    field[10] = '\0';
+    if (!g_ascii_string_to_unsigned (g_strstrip (field), 10, 0, G_MAXINT64, &size, NULL))
+        return deb_fail (error, "bad size of ar member %s", name);
+
+    deb->member_left = size;
+    deb->member_pad = size & 1;
+    deb->state = DEB_MEMBER;
+
+    if (deb->n_members == 0)
+    {
+        if (g_strcmp0 (name, "debian-binary") != 0)
+            return deb_fail (error, "starts with %s instead of debian-binary", name);
+        deb->member = MEMBER_VERSION;
+        return TRUE;
+    }
+
+    if (name[0] == '_')
+    {
+        deb->member = MEMBER_SKIP;
+        return TRUE;
+    }
+
+    if (deb->n_members == 1)
+        return deb_begin_control (deb, name, error);
+
+    return deb_begin_data (deb, name, size, error);
+}
+
+static gboolean
+deb_member_data (ViewerInstallerDeb *deb,
+                 const guchar *data,
+                 gsize len,
+                 GError **error)
+{
+    switch (deb->member)
+    {
+        case MEMBER_VERSION:
+            if (deb->format->len < 16)
+                g_string_append_len (deb->format, (const gchar *) data, MIN (len, 16));
+            return TRUE;
+        case MEMBER_CONTROL:
+            return deb_inflate (deb, data, len, FALSE, error);
+        default:
+            return TRUE;
+    }
+}
+
+static gboolean
+deb_end_member (ViewerInstallerDeb *deb,
+                GError **error)
+{
+    deb->state = DEB_HEADER;
+
+    switch (deb->member)
+    {
+        case MEMBER_VERSION:
+            if (!g_str_has_prefix (deb->format->str, "2."))
+                return deb_fail (error, "format %s is not 2.x", g_strchomp (deb->format->str));
+            break;
+        case MEMBER_CONTROL:
+            if (!deb_inflate (deb, NULL, 0, TRUE, error))
+                return FALSE;
+            if (deb->inflate != INFLATE_UNKNOWN && !deb->control_done)
+                return deb_fail (error, "control.tar has no control file");
+            break;
+        default:
+            return TRUE;
+    }
+
+    deb->n_members++;
+    return TRUE;
+}
+
+static gboolean
+deb_feed (ViewerInstallerDeb *deb,
+          const guchar *data,
+          gsize len,
+          GError **error)
+{
+    while (len > 0 && deb->state != DEB_DONE)
+    {
+        gsize n = 0;
+
+        if (deb->state == DEB_MAGIC || deb->state == DEB_HEADER)
+        {
+            guint need = deb->state == DEB_MAGIC ? AR_MAGIC_SIZE : AR_HEADER_SIZE;
+
+            n = MIN (len, need - deb->header->len);
+            g_byte_array_append (deb->header, data, n);
+            deb->offset += n;
+
+            if (deb->header->len == need)
+            {
+                if (deb->state == DEB_MAGIC)
+                {
+                    if (memcmp (deb->header->data, AR_MAGIC, AR_MAGIC_SIZE) != 0)
+                        return deb_fail (error, "not an ar archive");
+                    deb->state = DEB_HEADER;
+                }
+                else if (!deb_begin_member (deb, error))
+                {
+                    return FALSE;
+                }
+                g_byte_array_set_size (deb->header, 0);
+            }
+        }
+        else if (0 < deb->member_left)
+        {
+            n = MIN (len, (gsize) deb->member_left);
+            deb->offset += n;
+            deb->member_left -= n;
+
+            if (!deb_member_data (deb, data, n, error))
+                return FALSE;
+        }
+        else
+        {
+            n = MIN (len, (gsize) deb->member_pad);
+            deb->offset += n;
+            deb->member_pad -= n;
+        }
+
+        if (deb->state == DEB_MEMBER && deb->member_left == 0 && deb->member_pad == 0 &&
+            !deb_end_member (deb, error))
+            return FALSE;
+
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+/* Feeds the next @len bytes of the archive. Once it failed, it keeps
+ * failing the same way */
+gboolean
+viewer_installer_deb_feed (ViewerInstallerDeb *deb,
+                           const void *data,
+                           gsize len,
+                           GError **error)
+{
+    g_return_val_if_fail (deb != NULL, FALSE);
+
+    if (!deb->error)
+        deb_feed (deb, data, len, &deb->error);
+
+    if (deb->error)
+    {
+        g_propagate_error (error, g_error_copy (deb->error));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Whether everything up to the payload was there and valid */
+gboolean
+viewer_installer_deb_is_done (ViewerInstallerDeb *deb)
+{
+    g_return_val_if_fail (deb != NULL, FALSE);
+
+    return deb->state == DEB_DONE;
+}
+
+/* A field of the control file, once it has been read */
+const gchar *
+viewer_installer_deb_get_field (ViewerInstallerDeb *deb,
+                                const gchar *field)
+{
+    g_return_val_if_fail (deb != NULL, NULL);
+
+    return g_hash_table_lookup (deb->fields, field);
+}
+
+/* Expects @package, and @version when given, in an archive of @size bytes
+ * or of any size when it is negative */
+ViewerInstallerDeb *
+viewer_installer_deb_new (const gchar *package,
+                          const gchar *version,
+                          goffset size)
+{
+    ViewerInstallerDeb *deb;
+
+    deb = g_new0 (ViewerInstallerDeb, 1);
+    deb->package = g_strdup (package);
+    deb->version = g_strdup (version);
+    deb->size = size;
+    deb->state = DEB_MAGIC;
+    deb->header = g_byte_array_sized_new (AR_HEADER_SIZE);
+    deb->format = g_string_new (NULL);
+    deb->tar_block = g_byte_array_sized_new (TAR_BLOCK_SIZE);
+    deb->control = g_string_new (NULL);
+    deb->fields = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    return deb;
+}
+
+void
+viewer_installer_deb_free (ViewerInstallerDeb *deb)
+{
+    if (!deb)
+        return;
+
+    if (deb->lzma_active)
+        lzma_end (&deb->lzma);
+
+    g_clear_object (&deb->zlib);
+    g_byte_array_unref (deb->header);
+    g_byte_array_unref (deb->tar_block);
+    g_string_free (deb->format, TRUE);
+    g_string_free (deb->control, TRUE);
+    g_hash_table_unref (deb->fields);
+    g_clear_error (&deb->error);
+    g_free (deb->package);
+    g_free (deb->version);
+    g_free (deb);
+}
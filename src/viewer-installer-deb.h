@@ -0,0 +1,40 @@
+/* viewer-installer-deb.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ViewerInstallerDeb ViewerInstallerDeb;
+
+ViewerInstallerDeb *viewer_installer_deb_new       (const gchar        *package,
+                                                    const gchar        *version,
+                                                    goffset             size);
+void                viewer_installer_deb_free      (ViewerInstallerDeb *deb);
+
+gboolean            viewer_installer_deb_feed      (ViewerInstallerDeb *deb,
+                                                    const void         *data,
+                                                    gsize               len,
+                                                    GError            **error);
+gboolean            viewer_installer_deb_is_done   (ViewerInstallerDeb *deb);
+const gchar        *viewer_installer_deb_get_field (ViewerInstallerDeb *deb,
+                                                    const gchar        *field);
+
+G_END_DECLS
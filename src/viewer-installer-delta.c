@@ -0,0 +1,185 @@
+/* viewer-installer-delta.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Delta updates.
+ *
+ * Two kinds of patch rebuild the new .deb:
+ *
+ *  - "xdelta3", a VCDIFF against the old .deb, which has to be in the
+ *    package cache under its "source-SHA256";
+ *  - "debdelta", applied by debpatch to the files of the installed
+ *    package, which has to be at the "from" version.
+ *
+ * The rebuilt file is checked against the package's SHA-256 and thrown
+ * away on any mismatch, the caller then downloads the full package.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "viewer-installer-cache.h"
+#include "viewer-installer-delta.h"
+#include "viewer-installer-dpkg.h"
+
+#define DELTA_BUFFER_SIZE (64 * 1024)
+
+static gboolean
+viewer_installer_delta_has_program (const gchar *program)
+{
+    g_autofree gchar *path = g_find_program_in_path (program);
+
+    return path != NULL;
+}
+
+/* Returns the first delta that applies on this host, with @source set to
+ * what it is applied to */
+const ViewerInstallerDelta *
+viewer_installer_delta_find (const ViewerInstallerPackage *package,
+                             gchar **source)
+{
+    g_autofree gchar *installed = NULL;
+    guint i;
+
+    if (package->deltas == NULL || package->deltas->len == 0)
+        return NULL;
+
+    installed = viewer_installer_dpkg_get_version (package->name);
+
+    for (i = 0; i < package->deltas->len; i++)
+    {
+        const ViewerInstallerDelta *delta = g_ptr_array_index (package->deltas, i);
+
+        if (g_strcmp0 (delta->format, "xdelta3") == 0)
+        {
+            gchar *entry;
+
+            if (!viewer_installer_delta_has_program ("xdelta3"))
+                continue;
+
+            entry = viewer_installer_cache_lookup (delta->source_sha256);
+            if (entry)
+            {
+                *source = entry;
+                return delta;
+            }
+        }
+        else if (g_strcmp0 (delta->format, "debdelta") == 0)
+        {
+            if (!installed || viewer_installer_dpkg_compare_versions (installed, delta->from) != 0)
+                continue;
+
+            if (!viewer_installer_delta_has_program ("debpatch"))
+                continue;
+
+            *source = g_strdup ("/");
+            return delta;
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean
+viewer_installer_delta_verify (const gchar *out_file,
+                               const gchar *sha256,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+    g_autoptr(GChecksum) checksum = NULL;
+    g_autofree guchar *buffer = NULL;
+    FILE *fp;
+    size_t n;
+
+    fp = g_fopen (out_file, "rb");
+    if (!fp)
+    {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "%s: %s", out_file, g_strerror (errno));
+        return FALSE;
+    }
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    buffer = g_malloc (DELTA_BUFFER_SIZE);
+
+    while ((n = fread (buffer, 1, DELTA_BUFFER_SIZE, fp)) > 0)
+    {
+        if (g_cancellable_is_cancelled (cancellable))
+            break;
+        g_checksum_update (checksum, buffer, n);
+    }
+    fclose (fp);
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+    if (g_ascii_strcasecmp (g_checksum_get_string (checksum), sha256) != 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "%s: rebuilt package does not match its checksum", out_file);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Blocking, run it on a worker */
+gboolean
+viewer_installer_delta_apply (const gchar *format,
+                              const gchar *source,
+                              const gchar *patch,
+                              const gchar *out_file,
+                              const gchar *sha256,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+    const gchar *xdelta_argv[] = { "xdelta3", "-d", "-f", "-s", source, patch, out_file, NULL };
+    const gchar *debpatch_argv[] = { "debpatch", patch, source, out_file, NULL };
+    const gchar * const *argv;
+    g_autofree gchar *output = NULL;
+    gint exit_status;
+
+    if (g_strcmp0 (format, "xdelta3") == 0)
+        argv = xdelta_argv;
+    else
+        argv = debpatch_argv;
+
+    g_unlink (out_file);
+
+    if (!g_spawn_sync (NULL, (gchar **) argv, NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                       NULL, NULL, NULL, &output, &exit_status, error))
+        return FALSE;
+
+    if (!g_spawn_check_exit_status (exit_status, NULL))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "%s failed: %s", argv[0], output ? g_strstrip (output) : "");
+        g_unlink (out_file);
+        return FALSE;
+    }
+
+    if (!viewer_installer_delta_verify (out_file, sha256, cancellable, error))
+    {
+        g_unlink (out_file);
+        return FALSE;
+    }
+
+    return TRUE;
+}
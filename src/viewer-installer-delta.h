@@ -0,0 +1,37 @@
+/* viewer-installer-delta.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "viewer-installer-manifest.h"
+
+G_BEGIN_DECLS
+
+const ViewerInstallerDelta *viewer_installer_delta_find  (const ViewerInstallerPackage *package,
+                                                          gchar                       **source);
+gboolean                    viewer_installer_delta_apply (const gchar                  *format,
+                                                          const gchar                  *source,
+                                                          const gchar                  *patch,
+                                                          const gchar                  *out_file,
+                                                          const gchar                  *sha256,
+                                                          GCancellable                 *cancellable,
+                                                          GError                      **error);
+
+G_END_DECLS
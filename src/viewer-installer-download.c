@@ -0,0 +1,1598 @@
+/* viewer-installer-download.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+
+#include "define.h"
+#include "viewer-installer-config.h"
+#include "viewer-installer-deb.h"
+#include "viewer-installer-download.h"
+#include "viewer-installer-transfer.h"
+
+/* Ranges smaller than this are not worth an extra connection */
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+
+/* How much may be written before the resume state is saved again */
+#define STATE_SAVE_INTERVAL (4 * 1024 * 1024)
+
+#define STATE_GROUP "download"
+
+#define HASH_BUFFER_SIZE (64 * 1024)
+
+/* Times the blocks that failed their hash are asked for again */
+#define BLOCK_ROUNDS 3
+
+typedef struct
+{
+    CURL                    *curl;
+    struct curl_slist       *headers;
+    ViewerInstallerDownload *download;
+
+    gboolean  ranged;
+    goffset   start;
+    goffset   end;       /* inclusive */
+    goffset   offset;    /* next byte to write */
+    gboolean  active;    /* running in the transfer engine */
+    guint     stream;    /* of the storage */
+
+    GChecksum *block_checksum;  /* of the block at offset, in block mode */
+    gboolean   block_tainted;   /* that block failed the package check */
+} DownloadSegment;
+
+/* Blocks first to last, inclusive */
+typedef struct
+{
+    guint first;
+    guint last;
+} BlockRun;
+
+typedef struct
+{
+    ViewerInstallerDownload *download;
+    GCancellable            *cancellable;
+    int                      fd;
+} BlockScan;
+
+struct _ViewerInstallerDownload
+{
+    gchar     *uri;
+    gchar     *out_file;
+    gchar     *part_file;
+    gchar     *state_file;
+    gchar     *md5;
+    gchar     *etag;
+    gchar     *last_modified;
+    gchar     *sha256;
+    gchar     *package;
+    gchar     *version;
+
+    guint     connections;
+    goffset   size;
+    gboolean  accept_ranges;
+
+    int       fd;
+    ViewerInstallerStorage     *storage;
+    ViewerInstallerStorageSync  sync;
+    GError   *write_error;
+    GError   *attempt_error;  /* while the part of a failed attempt is kept */
+    goffset   written;
+    goffset   saved;
+    gboolean  resumed;
+    gboolean  range_ignored;
+    gboolean  corrupted;
+
+    CURL      *handle;    /* handed over by the caller for the first segment */
+
+    GChecksum *checksum;
+    goffset   hashed;     /* the file is hashed up to here */
+    goffset   catch_up;   /* a worker hashes the file up to here, or 0 */
+    gboolean  transfer_pending;  /* all segments ended while it did */
+
+    /* Parses the stream from the first byte, see viewer-installer-deb.c */
+    ViewerInstallerDeb *deb;
+
+    /* Block mode: only blocks not known to match their hash are fetched */
+    goffset    block_size;
+    GPtrArray *blocks;        /* hex SHA-256 per block */
+    guint8    *block_good;    /* per block, NULL outside block mode */
+    guint      block_round;
+    gboolean   partial;       /* good blocks are kept, only the others are fetched */
+
+    GPtrArray *segments;
+
+    /* The run in progress */
+    GTask     *task;
+    guint     count;
+    guint     stage;
+    guint     pending;
+    CURLcode  result;
+
+    ViewerInstallerDownloadProgressFunc progress_func;
+    gpointer                            progress_data;
+};
+
+static void viewer_installer_download_save_state (ViewerInstallerDownload *download);
+static void viewer_installer_download_transferred (ViewerInstallerDownload *download);
+
+static void
+download_segment_free (DownloadSegment *segment)
+{
+    if (segment->curl)
+        curl_easy_cleanup (segment->curl);
+
+    if (segment->headers)
+        curl_slist_free_all (segment->headers);
+
+    if (segment->block_checksum)
+        g_checksum_free (segment->block_checksum);
+
+    g_free (segment);
+}
+
+static gboolean
+download_segment_is_done (DownloadSegment *segment)
+{
+    return segment->ranged && segment->end < segment->offset;
+}
+
+/* Hash what is already in the file between the hash cursor and @end.
+ * Only needed for data that arrived ahead of the cursor, i.e. later
+ * range segments or the part kept from an interrupted download. The
+ * caller makes sure the write-behind is past @end */
+static gboolean
+viewer_installer_download_hash_file (ViewerInstallerDownload *download,
+                                     goffset end)
+{
+    g_autofree guchar *buffer = NULL;
+
+    if (download->hashed >= end)
+        return TRUE;
+
+    buffer = g_malloc (HASH_BUFFER_SIZE);
+
+    while (download->hashed < end)
+    {
+        ssize_t n;
+        n = pread (download->fd, buffer, MIN (HASH_BUFFER_SIZE, end - download->hashed), download->hashed);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+
+        g_checksum_update (download->checksum, buffer, n);
+        download->hashed += n;
+    }
+
+    return TRUE;
+}
+
+/* Owns the checksum and the file while it runs; the main loop leaves
+ * both alone until it is done */
+static void
+viewer_installer_download_catch_up_thread (GTask *task,
+                                           gpointer source_object,
+                                           gpointer task_data,
+                                           GCancellable *cancellable)
+{
+    ViewerInstallerDownload *download = task_data;
+
+    g_task_return_boolean (task, viewer_installer_download_hash_file (download, download->catch_up));
+}
+
+static void
+viewer_installer_download_catch_up_done (GObject *source,
+                                         GAsyncResult *result,
+                                         gpointer user_data)
+{
+    ViewerInstallerDownload *download = user_data;
+
+    /* A read error is left for verify to report */
+    g_task_propagate_boolean (G_TASK (result), NULL);
+    download->catch_up = 0;
+
+    if (download->transfer_pending)
+    {
+        download->transfer_pending = FALSE;
+        viewer_installer_download_transferred (download);
+    }
+}
+
+/* Feed a chunk written at @offset to the checksum. Chunks that continue
+ * right at the cursor are hashed from memory as they stream by. When the
+ * cursor reaches data that is already in the file, a worker reads it
+ * back while the transfer goes on, as far as the write-behind got; it is
+ * still in the page cache then */
+static void
+viewer_installer_download_hash (DownloadSegment *segment,
+                                const char *ptr,
+                                size_t len,
+                                goffset offset)
+{
+    ViewerInstallerDownload *download = segment->download;
+    goffset written;
+    GTask *task;
+
+    /* A partial fetch is hashed whole at verify, once after the last round */
+    if (!download->checksum || download->partial || download->catch_up)
+        return;
+
+    if (download->hashed == offset)
+    {
+        g_checksum_update (download->checksum, (const guchar *) ptr, len);
+        download->hashed += len;
+        return;
+    }
+
+    if (offset < download->hashed || download->hashed < segment->start)
+        return;
+
+    written = viewer_installer_storage_get_written (download->storage, segment->stream);
+    if (written <= download->hashed)
+        return;
+
+    download->catch_up = MIN (offset, written);
+
+    task = g_task_new (NULL, NULL, viewer_installer_download_catch_up_done, download);
+    g_task_set_task_data (task, download, NULL);
+    g_task_run_in_thread (task, viewer_installer_download_catch_up_thread);
+    g_object_unref (task);
+}
+
+static goffset
+viewer_installer_download_block_length (ViewerInstallerDownload *download,
+                                        guint index)
+{
+    return MIN (download->block_size, download->size - (goffset) index * download->block_size);
+}
+
+static gboolean
+viewer_installer_download_block_matches (ViewerInstallerDownload *download,
+                                         guint index,
+                                         const gchar *sha256)
+{
+    return g_ascii_strcasecmp (sha256, g_ptr_array_index (download->blocks, index)) == 0;
+}
+
+/* Checks each block as its last byte streams by. Segments start on a
+ * block boundary in block mode, so every block is seen whole. A @tainted
+ * chunk fails every block it touches, whatever their hashes say */
+static void
+viewer_installer_download_hash_blocks (DownloadSegment *segment,
+                                       const char *ptr,
+                                       size_t len,
+                                       goffset offset,
+                                       gboolean tainted)
+{
+    ViewerInstallerDownload *download = segment->download;
+
+    if (!segment->block_checksum)
+        segment->block_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+    if (tainted)
+        segment->block_tainted = TRUE;
+
+    while (len > 0)
+    {
+        guint index = offset / download->block_size;
+        goffset end = (goffset) index * download->block_size + viewer_installer_download_block_length (download, index);
+        size_t n = MIN ((goffset) len, end - offset);
+
+        g_checksum_update (segment->block_checksum, (const guchar *) ptr, n);
+
+        if (offset + (goffset) n == end)
+        {
+            download->block_good[index] = !segment->block_tainted &&
+                                          viewer_installer_download_block_matches (download, index,
+                                                                                   g_checksum_get_string (segment->block_checksum));
+            if (!download->block_good[index])
+                g_debug ("Block %u of %s does not match", index, download->uri);
+
+            g_checksum_reset (segment->block_checksum);
+            segment->block_tainted = FALSE;
+        }
+
+        ptr += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+static size_t
+viewer_installer_download_write (char *ptr, size_t size, size_t nmemb, void *user_data)
+{
+    DownloadSegment *segment = user_data;
+    ViewerInstallerDownload *download = segment->download;
+    size_t len = size * nmemb;
+    goffset offset = segment->offset;
+    gboolean tainted = FALSE;
+    GError *error = NULL;
+
+    if (segment->ranged)
+    {
+        long code = 0;
+
+        /* A server that ignores Range, or whose file no longer matches
+         * If-Range, sends the whole file with 200. That would overwrite
+         * the other segments */
+        curl_easy_getinfo (segment->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code != 206)
+        {
+            download->range_ignored = TRUE;
+            return 0;
+        }
+
+        if (segment->offset + (goffset) len > segment->end + 1)
+            return 0;
+    }
+
+    /* A wrong or damaged file is given up on before it is on disk. In
+     * block mode only the blocks it was seen in are fetched again, the
+     * good ones already on disk are kept */
+    if (download->deb && segment->start == 0 &&
+        !viewer_installer_deb_feed (download->deb, ptr, len, &error))
+    {
+        g_prefix_error (&error, "%s: ", download->uri);
+
+        if (download->block_good)
+        {
+            g_debug ("%s", error->message);
+            g_clear_error (&error);
+            g_clear_pointer (&download->deb, viewer_installer_deb_free);
+            tainted = TRUE;
+        }
+        else
+        {
+            if (!download->write_error)
+                download->write_error = error;
+            else
+                g_error_free (error);
+
+            /* Nothing of this file is worth resuming */
+            download->corrupted = TRUE;
+            viewer_installer_download_discard (download);
+            return 0;
+        }
+    }
+
+    /* Never waits for the disk unless it is far behind */
+    if (!viewer_installer_storage_write (download->storage, segment->stream, offset, ptr, len, &error))
+    {
+        g_prefix_error (&error, "%s: ", download->part_file);
+        if (!download->write_error)
+            download->write_error = error;
+        else
+            g_error_free (error);
+        return 0;
+    }
+    segment->offset += len;
+
+    if (download->block_good)
+        viewer_installer_download_hash_blocks (segment, ptr, len, offset, tainted);
+
+    viewer_installer_download_hash (segment, ptr, len, offset);
+
+    download->written += len;
+
+    if (STATE_SAVE_INTERVAL <= download->written - download->saved)
+        viewer_installer_download_save_state (download);
+
+    if (download->progress_func)
+        download->progress_func (download->written, download->size, download->progress_data);
+
+    return len;
+}
+
+static DownloadSegment *
+viewer_installer_download_segment_new (ViewerInstallerDownload *download,
+                                       gboolean ranged,
+                                       goffset start,
+                                       goffset offset,
+                                       goffset end)
+{
+    DownloadSegment *segment;
+
+    segment = g_new0 (DownloadSegment, 1);
+    segment->download = download;
+    segment->ranged = ranged;
+    segment->start = start;
+    segment->end = end;
+    segment->offset = offset;
+
+    /* A handle that already talked to the server keeps its connection
+     * and TLS session; reset drops only the options */
+    if (download->handle)
+    {
+        segment->curl = g_steal_pointer (&download->handle);
+        curl_easy_reset (segment->curl);
+    }
+    else
+    {
+        segment->curl = curl_easy_init ();
+    }
+
+    if (!segment->curl)
+    {
+        g_free (segment);
+        return NULL;
+    }
+
+    curl_easy_setopt (segment->curl, CURLOPT_URL, download->uri);
+    curl_easy_setopt (segment->curl, CURLOPT_USERNAME, "HancomGooroom");
+    curl_easy_setopt (segment->curl, CURLOPT_REFERER, VIEWER_REFERER);
+    curl_easy_setopt (segment->curl, CURLOPT_FAILONERROR, 1L);
+
+    if (download->md5)
+        curl_easy_setopt (segment->curl, CURLOPT_SSH_HOST_PUBLIC_KEY_MD5, download->md5);
+
+    if (ranged)
+    {
+        g_autofree gchar *range = NULL;
+        range = g_strdup_printf ("%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT, offset, end);
+        curl_easy_setopt (segment->curl, CURLOPT_RANGE, range);
+
+        /* Only continue a partial file when the server still has the
+         * same one, otherwise it answers 200 and we start over */
+        if (download->resumed)
+        {
+            const gchar *validator = download->etag;
+            g_autofree gchar *if_range = NULL;
+
+            /* If-Range only accepts strong entity tags */
+            if (!validator || (g_str_has_prefix (validator, "W/") && download->last_modified))
+                validator = download->last_modified;
+
+            if_range = g_strdup_printf ("If-Range: %s", validator);
+            segment->headers = curl_slist_append (NULL, if_range);
+            curl_easy_setopt (segment->curl, CURLOPT_HTTPHEADER, segment->headers);
+        }
+    }
+
+    curl_easy_setopt (segment->curl, CURLOPT_WRITEFUNCTION, viewer_installer_download_write);
+    curl_easy_setopt (segment->curl, CURLOPT_WRITEDATA, segment);
+
+    return segment;
+}
+
+static guint
+viewer_installer_download_count_segments (ViewerInstallerDownload *download)
+{
+    guint count;
+
+    if (!download->accept_ranges || download->size <= 0)
+        return 1;
+
+    count = MAX (1, download->size / MIN_SEGMENT_SIZE);
+    return MIN (count, download->connections);
+}
+
+static gboolean
+viewer_installer_download_can_resume (ViewerInstallerDownload *download)
+{
+    return (0 < download->size && download->accept_ranges &&
+            (download->etag || download->last_modified));
+}
+
+static void
+viewer_installer_download_remove_state (ViewerInstallerDownload *download)
+{
+    g_unlink (download->state_file);
+}
+
+static void
+viewer_installer_download_save_state (ViewerInstallerDownload *download)
+{
+    guint i;
+    goffset done = 0;
+    g_autofree gchar *data = NULL;
+    g_autoptr(GKeyFile) keyfile = NULL;
+    g_autoptr(GPtrArray) ranges = NULL;
+
+    /* Block mode finds what is good by hashing it instead */
+    if (!download->segments || download->block_good || !viewer_installer_download_can_resume (download))
+        return;
+
+    keyfile = g_key_file_new ();
+    ranges = g_ptr_array_new_with_free_func (g_free);
+
+    g_key_file_set_string (keyfile, STATE_GROUP, "uri", download->uri);
+    g_key_file_set_int64 (keyfile, STATE_GROUP, "size", download->size);
+    if (download->etag)
+        g_key_file_set_string (keyfile, STATE_GROUP, "etag", download->etag);
+    if (download->last_modified)
+        g_key_file_set_string (keyfile, STATE_GROUP, "last-modified", download->last_modified);
+
+    /* Only what is known to be in the file, see the storage */
+    for (i = 0; i < download->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (download->segments, i);
+        goffset offset = segment->offset;
+
+        if (download->storage)
+            offset = viewer_installer_storage_get_durable (download->storage, segment->stream);
+
+        g_ptr_array_add (ranges, g_strdup_printf ("%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                                                  segment->start, offset, segment->end));
+        done += offset - segment->start;
+    }
+    g_key_file_set_int64 (keyfile, STATE_GROUP, "bytes-done", done);
+    g_key_file_set_string_list (keyfile, STATE_GROUP, "segments",
+                                (const gchar * const *) ranges->pdata, ranges->len);
+
+    data = g_key_file_to_data (keyfile, NULL, NULL);
+    if (!g_file_set_contents (download->state_file, data, -1, NULL))
+        g_warning ("Could not save download state to %s", download->state_file);
+
+    download->saved = download->written;
+}
+
+static gboolean
+viewer_installer_download_parse_range (const gchar *range,
+                                       goffset *start,
+                                       goffset *offset,
+                                       goffset *end)
+{
+    guint64 values[3];
+    g_auto(GStrv) fields = NULL;
+    guint i;
+
+    fields = g_strsplit (range, ":", -1);
+    if (g_strv_length (fields) != 3)
+        return FALSE;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (!g_ascii_string_to_unsigned (fields[i], 10, 0, G_MAXINT64, &values[i], NULL))
+            return FALSE;
+    }
+
+    *start = values[0];
+    *offset = values[1];
+    *end = values[2];
+    return TRUE;
+}
+
+static gboolean
+viewer_installer_download_load_state (ViewerInstallerDownload *download)
+{
+    gsize i, n_ranges = 0;
+    g_autofree gchar *uri = NULL;
+    g_autofree gchar *etag = NULL;
+    g_autofree gchar *last_modified = NULL;
+    g_auto(GStrv) ranges = NULL;
+    g_autoptr(GKeyFile) keyfile = NULL;
+
+    if (!viewer_installer_download_can_resume (download))
+        return FALSE;
+
+    if (!g_file_test (download->part_file, G_FILE_TEST_IS_REGULAR))
+        return FALSE;
+
+    keyfile = g_key_file_new ();
+    if (!g_key_file_load_from_file (keyfile, download->state_file, G_KEY_FILE_NONE, NULL))
+        return FALSE;
+
+    uri = g_key_file_get_string (keyfile, STATE_GROUP, "uri", NULL);
+    etag = g_key_file_get_string (keyfile, STATE_GROUP, "etag", NULL);
+    last_modified = g_key_file_get_string (keyfile, STATE_GROUP, "last-modified", NULL);
+
+    /* The partial file belongs to another version of the package */
+    if (g_strcmp0 (uri, download->uri) != 0 ||
+        g_key_file_get_int64 (keyfile, STATE_GROUP, "size", NULL) != download->size ||
+        g_strcmp0 (etag, download->etag) != 0 ||
+        g_strcmp0 (last_modified, download->last_modified) != 0)
+        return FALSE;
+
+    ranges = g_key_file_get_string_list (keyfile, STATE_GROUP, "segments", &n_ranges, NULL);
+    if (!ranges || n_ranges == 0)
+        return FALSE;
+
+    download->resumed = TRUE;
+    download->written = 0;
+
+    for (i = 0; i < n_ranges; i++)
+    {
+        goffset start, offset, end;
+        DownloadSegment *segment;
+
+        if (!viewer_installer_download_parse_range (ranges[i], &start, &offset, &end) ||
+            offset < start || end + 1 < offset || download->size <= end)
+            goto error;
+
+        segment = viewer_installer_download_segment_new (download, TRUE, start, offset, end);
+        if (!segment)
+            goto error;
+
+        g_ptr_array_add (download->segments, segment);
+        download->written += offset - start;
+    }
+
+    download->saved = download->written;
+    g_debug ("Resuming %s at %" G_GINT64_FORMAT " of %" G_GINT64_FORMAT " bytes",
+             download->uri, download->written, download->size);
+    return TRUE;
+
+error:
+    g_ptr_array_set_size (download->segments, 0);
+    download->resumed = FALSE;
+    download->written = 0;
+    return FALSE;
+}
+
+static gboolean
+viewer_installer_download_open (ViewerInstallerDownload *download,
+                                int flags,
+                                GError **error)
+{
+    download->fd = g_open (download->part_file, O_RDWR | O_CREAT | flags, 0644);
+    if (download->fd < 0)
+    {
+        int saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "%s: %s", download->part_file, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    /* A full disk fails here, before anything is transferred */
+    return viewer_installer_storage_reserve (download->fd, download->part_file, download->size, error);
+}
+
+/* Write-behind for the segments of the attempt */
+static void
+viewer_installer_download_start_storage (ViewerInstallerDownload *download)
+{
+    guint i;
+
+    /* With checkpoints, the resume state is saved every STATE_SAVE_INTERVAL
+     * and only counts what was forced to disk by then */
+    download->storage = viewer_installer_storage_new (download->fd,
+                                                      download->sync == STORAGE_SYNC_CHECKPOINT ? STATE_SAVE_INTERVAL : 0);
+
+    for (i = 0; i < download->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (download->segments, i);
+        segment->stream = viewer_installer_storage_add_stream (download->storage, segment->offset);
+    }
+}
+
+/* Only a first segment that starts from scratch streams the whole
+ * archive header by; a resumed one was checked on its first attempt */
+static void
+viewer_installer_download_start_check (ViewerInstallerDownload *download)
+{
+    DownloadSegment *first;
+
+    if (download->segments->len == 0)
+        return;
+
+    /* Nor does one that refetches single blocks */
+    first = g_ptr_array_index (download->segments, 0);
+    if (download->package && !download->partial && first->start == 0 && first->offset == 0)
+        download->deb = viewer_installer_deb_new (download->package, download->version, download->size);
+}
+
+/* Segments over the runs of blocks still missing, at most @count unless
+ * a run is long enough to be split. The runs closest together are merged
+ * first, fetching the good blocks between them again */
+static gboolean
+viewer_installer_download_block_segments (ViewerInstallerDownload *download,
+                                          guint count)
+{
+    g_autoptr(GArray) runs = NULL;
+    goffset missing, length;
+    guint i, j;
+
+    runs = g_array_new (FALSE, FALSE, sizeof (BlockRun));
+    download->written = 0;
+
+    for (i = 0; i < download->blocks->len; i++)
+    {
+        BlockRun run = { i, i };
+
+        if (download->block_good[i])
+        {
+            download->written += viewer_installer_download_block_length (download, i);
+            continue;
+        }
+
+        if (0 < runs->len && g_array_index (runs, BlockRun, runs->len - 1).last + 1 == i)
+            g_array_index (runs, BlockRun, runs->len - 1).last = i;
+        else
+            g_array_append_val (runs, run);
+    }
+
+    while (count < runs->len)
+    {
+        guint best = 0;
+
+        for (i = 1; i + 1 < runs->len; i++)
+        {
+            if (g_array_index (runs, BlockRun, i + 1).first - g_array_index (runs, BlockRun, i).last <
+                g_array_index (runs, BlockRun, best + 1).first - g_array_index (runs, BlockRun, best).last)
+                best = i;
+        }
+
+        for (j = g_array_index (runs, BlockRun, best).last + 1; j < g_array_index (runs, BlockRun, best + 1).first; j++)
+            download->written -= viewer_installer_download_block_length (download, j);
+
+        g_array_index (runs, BlockRun, best).last = g_array_index (runs, BlockRun, best + 1).last;
+        g_array_remove_index (runs, best + 1);
+    }
+
+    missing = download->size - download->written;
+    length = MAX (MIN_SEGMENT_SIZE, missing / MAX (1, count));
+    length = (length + download->block_size - 1) / download->block_size * download->block_size;
+
+    for (i = 0; i < runs->len; i++)
+    {
+        BlockRun *run = &g_array_index (runs, BlockRun, i);
+        goffset start = (goffset) run->first * download->block_size;
+        goffset end = (goffset) run->last * download->block_size + viewer_installer_download_block_length (download, run->last);
+
+        while (start < end)
+        {
+            DownloadSegment *segment;
+            goffset next = MIN (start + length, end);
+
+            segment = viewer_installer_download_segment_new (download, TRUE, start, start, next - 1);
+            if (!segment)
+                return FALSE;
+
+            g_ptr_array_add (download->segments, segment);
+            start = next;
+        }
+    }
+
+    download->saved = download->written;
+    return TRUE;
+}
+
+static gboolean
+viewer_installer_download_prepare (ViewerInstallerDownload *download,
+                                   guint count,
+                                   gboolean resume,
+                                   GError **error)
+{
+    guint i;
+    goffset length;
+
+    download->written = 0;
+    download->saved = 0;
+    download->resumed = FALSE;
+    download->range_ignored = FALSE;
+    download->corrupted = FALSE;
+    download->partial = FALSE;
+    g_clear_error (&download->write_error);
+    g_clear_pointer (&download->deb, viewer_installer_deb_free);
+
+    g_clear_pointer (&download->checksum, g_checksum_free);
+    download->hashed = 0;
+    download->catch_up = 0;
+    download->transfer_pending = FALSE;
+    if (download->sha256)
+        download->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    download->segments = g_ptr_array_new_with_free_func ((GDestroyNotify) download_segment_free);
+
+    /* Starting over does without the blocks */
+    if (!resume)
+        g_clear_pointer (&download->block_good, g_free);
+
+    /* Whatever state the part file is in, its good blocks are kept */
+    if (download->block_good)
+    {
+        for (i = 0; i < download->blocks->len; i++)
+            download->partial |= download->block_good[i];
+
+        viewer_installer_download_remove_state (download);
+
+        if (!viewer_installer_download_open (download, 0, error))
+            return FALSE;
+
+        /* Left over from a bigger file */
+        if (ftruncate (download->fd, download->size) != 0)
+        {
+            int saved_errno = errno;
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                         "%s: %s", download->part_file, g_strerror (saved_errno));
+            return FALSE;
+        }
+
+        if (!viewer_installer_download_block_segments (download, count))
+            goto error;
+
+        viewer_installer_download_start_storage (download);
+        viewer_installer_download_start_check (download);
+        return TRUE;
+    }
+
+    if (resume && viewer_installer_download_load_state (download))
+    {
+        if (!viewer_installer_download_open (download, 0, error))
+            return FALSE;
+
+        viewer_installer_download_start_storage (download);
+        viewer_installer_download_start_check (download);
+        return TRUE;
+    }
+
+    viewer_installer_download_remove_state (download);
+
+    if (!viewer_installer_download_open (download, O_TRUNC, error))
+        return FALSE;
+
+    if (count == 1)
+    {
+        DownloadSegment *segment;
+        segment = viewer_installer_download_segment_new (download, FALSE, 0, 0, download->size - 1);
+        if (!segment)
+            goto error;
+
+        g_ptr_array_add (download->segments, segment);
+        viewer_installer_download_start_storage (download);
+        viewer_installer_download_start_check (download);
+        return TRUE;
+    }
+
+    length = download->size / count;
+    for (i = 0; i < count; i++)
+    {
+        DownloadSegment *segment;
+        goffset start = i * length;
+        goffset end = (i == count - 1) ? download->size - 1 : start + length - 1;
+
+        segment = viewer_installer_download_segment_new (download, TRUE, start, start, end);
+        if (!segment)
+            goto error;
+
+        g_ptr_array_add (download->segments, segment);
+    }
+
+    viewer_installer_download_start_storage (download);
+    viewer_installer_download_start_check (download);
+    return TRUE;
+
+error:
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "curl_easy_init failed");
+    return FALSE;
+}
+
+static void
+viewer_installer_download_cleanup (ViewerInstallerDownload *download)
+{
+    if (download->segments)
+    {
+        guint i;
+
+        for (i = 0; i < download->segments->len; i++)
+        {
+            DownloadSegment *segment = g_ptr_array_index (download->segments, i);
+            if (segment->active)
+                viewer_installer_transfer_remove (viewer_installer_transfer_get_default (), segment->curl);
+        }
+
+        g_ptr_array_unref (download->segments);
+        download->segments = NULL;
+    }
+
+    g_clear_pointer (&download->storage, viewer_installer_storage_free);
+
+    if (0 <= download->fd)
+    {
+        close (download->fd);
+        download->fd = -1;
+    }
+}
+
+static gboolean
+viewer_installer_download_verify (ViewerInstallerDownload *download,
+                                  GError **error)
+{
+    const gchar *sha256;
+
+    /* Shorter than its own header. Block mode has the block hashes */
+    if (download->deb && !download->block_good && !viewer_installer_deb_is_done (download->deb))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "%s: not a valid package: ends before its data.tar", download->uri);
+        download->corrupted = TRUE;
+        viewer_installer_download_discard (download);
+        return FALSE;
+    }
+
+    if (!download->checksum)
+        return TRUE;
+
+    /* Segments that finished ahead of the cursor are still unhashed,
+     * and part of them may still be in the write-behind */
+    if ((download->storage && !viewer_installer_storage_flush (download->storage, NULL)) ||
+        !viewer_installer_download_hash_file (download, 0 < download->size ? download->size : download->hashed))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "%s: could not read back for checksum", download->part_file);
+        return FALSE;
+    }
+
+    sha256 = g_checksum_get_string (download->checksum);
+    if (g_ascii_strcasecmp (sha256, download->sha256) != 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "%s: SHA-256 %s does not match %s", download->uri, sha256, download->sha256);
+
+        /* Nothing of this file is worth resuming */
+        download->corrupted = TRUE;
+        viewer_installer_download_discard (download);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void viewer_installer_download_attempt (ViewerInstallerDownload *download,
+                                               guint count,
+                                               gboolean resume);
+
+static gboolean
+viewer_installer_download_finish_file (ViewerInstallerDownload *download,
+                                       GError **error)
+{
+    if (g_rename (download->part_file, download->out_file) != 0)
+    {
+        int saved_errno = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "%s: %s", download->out_file, g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    viewer_installer_download_remove_state (download);
+    return TRUE;
+}
+
+static void
+viewer_installer_download_return (ViewerInstallerDownload *download,
+                                  GError *error)
+{
+    GTask *task = g_steal_pointer (&download->task);
+
+    if (error)
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
+
+    g_object_unref (task);
+}
+
+/* Decides what follows an attempt: done, another try, or failure */
+static void
+viewer_installer_download_attempt_next (ViewerInstallerDownload *download,
+                                        GError *error)
+{
+    viewer_installer_download_cleanup (download);
+
+    if (!error)
+    {
+        GError *local_error = NULL;
+
+        viewer_installer_download_finish_file (download, &local_error);
+        viewer_installer_download_return (download, local_error);
+        return;
+    }
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        viewer_installer_download_return (download, error);
+        return;
+    }
+
+    /* The file on the server changed since the partial download,
+     * or the part kept from it was damaged */
+    if (download->stage == 0 && (download->range_ignored || download->corrupted) && download->resumed)
+    {
+        g_debug ("Partial file of %s is stale, downloading it again", download->uri);
+        g_error_free (error);
+
+        download->stage = 1;
+        viewer_installer_download_attempt (download, download->count, FALSE);
+        return;
+    }
+
+    /* The server advertised ranges but did not honour them,
+     * start over on a single connection */
+    if (download->stage < 2 && download->range_ignored && (1 < download->count || download->block_good))
+    {
+        g_debug ("Range request ignored by server, retrying with one connection");
+        g_error_free (error);
+
+        download->stage = 2;
+        viewer_installer_download_attempt (download, 1, FALSE);
+        return;
+    }
+
+    viewer_installer_download_return (download, error);
+}
+
+/* Draining the write-behind and syncing wait for the disk, keep them off
+ * the main loop. No transfer is active anymore, the segments stay put */
+static void
+viewer_installer_download_keep_thread (GTask *task,
+                                       gpointer source_object,
+                                       gpointer task_data,
+                                       GCancellable *cancellable)
+{
+    ViewerInstallerDownload *download = task_data;
+
+    /* A cancel has to be quick; the state claims only what is durable */
+    if (download->storage && download->sync == STORAGE_SYNC_CHECKPOINT &&
+        !g_error_matches (download->attempt_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        viewer_installer_storage_sync (download->storage, NULL);
+    else if (download->storage)
+        viewer_installer_storage_flush (download->storage, NULL);
+    viewer_installer_download_save_state (download);
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+viewer_installer_download_keep_done (GObject *source,
+                                     GAsyncResult *result,
+                                     gpointer user_data)
+{
+    ViewerInstallerDownload *download = user_data;
+
+    viewer_installer_download_attempt_next (download, g_steal_pointer (&download->attempt_error));
+}
+
+static void
+viewer_installer_download_attempt_done (ViewerInstallerDownload *download,
+                                        GError *error)
+{
+    GTask *task;
+
+    if (!error || download->range_ignored || download->corrupted)
+    {
+        viewer_installer_download_attempt_next (download, error);
+        return;
+    }
+
+    /* Keep what has arrived so far for the next attempt */
+    download->attempt_error = error;
+
+    task = g_task_new (NULL, NULL, viewer_installer_download_keep_done, download);
+    g_task_set_task_data (task, download, NULL);
+    g_task_run_in_thread (task, viewer_installer_download_keep_thread);
+    g_object_unref (task);
+}
+
+/* Catching the hash up may read most of the file back, keep it off the
+ * main loop */
+static void
+viewer_installer_download_verify_thread (GTask *task,
+                                         gpointer source_object,
+                                         gpointer task_data,
+                                         GCancellable *cancellable)
+{
+    ViewerInstallerDownload *download = task_data;
+    GError *error = NULL;
+
+    if (!viewer_installer_download_verify (download, &error))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    /* On disk before the rename makes it the package */
+    if (download->storage && download->sync != STORAGE_SYNC_NONE &&
+        !viewer_installer_storage_sync (download->storage, &error))
+    {
+        g_prefix_error (&error, "%s: ", download->part_file);
+        g_task_return_error (task, error);
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+viewer_installer_download_verify_done (GObject *source,
+                                       GAsyncResult *result,
+                                       gpointer user_data)
+{
+    GError *error = NULL;
+
+    g_task_propagate_boolean (G_TASK (result), &error);
+    viewer_installer_download_attempt_done (user_data, error);
+}
+
+static void
+viewer_installer_download_transferred (ViewerInstallerDownload *download)
+{
+    GError *error = NULL;
+    GTask *task;
+
+    /* The worker hashing ahead still reads the file */
+    if (download->catch_up)
+    {
+        download->transfer_pending = TRUE;
+        return;
+    }
+
+    /* Says more than the CURLE_WRITE_ERROR it caused */
+    if (download->write_error)
+    {
+        viewer_installer_download_attempt_done (download, g_steal_pointer (&download->write_error));
+        return;
+    }
+
+    if (!viewer_installer_transfer_propagate (download->result, g_task_get_cancellable (download->task), &error))
+    {
+        viewer_installer_download_attempt_done (download, error);
+        return;
+    }
+
+    /* Blocks that failed their hash are asked for again on their own */
+    if (download->block_good)
+    {
+        guint i, bad = 0;
+
+        for (i = 0; i < download->blocks->len; i++)
+            bad += !download->block_good[i];
+
+        if (0 < bad && download->block_round < BLOCK_ROUNDS)
+        {
+            g_debug ("%u blocks of %s do not match, fetching them again", bad, download->uri);
+            download->block_round++;
+
+            viewer_installer_download_cleanup (download);
+            viewer_installer_download_attempt (download, download->count, TRUE);
+            return;
+        }
+
+        if (0 < bad)
+        {
+            g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "%s: %u blocks do not match the manifest", download->uri, bad);
+            viewer_installer_download_attempt_done (download, error);
+            return;
+        }
+    }
+
+    task = g_task_new (NULL, NULL, viewer_installer_download_verify_done, download);
+    g_task_set_task_data (task, download, NULL);
+    g_task_run_in_thread (task, viewer_installer_download_verify_thread);
+    g_object_unref (task);
+}
+
+static void
+viewer_installer_download_segment_done (CURL *curl,
+                                        CURLcode result,
+                                        gpointer user_data)
+{
+    DownloadSegment *segment = user_data;
+    ViewerInstallerDownload *download = segment->download;
+
+    segment->active = FALSE;
+    download->pending--;
+
+    /* One failed segment fails the whole file, stop the others */
+    if (result != CURLE_OK && download->result == CURLE_OK)
+    {
+        guint i;
+
+        download->result = result;
+        for (i = 0; i < download->segments->len; i++)
+        {
+            DownloadSegment *other = g_ptr_array_index (download->segments, i);
+            if (!other->active)
+                continue;
+
+            viewer_installer_transfer_remove (viewer_installer_transfer_get_default (), other->curl);
+            other->active = FALSE;
+            download->pending--;
+        }
+    }
+
+    if (download->pending == 0)
+        viewer_installer_download_transferred (download);
+}
+
+static void
+viewer_installer_download_attempt (ViewerInstallerDownload *download,
+                                   guint count,
+                                   gboolean resume)
+{
+    GError *error = NULL;
+    guint i;
+
+    download->result = CURLE_OK;
+    download->pending = 0;
+
+    if (!viewer_installer_download_prepare (download, count, resume, &error))
+    {
+        viewer_installer_download_attempt_done (download, error);
+        return;
+    }
+
+    for (i = 0; i < download->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (download->segments, i);
+        if (!download_segment_is_done (segment))
+        {
+            segment->active = TRUE;
+            download->pending++;
+        }
+    }
+
+    /* Everything was on disk already */
+    if (download->pending == 0)
+    {
+        viewer_installer_download_transferred (download);
+        return;
+    }
+
+    for (i = 0; i < download->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (download->segments, i);
+        if (segment->active)
+            viewer_installer_transfer_add (viewer_installer_transfer_get_default (),
+                                           segment->curl,
+                                           g_task_get_cancellable (download->task),
+                                           viewer_installer_download_segment_done,
+                                           segment);
+    }
+}
+
+static void
+viewer_installer_download_scan_block (gpointer data,
+                                      gpointer user_data)
+{
+    BlockScan *scan = user_data;
+    ViewerInstallerDownload *download = scan->download;
+    guint index = GPOINTER_TO_UINT (data) - 1;
+    goffset start = (goffset) index * download->block_size;
+    gsize length = viewer_installer_download_block_length (download, index);
+    g_autofree guchar *buffer = NULL;
+    g_autofree gchar *sha256 = NULL;
+    gsize done = 0;
+
+    if (g_cancellable_is_cancelled (scan->cancellable))
+        return;
+
+    buffer = g_malloc (length);
+    while (done < length)
+    {
+        ssize_t n = pread (scan->fd, buffer + done, length - done, start + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        done += n;
+    }
+
+    sha256 = g_compute_checksum_for_data (G_CHECKSUM_SHA256, buffer, length);
+    download->block_good[index] = viewer_installer_download_block_matches (download, index, sha256);
+}
+
+/* Hashes the blocks of a part file left in an unknown state, on a thread
+ * per processor */
+static void
+viewer_installer_download_scan_thread (GTask *task,
+                                       gpointer source_object,
+                                       gpointer task_data,
+                                       GCancellable *cancellable)
+{
+    ViewerInstallerDownload *download = task_data;
+    BlockScan scan = { download, cancellable, -1 };
+    GThreadPool *pool;
+    guint i;
+
+    scan.fd = g_open (download->part_file, O_RDONLY, 0);
+    if (0 <= scan.fd)
+    {
+        pool = g_thread_pool_new (viewer_installer_download_scan_block, &scan,
+                                  g_get_num_processors (), TRUE, NULL);
+        for (i = 0; i < download->blocks->len; i++)
+            g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), NULL);
+        g_thread_pool_free (pool, FALSE, TRUE);
+
+        close (scan.fd);
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+viewer_installer_download_scan_done (GObject *source,
+                                     GAsyncResult *result,
+                                     gpointer user_data)
+{
+    ViewerInstallerDownload *download = user_data;
+    guint i, good = 0;
+
+    if (g_cancellable_is_cancelled (g_task_get_cancellable (download->task)))
+    {
+        viewer_installer_download_return (download, g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                                                         "Operation was cancelled"));
+        return;
+    }
+
+    for (i = 0; i < download->blocks->len; i++)
+        good += download->block_good[i];
+    g_debug ("%u of %u blocks of %s are already on disk", good, download->blocks->len, download->uri);
+
+    viewer_installer_download_attempt (download, download->count, TRUE);
+}
+
+/* Block mode needs hashes that cover the file and ranges to fetch them */
+static gboolean
+viewer_installer_download_start_blocks (ViewerInstallerDownload *download)
+{
+    goffset n_blocks;
+
+    g_clear_pointer (&download->block_good, g_free);
+
+    if (!download->blocks || download->size <= 0 || !download->accept_ranges)
+        return FALSE;
+
+    n_blocks = (download->size + download->block_size - 1) / download->block_size;
+    if (n_blocks != download->blocks->len)
+    {
+        g_warning ("%u block hashes do not cover the %" G_GINT64_FORMAT " bytes of %s",
+                   download->blocks->len, download->size, download->uri);
+        return FALSE;
+    }
+
+    download->block_good = g_new0 (guint8, n_blocks);
+    return TRUE;
+}
+
+/* Runs on the transfer engine of the main context. @download must stay
+ * alive until @callback has been called */
+void
+viewer_installer_download_run_async (ViewerInstallerDownload *download,
+                                     GCancellable *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+    g_return_if_fail (download != NULL);
+    g_return_if_fail (download->task == NULL);
+
+    download->task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (download->task, viewer_installer_download_run_async);
+
+    if (g_task_return_error_if_cancelled (download->task))
+    {
+        g_clear_object (&download->task);
+        return;
+    }
+
+    download->stage = 0;
+    download->block_round = 0;
+    download->count = viewer_installer_download_count_segments (download);
+
+    if (viewer_installer_download_start_blocks (download) &&
+        g_file_test (download->part_file, G_FILE_TEST_IS_REGULAR))
+    {
+        GTask *task = g_task_new (NULL, cancellable, viewer_installer_download_scan_done, download);
+        g_task_set_task_data (task, download, NULL);
+        g_task_run_in_thread (task, viewer_installer_download_scan_thread);
+        g_object_unref (task);
+        return;
+    }
+
+    viewer_installer_download_attempt (download, download->count, TRUE);
+}
+
+gboolean
+viewer_installer_download_run_finish (ViewerInstallerDownload *download,
+                                      GAsyncResult *result,
+                                      GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+void
+viewer_installer_download_discard (ViewerInstallerDownload *download)
+{
+    g_return_if_fail (download != NULL);
+
+    g_unlink (download->part_file);
+    viewer_installer_download_remove_state (download);
+}
+
+void
+viewer_installer_download_set_md5 (ViewerInstallerDownload *download,
+                                   const gchar *md5)
+{
+    g_return_if_fail (download != NULL);
+
+    g_free (download->md5);
+    download->md5 = g_strdup (md5);
+}
+
+void
+viewer_installer_download_set_sha256 (ViewerInstallerDownload *download,
+                                      const gchar *sha256)
+{
+    g_return_if_fail (download != NULL);
+
+    g_free (download->sha256);
+    download->sha256 = g_strdup (sha256);
+}
+
+void
+viewer_installer_download_set_connections (ViewerInstallerDownload *download,
+                                           guint connections)
+{
+    g_return_if_fail (download != NULL);
+
+    download->connections = MAX (1, connections);
+}
+
+void
+viewer_installer_download_set_size (ViewerInstallerDownload *download,
+                                    goffset size,
+                                    gboolean accept_ranges)
+{
+    g_return_if_fail (download != NULL);
+
+    download->size = size;
+    download->accept_ranges = accept_ranges;
+}
+
+void
+viewer_installer_download_set_validators (ViewerInstallerDownload *download,
+                                          const gchar *etag,
+                                          const gchar *last_modified)
+{
+    g_return_if_fail (download != NULL);
+
+    g_free (download->etag);
+    download->etag = g_strdup (etag);
+
+    g_free (download->last_modified);
+    download->last_modified = g_strdup (last_modified);
+}
+
+/* Checks the stream is the .deb of @package at @version, the version
+ * is not checked when NULL */
+void
+viewer_installer_download_set_package (ViewerInstallerDownload *download,
+                                       const gchar *package,
+                                       const gchar *version)
+{
+    g_return_if_fail (download != NULL);
+
+    g_free (download->package);
+    download->package = g_strdup (package);
+
+    g_free (download->version);
+    download->version = g_strdup (version);
+}
+
+/* A control field of the package, when its control file streamed by
+ * during the last run */
+const gchar *
+viewer_installer_download_get_field (ViewerInstallerDownload *download,
+                                     const gchar *field)
+{
+    g_return_val_if_fail (download != NULL, NULL);
+
+    if (!download->deb || !viewer_installer_deb_is_done (download->deb))
+        return NULL;
+
+    return viewer_installer_deb_get_field (download->deb, field);
+}
+
+/* Hashes of the @block_size pieces of the file, from the manifest */
+void
+viewer_installer_download_set_blocks (ViewerInstallerDownload *download,
+                                      goffset block_size,
+                                      GPtrArray *blocks)
+{
+    g_return_if_fail (download != NULL);
+    g_return_if_fail (blocks == NULL || blocks->len == 0 || 0 < block_size);
+
+    g_clear_pointer (&download->blocks, g_ptr_array_unref);
+    if (blocks && 0 < blocks->len)
+        download->blocks = g_ptr_array_ref (blocks);
+    download->block_size = block_size;
+}
+
+void
+viewer_installer_download_set_sync (ViewerInstallerDownload *download,
+                                    ViewerInstallerStorageSync sync)
+{
+    g_return_if_fail (download != NULL);
+
+    download->sync = sync;
+}
+
+/* Takes ownership of @curl and uses it for the first request */
+void
+viewer_installer_download_set_handle (ViewerInstallerDownload *download,
+                                      CURL *curl)
+{
+    g_return_if_fail (download != NULL);
+
+    if (download->handle)
+        curl_easy_cleanup (download->handle);
+    download->handle = curl;
+}
+
+void
+viewer_installer_download_set_progress_func (ViewerInstallerDownload *download,
+                                             ViewerInstallerDownloadProgressFunc func,
+                                             gpointer user_data)
+{
+    g_return_if_fail (download != NULL);
+
+    download->progress_func = func;
+    download->progress_data = user_data;
+}
+
+ViewerInstallerDownload *
+viewer_installer_download_new (const gchar *uri,
+                               const gchar *out_file)
+{
+    ViewerInstallerDownload *download;
+
+    download = g_new0 (ViewerInstallerDownload, 1);
+    download->uri = g_strdup (uri);
+    download->out_file = g_strdup (out_file);
+    download->part_file = g_strdup_printf ("%s.part", out_file);
+    download->state_file = g_strdup_printf ("%s.part.state", out_file);
+    download->connections = 1;
+    download->size = -1;
+    download->fd = -1;
+    download->sync = STORAGE_SYNC_CHECKPOINT;
+
+    return download;
+}
+
+void
+viewer_installer_download_free (ViewerInstallerDownload *download)
+{
+    if (!download)
+        return;
+
+    viewer_installer_download_cleanup (download);
+
+    g_free (download->uri);
+    g_free (download->out_file);
+    g_free (download->part_file);
+    g_free (download->state_file);
+    g_free (download->md5);
+    g_free (download->etag);
+    g_free (download->last_modified);
+    g_free (download->sha256);
+    g_free (download->package);
+    g_free (download->version);
+    g_clear_pointer (&download->checksum, g_checksum_free);
+    g_clear_pointer (&download->deb, viewer_installer_deb_free);
+    g_clear_pointer (&download->blocks, g_ptr_array_unref);
+    g_free (download->block_good);
+    g_clear_error (&download->write_error);
+    g_clear_object (&download->task);
+    g_clear_pointer (&download->handle, curl_easy_cleanup);
+    g_free (download);
+}
@@ -0,0 +1,75 @@
+/* viewer-installer-download.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <curl/curl.h>
+
+#include "viewer-installer-storage.h"
+
+G_BEGIN_DECLS
+
+typedef struct _ViewerInstallerDownload ViewerInstallerDownload;
+
+typedef void (*ViewerInstallerDownloadProgressFunc) (goffset  now,
+                                                     goffset  total,
+                                                     gpointer user_data);
+
+ViewerInstallerDownload *viewer_installer_download_new              (const gchar *uri,
+                                                                     const gchar *out_file);
+void                     viewer_installer_download_free             (ViewerInstallerDownload *download);
+
+void                     viewer_installer_download_set_md5          (ViewerInstallerDownload *download,
+                                                                     const gchar             *md5);
+void                     viewer_installer_download_set_sha256       (ViewerInstallerDownload *download,
+                                                                     const gchar             *sha256);
+void                     viewer_installer_download_set_connections  (ViewerInstallerDownload *download,
+                                                                     guint                    connections);
+void                     viewer_installer_download_set_size         (ViewerInstallerDownload *download,
+                                                                     goffset                  size,
+                                                                     gboolean                 accept_ranges);
+void                     viewer_installer_download_set_validators   (ViewerInstallerDownload *download,
+                                                                     const gchar             *etag,
+                                                                     const gchar             *last_modified);
+void                     viewer_installer_download_set_handle       (ViewerInstallerDownload *download,
+                                                                     CURL                    *curl);
+void                     viewer_installer_download_set_package      (ViewerInstallerDownload *download,
+                                                                     const gchar             *package,
+                                                                     const gchar             *version);
+void                     viewer_installer_download_set_blocks       (ViewerInstallerDownload *download,
+                                                                     goffset                  block_size,
+                                                                     GPtrArray               *blocks);
+void                     viewer_installer_download_set_sync         (ViewerInstallerDownload    *download,
+                                                                     ViewerInstallerStorageSync  sync);
+void                     viewer_installer_download_set_progress_func (ViewerInstallerDownload            *download,
+                                                                      ViewerInstallerDownloadProgressFunc func,
+                                                                      gpointer                            user_data);
+
+void                     viewer_installer_download_run_async        (ViewerInstallerDownload *download,
+                                                                     GCancellable            *cancellable,
+                                                                     GAsyncReadyCallback      callback,
+                                                                     gpointer                 user_data);
+gboolean                 viewer_installer_download_run_finish       (ViewerInstallerDownload *download,
+                                                                     GAsyncResult            *result,
+                                                                     GError                 **error);
+void                     viewer_installer_download_discard          (ViewerInstallerDownload *download);
+const gchar             *viewer_installer_download_get_field        (ViewerInstallerDownload *download,
+                                                                     const gchar             *field);
+
+G_END_DECLS
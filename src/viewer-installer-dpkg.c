@@ -0,0 +1,576 @@
+/* viewer-installer-dpkg.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads the dpkg database without running dpkg-query.
+ *
+ * The status file is mapped and split into stanzas once; queries look the
+ * package up in a hash table and only parse the fields of its stanza.
+ * The index is rebuilt whenever the file is replaced, which dpkg always
+ * does by renaming a new one over it.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "viewer-installer-dpkg.h"
+
+typedef struct _DpkgStanza DpkgStanza;
+
+struct _DpkgStanza
+{
+    const gchar *data;
+    gsize        length;
+    DpkgStanza  *next;      /* same package, other architecture */
+};
+
+typedef struct
+{
+    GMappedFile *mapped;
+    GHashTable  *stanzas;   /* package name -> DpkgStanza */
+
+    dev_t        dev;
+    ino_t        ino;
+    time_t       mtime;
+    off_t        size;
+} DpkgStatus;
+
+static DpkgStatus status_cache;
+static GMutex status_mutex;
+
+static void
+dpkg_stanza_free (DpkgStanza *stanza)
+{
+    while (stanza)
+    {
+        DpkgStanza *next = stanza->next;
+        g_free (stanza);
+        stanza = next;
+    }
+}
+
+/* Returns the first line of @field, or NULL */
+static gchar *
+dpkg_stanza_get_field (const DpkgStanza *stanza,
+                       const gchar *field)
+{
+    const gchar *p = stanza->data;
+    const gchar *end = stanza->data + stanza->length;
+    gsize field_len = strlen (field);
+
+    while (p < end)
+    {
+        const gchar *eol = memchr (p, '\n', end - p);
+        if (!eol)
+            eol = end;
+
+        if ((gsize) (eol - p) > field_len &&
+            memcmp (p, field, field_len) == 0 && p[field_len] == ':')
+        {
+            const gchar *value = p + field_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+            return g_strndup (value, eol - value);
+        }
+
+        p = eol + 1;
+    }
+
+    return NULL;
+}
+
+static gboolean
+dpkg_stanza_is_installed (const DpkgStanza *stanza)
+{
+    g_autofree gchar *status = NULL;
+
+    /* "want flag state", e.g. "install ok installed" */
+    status = dpkg_stanza_get_field (stanza, "Status");
+    return (status && g_str_has_suffix (status, " installed"));
+}
+
+static void
+dpkg_status_clear (DpkgStatus *status)
+{
+    g_clear_pointer (&status->stanzas, g_hash_table_unref);
+    g_clear_pointer (&status->mapped, g_mapped_file_unref);
+    status->dev = 0;
+    status->ino = 0;
+    status->mtime = 0;
+    status->size = 0;
+}
+
+static void
+dpkg_status_index (DpkgStatus *status)
+{
+    const gchar *data = g_mapped_file_get_contents (status->mapped);
+    const gchar *end = data + g_mapped_file_get_length (status->mapped);
+    const gchar *p = data;
+
+    status->stanzas = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, (GDestroyNotify) dpkg_stanza_free);
+
+    while (p < end)
+    {
+        const gchar *stanza_end;
+        const gchar *name;
+        const gchar *eol;
+        DpkgStanza *stanza;
+        DpkgStanza *first;
+        gchar *key;
+
+        while (p < end && *p == '\n')
+            p++;
+        if (p == end)
+            break;
+
+        stanza_end = memmem (p, end - p, "\n\n", 2);
+        stanza_end = stanza_end ? stanza_end + 1 : end;
+
+        /* Package is the first field dpkg writes, but do not rely on it */
+        if ((gsize) (stanza_end - p) > 8 && memcmp (p, "Package:", 8) == 0)
+            name = p + 8;
+        else if ((name = memmem (p, stanza_end - p, "\nPackage:", 9)))
+            name += 9;
+        else
+        {
+            p = stanza_end;
+            continue;
+        }
+
+        while (name < stanza_end && *name == ' ')
+            name++;
+        eol = memchr (name, '\n', stanza_end - name);
+        if (!eol)
+            eol = stanza_end;
+
+        stanza = g_new0 (DpkgStanza, 1);
+        stanza->data = p;
+        stanza->length = stanza_end - p;
+
+        key = g_strndup (name, eol - name);
+        first = g_hash_table_lookup (status->stanzas, key);
+        if (first)
+        {
+            stanza->next = first->next;
+            first->next = stanza;
+            g_free (key);
+        }
+        else
+        {
+            g_hash_table_insert (status->stanzas, key, stanza);
+        }
+
+        p = stanza_end;
+    }
+}
+
+/* Called with status_mutex held */
+static DpkgStatus *
+dpkg_status_get (void)
+{
+    GStatBuf st;
+    DpkgStatus *status = &status_cache;
+    g_autofree gchar *path = NULL;
+    const gchar *admindir;
+
+    /* Same override dpkg itself honours */
+    admindir = g_getenv ("DPKG_ADMINDIR");
+    path = g_build_filename (admindir ? admindir : DPKG_ADMINDIR, "status", NULL);
+
+    if (g_stat (path, &st) != 0)
+    {
+        dpkg_status_clear (status);
+        return status;
+    }
+
+    if (status->stanzas &&
+        status->dev == st.st_dev && status->ino == st.st_ino &&
+        status->mtime == st.st_mtime && status->size == st.st_size)
+        return status;
+
+    dpkg_status_clear (status);
+
+    status->mapped = g_mapped_file_new (path, FALSE, NULL);
+    if (!status->mapped)
+        return status;
+
+    status->dev = st.st_dev;
+    status->ino = st.st_ino;
+    status->mtime = st.st_mtime;
+    status->size = st.st_size;
+
+    dpkg_status_index (status);
+
+    return status;
+}
+
+static const DpkgStanza *
+dpkg_status_find_installed (DpkgStatus *status,
+                            const gchar *package)
+{
+    const DpkgStanza *stanza;
+
+    if (!status->stanzas)
+        return NULL;
+
+    for (stanza = g_hash_table_lookup (status->stanzas, package); stanza; stanza = stanza->next)
+    {
+        if (dpkg_stanza_is_installed (stanza))
+            return stanza;
+    }
+
+    return NULL;
+}
+
+/* Character order of dpkg's verrevcmp: '~' first, then the end of the
+ * string, letters, and everything else */
+static gint
+dpkg_version_order (gchar c)
+{
+    if (g_ascii_isdigit (c))
+        return 0;
+    else if (g_ascii_isalpha (c))
+        return c;
+    else if (c == '~')
+        return -1;
+    else if (c)
+        return c + 256;
+    else
+        return 0;
+}
+
+static gint
+dpkg_version_verrevcmp (const gchar *a,
+                        const gchar *b)
+{
+    while (*a || *b)
+    {
+        gint first_diff = 0;
+
+        while ((*a && !g_ascii_isdigit (*a)) || (*b && !g_ascii_isdigit (*b)))
+        {
+            gint ac = dpkg_version_order (*a);
+            gint bc = dpkg_version_order (*b);
+
+            if (ac != bc)
+                return ac - bc;
+            a++;
+            b++;
+        }
+
+        while (*a == '0')
+            a++;
+        while (*b == '0')
+            b++;
+
+        while (g_ascii_isdigit (*a) && g_ascii_isdigit (*b))
+        {
+            if (!first_diff)
+                first_diff = *a - *b;
+            a++;
+            b++;
+        }
+
+        if (g_ascii_isdigit (*a))
+            return 1;
+        if (g_ascii_isdigit (*b))
+            return -1;
+        if (first_diff)
+            return first_diff;
+    }
+
+    return 0;
+}
+
+/* Splits "epoch:upstream-revision" in place */
+static void
+dpkg_version_split (gchar *version,
+                    glong *epoch,
+                    const gchar **upstream,
+                    const gchar **revision)
+{
+    gchar *colon = strchr (version, ':');
+    gchar *hyphen;
+
+    *epoch = 0;
+    if (colon)
+    {
+        *colon = '\0';
+        *epoch = strtol (version, NULL, 10);
+        version = colon + 1;
+    }
+
+    *upstream = version;
+    *revision = "";
+
+    hyphen = strrchr (version, '-');
+    if (hyphen)
+    {
+        *hyphen = '\0';
+        *revision = hyphen + 1;
+    }
+}
+
+/* Returns a number less than, equal to or greater than zero as
+ * version @a is older than, equal to or newer than @b */
+gint
+viewer_installer_dpkg_compare_versions (const gchar *a,
+                                        const gchar *b)
+{
+    g_autofree gchar *va = NULL;
+    g_autofree gchar *vb = NULL;
+    const gchar *upstream_a, *upstream_b;
+    const gchar *revision_a, *revision_b;
+    glong epoch_a, epoch_b;
+    gint res;
+
+    g_return_val_if_fail (a != NULL && b != NULL, 0);
+
+    va = g_strstrip (g_strdup (a));
+    vb = g_strstrip (g_strdup (b));
+
+    dpkg_version_split (va, &epoch_a, &upstream_a, &revision_a);
+    dpkg_version_split (vb, &epoch_b, &upstream_b, &revision_b);
+
+    if (epoch_a != epoch_b)
+        return epoch_a > epoch_b ? 1 : -1;
+
+    res = dpkg_version_verrevcmp (upstream_a, upstream_b);
+    if (res)
+        return res;
+
+    return dpkg_version_verrevcmp (revision_a, revision_b);
+}
+
+static gboolean
+dpkg_version_satisfies (const gchar *installed,
+                        const gchar *op,
+                        const gchar *wanted)
+{
+    gint res = viewer_installer_dpkg_compare_versions (installed, wanted);
+
+    if (g_str_equal (op, "<<"))
+        return res < 0;
+    if (g_str_equal (op, "<=") || g_str_equal (op, "<"))
+        return res <= 0;
+    if (g_str_equal (op, "="))
+        return res == 0;
+    if (g_str_equal (op, ">=") || g_str_equal (op, ">"))
+        return res >= 0;
+    if (g_str_equal (op, ">>"))
+        return res > 0;
+
+    return FALSE;
+}
+
+/* One alternative, e.g. "libc6:any (>= 2.28)". Virtual packages are not
+ * looked up, which at worst sends the install through apt. */
+static gboolean
+dpkg_status_satisfies (DpkgStatus *status,
+                       const gchar *relation)
+{
+    g_autofree gchar *name = NULL;
+    g_autofree gchar *op = NULL;
+    g_autofree gchar *wanted = NULL;
+    const DpkgStanza *stanza;
+    const gchar *p = relation;
+    const gchar *start;
+
+    while (g_ascii_isspace (*p))
+        p++;
+    start = p;
+    while (*p && !g_ascii_isspace (*p) && *p != '(' && *p != ':')
+        p++;
+    if (p == start)
+        return FALSE;
+    name = g_strndup (start, p - start);
+
+    /* Architecture qualifier */
+    while (*p && !g_ascii_isspace (*p) && *p != '(')
+        p++;
+    while (g_ascii_isspace (*p))
+        p++;
+
+    if (*p == '(')
+    {
+        p++;
+        while (g_ascii_isspace (*p))
+            p++;
+        start = p;
+        while (*p == '<' || *p == '=' || *p == '>')
+            p++;
+        op = g_strndup (start, p - start);
+        while (g_ascii_isspace (*p))
+            p++;
+        start = p;
+        while (*p && *p != ')' && !g_ascii_isspace (*p))
+            p++;
+        wanted = g_strndup (start, p - start);
+
+        if (!*op || !*wanted)
+            return FALSE;
+    }
+
+    if (!status->stanzas)
+        return FALSE;
+
+    for (stanza = g_hash_table_lookup (status->stanzas, name); stanza; stanza = stanza->next)
+    {
+        g_autofree gchar *version = NULL;
+
+        if (!dpkg_stanza_is_installed (stanza))
+            continue;
+        if (!wanted)
+            return TRUE;
+
+        version = dpkg_stanza_get_field (stanza, "Version");
+        if (version && dpkg_version_satisfies (version, op, wanted))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Checks a Depends-style field, "a (>= 1) | b, c" */
+gboolean
+viewer_installer_dpkg_depends_satisfied (const gchar *depends)
+{
+    gboolean res = TRUE;
+    gchar **groups;
+    guint i;
+
+    g_return_val_if_fail (depends != NULL, FALSE);
+
+    groups = g_strsplit (depends, ",", -1);
+
+    g_mutex_lock (&status_mutex);
+    for (i = 0; res && groups[i]; i++)
+    {
+        gchar **alternatives;
+        guint j;
+
+        if (!*g_strstrip (groups[i]))
+            continue;
+
+        res = FALSE;
+        alternatives = g_strsplit (groups[i], "|", -1);
+        for (j = 0; !res && alternatives[j]; j++)
+            res = dpkg_status_satisfies (dpkg_status_get (), alternatives[j]);
+        g_strfreev (alternatives);
+    }
+    g_mutex_unlock (&status_mutex);
+
+    g_strfreev (groups);
+
+    return res;
+}
+
+/* Whether the Pre-Depends and Depends of a local archive are all met,
+ * so it can be handed to dpkg without the apt solver */
+gboolean
+viewer_installer_dpkg_deb_depends_satisfied (const gchar *deb_file)
+{
+    g_autofree gchar *output = NULL;
+    gchar **lines;
+    GString *depends;
+    gboolean res;
+    gint exit_status;
+    guint i;
+
+    const gchar *argv[] = { "dpkg-deb", "--field", deb_file, "Pre-Depends", "Depends", NULL };
+
+    g_return_val_if_fail (deb_file != NULL, FALSE);
+
+    if (!g_spawn_sync (NULL, (gchar **) argv, NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &output, NULL, &exit_status, NULL))
+        return FALSE;
+
+    if (!g_spawn_check_exit_status (exit_status, NULL))
+        return FALSE;
+
+    /* "Field: value" lines, continuations start with a blank */
+    depends = g_string_new (NULL);
+    lines = g_strsplit (output, "\n", -1);
+    for (i = 0; lines[i]; i++)
+    {
+        const gchar *value = lines[i];
+
+        if (!g_ascii_isspace (*value))
+        {
+            value = strchr (value, ':');
+            if (!value)
+                continue;
+            value++;
+            if (depends->len)
+                g_string_append_c (depends, ',');
+        }
+
+        g_string_append (depends, value);
+    }
+    g_strfreev (lines);
+
+    res = viewer_installer_dpkg_depends_satisfied (depends->str);
+    g_string_free (depends, TRUE);
+
+    return res;
+}
+
+gboolean
+viewer_installer_dpkg_is_installed (const gchar *package)
+{
+    gboolean res;
+
+    g_return_val_if_fail (package != NULL, FALSE);
+
+    g_mutex_lock (&status_mutex);
+    res = (dpkg_status_find_installed (dpkg_status_get (), package) != NULL);
+    g_mutex_unlock (&status_mutex);
+
+    return res;
+}
+
+gchar *
+viewer_installer_dpkg_get_version (const gchar *package)
+{
+    const DpkgStanza *stanza;
+    gchar *version = NULL;
+
+    g_return_val_if_fail (package != NULL, NULL);
+
+    g_mutex_lock (&status_mutex);
+    stanza = dpkg_status_find_installed (dpkg_status_get (), package);
+    if (stanza)
+        version = dpkg_stanza_get_field (stanza, "Version");
+    g_mutex_unlock (&status_mutex);
+
+    return version;
+}
+
+void
+viewer_installer_dpkg_reset (void)
+{
+    g_mutex_lock (&status_mutex);
+    dpkg_status_clear (&status_cache);
+    g_mutex_unlock (&status_mutex);
+}
@@ -0,0 +1,36 @@
+/* viewer-installer-dpkg.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define DPKG_ADMINDIR "/var/lib/dpkg"
+
+gboolean  viewer_installer_dpkg_is_installed (const gchar *package);
+gchar    *viewer_installer_dpkg_get_version  (const gchar *package);
+void      viewer_installer_dpkg_reset        (void);
+
+gint      viewer_installer_dpkg_compare_versions      (const gchar *a,
+                                                       const gchar *b);
+gboolean  viewer_installer_dpkg_depends_satisfied     (const gchar *depends);
+gboolean  viewer_installer_dpkg_deb_depends_satisfied (const gchar *deb_file);
+
+G_END_DECLS
@@ -0,0 +1,806 @@
+/* viewer-installer-manifest.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Package manifest.
+ *
+ * The manifest is either the original single package
+ *
+ *   { "package" : { "name" : ..., "file-name" : ..., "SHA256" : ... } }
+ *
+ * or a list of them, where "dependency" names other entries:
+ *
+ *   { "packages" : [ { "name" : "a", ... },
+ *                    { "name" : "b", ..., "dependency" : [ "a" ] } ] }
+ *
+ * Packages are kept in install order, every package after the ones it
+ * depends on. A dependency cycle makes the manifest invalid.
+ *
+ * A package with a "version" can also list "deltas", patches that rebuild
+ * it from an older version instead of downloading all of it:
+ *
+ *   "deltas" : [ { "from" : "11.20.0.1520", "format" : "xdelta3",
+ *                  "file-name" : ..., "SHA256" : ..., "source-SHA256" : ... } ]
+ *
+ * "blocks" lists the SHA-256 of every fixed-size block of the file, the
+ * last one possibly shorter, so a damaged download only fetches the
+ * blocks that do not match again:
+ *
+ *   "blocks" : { "size" : 1048576, "SHA256" : [ ..., ... ] }
+ *
+ * The manifest installed with the program can be overridden by one
+ * fetched from manifest-url, which falls back to it when offline.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+#include <json-glib/json-glib.h>
+
+#include "define.h"
+#include "viewer-installer-config.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-trace.h"
+#include "viewer-installer-transfer.h"
+
+#define JSON_FILE "hancom-viewer-installer/viewer-installer-infos.json"
+
+/* A remote manifest is in the way of the window, it gets little time */
+#define FETCH_CONNECT_TIMEOUT 5
+#define FETCH_TIMEOUT 15
+#define FETCH_MAX_SIZE (4 * 1024 * 1024)
+
+#define FETCH_GROUP "manifest"
+
+/* Blocks are hashed whole in memory */
+#define BLOCK_SIZE_MIN (64 * 1024)
+#define BLOCK_SIZE_MAX (64 * 1024 * 1024)
+
+struct _ViewerInstallerManifest
+{
+    gint       ref_count;
+    GPtrArray *packages;
+};
+
+G_DEFINE_BOXED_TYPE (ViewerInstallerManifest, viewer_installer_manifest,
+                     viewer_installer_manifest_ref, viewer_installer_manifest_unref)
+
+static void
+viewer_installer_delta_free (ViewerInstallerDelta *delta)
+{
+    g_free (delta->from);
+    g_free (delta->format);
+    g_free (delta->file_name);
+    g_free (delta->sha256);
+    g_free (delta->source_sha256);
+    g_free (delta);
+}
+
+static void
+viewer_installer_package_free (ViewerInstallerPackage *package)
+{
+    g_free (package->name);
+    g_free (package->version);
+    g_free (package->file_name);
+    g_free (package->md5);
+    g_free (package->sha256);
+    g_ptr_array_unref (package->depends);
+    g_ptr_array_unref (package->deltas);
+    g_ptr_array_unref (package->blocks);
+    g_free (package);
+}
+
+static gchar *
+viewer_installer_manifest_dup_member (JsonObject *object,
+                                      const gchar *member)
+{
+    JsonNode *json_node = json_object_get_member (object, member);
+
+    if (json_node == NULL || !JSON_NODE_HOLDS_VALUE (json_node))
+        return NULL;
+
+    return g_strdup (json_node_get_string (json_node));
+}
+
+/* File names end up under OUT_PATH, where they are deleted and written */
+static gboolean
+viewer_installer_manifest_is_file_name (const gchar *file_name)
+{
+    return file_name != NULL && *file_name != '\0' &&
+           strchr (file_name, '/') == NULL &&
+           g_strcmp0 (file_name, ".") != 0 &&
+           g_strcmp0 (file_name, "..") != 0;
+}
+
+/* A block list that cannot be used is dropped, the whole-file hash still
+ * checks the download */
+static void
+viewer_installer_manifest_parse_blocks (ViewerInstallerPackage *package,
+                                        JsonObject *json_blocks)
+{
+    JsonArray *array;
+    guint i;
+
+    if (json_blocks == NULL || !json_object_has_member (json_blocks, "SHA256"))
+        goto invalid;
+
+    package->block_size = json_object_get_int_member (json_blocks, "size");
+    if (package->block_size < BLOCK_SIZE_MIN || BLOCK_SIZE_MAX < package->block_size)
+        goto invalid;
+
+    array = json_object_get_array_member (json_blocks, "SHA256");
+    for (i = 0; array && i < json_array_get_length (array); i++)
+    {
+        const gchar *sha256 = json_array_get_string_element (array, i);
+
+        if (!sha256 || strlen (sha256) != 64 || strspn (sha256, "0123456789abcdefABCDEF") != 64)
+            goto invalid;
+
+        g_ptr_array_add (package->blocks, g_strdup (sha256));
+    }
+
+    if (package->blocks->len > 0)
+        return;
+
+invalid:
+    g_warning ("Ignoring invalid block list of %s", package->name);
+    g_ptr_array_set_size (package->blocks, 0);
+    package->block_size = 0;
+}
+
+static ViewerInstallerPackage *
+viewer_installer_manifest_parse_package (JsonNode *json_node,
+                                         GError **error)
+{
+    ViewerInstallerPackage *package;
+    JsonObject *json_item;
+    guint i;
+
+    if (!JSON_NODE_HOLDS_OBJECT (json_node))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Package entry is not an object");
+        return NULL;
+    }
+    json_item = json_node_get_object (json_node);
+
+    package = g_new0 (ViewerInstallerPackage, 1);
+    package->name = viewer_installer_manifest_dup_member (json_item, "name");
+    package->version = viewer_installer_manifest_dup_member (json_item, "version");
+    package->file_name = viewer_installer_manifest_dup_member (json_item, "file-name");
+    package->md5 = viewer_installer_manifest_dup_member (json_item, "MD5");
+    package->sha256 = viewer_installer_manifest_dup_member (json_item, "SHA256");
+    package->depends = g_ptr_array_new_with_free_func (g_free);
+    package->deltas = g_ptr_array_new_with_free_func ((GDestroyNotify) viewer_installer_delta_free);
+    package->blocks = g_ptr_array_new_with_free_func (g_free);
+
+    if (package->name == NULL || package->file_name == NULL)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Package entry without a name or file-name");
+        viewer_installer_package_free (package);
+        return NULL;
+    }
+
+    if (!viewer_installer_manifest_is_file_name (package->file_name))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "Package %s has an invalid file-name", package->name);
+        viewer_installer_package_free (package);
+        return NULL;
+    }
+
+    if (json_object_has_member (json_item, "dependency"))
+    {
+        JsonArray *array = json_object_get_array_member (json_item, "dependency");
+
+        for (i = 0; array && i < json_array_get_length (array); i++)
+        {
+            const gchar *depend = json_array_get_string_element (array, i);
+            if (depend)
+                g_ptr_array_add (package->depends, g_strdup (depend));
+        }
+    }
+
+    if (json_object_has_member (json_item, "deltas"))
+    {
+        JsonArray *array = json_object_get_array_member (json_item, "deltas");
+
+        for (i = 0; array && i < json_array_get_length (array); i++)
+        {
+            JsonObject *json_delta = json_array_get_object_element (array, i);
+            ViewerInstallerDelta *delta;
+
+            if (json_delta == NULL)
+                continue;
+
+            delta = g_new0 (ViewerInstallerDelta, 1);
+            delta->from = viewer_installer_manifest_dup_member (json_delta, "from");
+            delta->format = viewer_installer_manifest_dup_member (json_delta, "format");
+            delta->file_name = viewer_installer_manifest_dup_member (json_delta, "file-name");
+            delta->sha256 = viewer_installer_manifest_dup_member (json_delta, "SHA256");
+            delta->source_sha256 = viewer_installer_manifest_dup_member (json_delta, "source-SHA256");
+
+            /* A patch is only worth anything if its result can be checked */
+            if (!delta->from || !delta->format || !delta->file_name || !delta->sha256 || !package->sha256)
+            {
+                g_warning ("Ignoring incomplete delta of %s", package->name);
+                viewer_installer_delta_free (delta);
+                continue;
+            }
+
+            if (!viewer_installer_manifest_is_file_name (delta->file_name))
+            {
+                g_warning ("Ignoring delta of %s with an invalid file-name", package->name);
+                viewer_installer_delta_free (delta);
+                continue;
+            }
+            g_ptr_array_add (package->deltas, delta);
+        }
+    }
+
+    if (json_object_has_member (json_item, "blocks"))
+        viewer_installer_manifest_parse_blocks (package, json_object_get_object_member (json_item, "blocks"));
+
+    return package;
+}
+
+/* Kahn's algorithm; ties keep the manifest order */
+static gboolean
+viewer_installer_manifest_sort (ViewerInstallerManifest *manifest,
+                                GError **error)
+{
+    GPtrArray *sorted;
+    GHashTable *placed;
+    guint i, j;
+
+    sorted = g_ptr_array_new_full (manifest->packages->len, (GDestroyNotify) viewer_installer_package_free);
+    placed = g_hash_table_new (g_str_hash, g_str_equal);
+
+    while (sorted->len < manifest->packages->len)
+    {
+        ViewerInstallerPackage *next = NULL;
+
+        for (i = 0; i < manifest->packages->len && next == NULL; i++)
+        {
+            ViewerInstallerPackage *package = g_ptr_array_index (manifest->packages, i);
+
+            if (g_hash_table_contains (placed, package->name))
+                continue;
+
+            for (j = 0; j < package->depends->len; j++)
+            {
+                const gchar *depend = g_ptr_array_index (package->depends, j);
+
+                if (viewer_installer_manifest_lookup (manifest, depend) &&
+                    !g_hash_table_contains (placed, depend))
+                    break;
+            }
+
+            if (j == package->depends->len)
+                next = package;
+        }
+
+        if (next == NULL)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Dependency cycle in the package manifest");
+            g_hash_table_unref (placed);
+            g_ptr_array_set_free_func (sorted, NULL);
+            g_ptr_array_unref (sorted);
+            return FALSE;
+        }
+
+        g_hash_table_add (placed, next->name);
+        g_ptr_array_add (sorted, next);
+    }
+
+    g_hash_table_unref (placed);
+
+    /* The packages moved over to the sorted array */
+    g_ptr_array_set_free_func (manifest->packages, NULL);
+    g_ptr_array_unref (manifest->packages);
+    manifest->packages = sorted;
+
+    return TRUE;
+}
+
+static ViewerInstallerManifest *
+viewer_installer_manifest_new_from_parser (JsonParser *json_parser,
+                                           GError **error)
+{
+    g_autoptr(ViewerInstallerManifest) manifest = NULL;
+    ViewerInstallerPackage *package;
+    JsonNode *json_root;
+    JsonObject *json_item;
+    guint i;
+
+    json_root = json_parser_get_root (json_parser);
+    if (json_root == NULL || !JSON_NODE_HOLDS_OBJECT (json_root))
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Package manifest is not an object");
+        return NULL;
+    }
+    json_item = json_node_get_object (json_root);
+
+    manifest = g_new0 (ViewerInstallerManifest, 1);
+    manifest->ref_count = 1;
+    manifest->packages = g_ptr_array_new_with_free_func ((GDestroyNotify) viewer_installer_package_free);
+
+    if (json_object_has_member (json_item, "packages"))
+    {
+        JsonArray *array = json_object_get_array_member (json_item, "packages");
+
+        for (i = 0; array && i < json_array_get_length (array); i++)
+        {
+            package = viewer_installer_manifest_parse_package (json_array_get_element (array, i), error);
+            if (package == NULL)
+                return NULL;
+
+            if (viewer_installer_manifest_lookup (manifest, package->name))
+            {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             "Package %s is listed twice", package->name);
+                viewer_installer_package_free (package);
+                return NULL;
+            }
+            g_ptr_array_add (manifest->packages, package);
+        }
+    }
+    else if (json_object_has_member (json_item, "package"))
+    {
+        package = viewer_installer_manifest_parse_package (json_object_get_member (json_item, "package"), error);
+        if (package == NULL)
+            return NULL;
+        g_ptr_array_add (manifest->packages, package);
+    }
+
+    if (manifest->packages->len == 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Package manifest has no package");
+        return NULL;
+    }
+
+    if (!viewer_installer_manifest_sort (manifest, error))
+        return NULL;
+
+    return g_steal_pointer (&manifest);
+}
+
+ViewerInstallerManifest *
+viewer_installer_manifest_new_from_file (const gchar *filename,
+                                         GError **error)
+{
+    g_autoptr(JsonParser) json_parser = json_parser_new ();
+
+    if (!json_parser_load_from_file (json_parser, filename, error))
+        return NULL;
+
+    return viewer_installer_manifest_new_from_parser (json_parser, error);
+}
+
+/* The manifest installed with the program */
+ViewerInstallerManifest *
+viewer_installer_manifest_new_default (GError **error)
+{
+    g_autofree gchar *filename = g_strdup_printf ("%s/%s", LIBDIR, JSON_FILE);
+
+    return viewer_installer_manifest_new_from_file (filename, error);
+}
+
+ViewerInstallerManifest *
+viewer_installer_manifest_new_from_data (const gchar *data,
+                                         gssize length,
+                                         GError **error)
+{
+    g_autoptr(JsonParser) json_parser = json_parser_new ();
+
+    if (!json_parser_load_from_data (json_parser, data, length, error))
+        return NULL;
+
+    return viewer_installer_manifest_new_from_parser (json_parser, error);
+}
+
+/* Remote manifest */
+
+typedef struct
+{
+    gchar             *url;
+    gchar             *cache_file;  /* body of the last 200 */
+    gchar             *state_file;  /* its URL and validators */
+    CURL              *curl;
+    struct curl_slist *headers;
+    GByteArray        *body;
+    gchar             *etag;
+    gchar             *last_modified;
+    gint64             span;
+} ManifestFetch;
+
+static void
+manifest_fetch_free (ManifestFetch *fetch)
+{
+    g_free (fetch->url);
+    g_free (fetch->cache_file);
+    g_free (fetch->state_file);
+    g_clear_pointer (&fetch->curl, curl_easy_cleanup);
+    curl_slist_free_all (fetch->headers);
+    g_byte_array_unref (fetch->body);
+    g_free (fetch->etag);
+    g_free (fetch->last_modified);
+    g_free (fetch);
+}
+
+static size_t
+viewer_installer_manifest_fetch_write (char *ptr, size_t size, size_t nmemb, void *user_data)
+{
+    ManifestFetch *fetch = user_data;
+    size_t len = size * nmemb;
+
+    if (fetch->body->len + len > FETCH_MAX_SIZE)
+        return 0;
+
+    g_byte_array_append (fetch->body, (const guint8 *) ptr, len);
+    return len;
+}
+
+static size_t
+viewer_installer_manifest_fetch_header (char *buffer, size_t size, size_t nmemb, void *user_data)
+{
+    ManifestFetch *fetch = user_data;
+    g_autofree gchar *line = NULL;
+    g_auto(GStrv) data = NULL;
+
+    /* header lines are not nul-terminated */
+    line = g_strndup (buffer, size * nmemb);
+
+    /* Only the headers of the last response count, after a redirect */
+    if (g_str_has_prefix (line, "HTTP/"))
+    {
+        g_clear_pointer (&fetch->etag, g_free);
+        g_clear_pointer (&fetch->last_modified, g_free);
+        return size * nmemb;
+    }
+
+    data = g_strsplit (line, ":", 2);
+    if (data[0] && data[1])
+    {
+        gchar *value = g_strstrip (data[1]);
+
+        if (g_ascii_strcasecmp (data[0], "ETag") == 0)
+        {
+            g_free (fetch->etag);
+            fetch->etag = g_strdup (value);
+        }
+        else if (g_ascii_strcasecmp (data[0], "Last-Modified") == 0)
+        {
+            g_free (fetch->last_modified);
+            fetch->last_modified = g_strdup (value);
+        }
+    }
+
+    return size * nmemb;
+}
+
+/* The cached copy, as long as it came from the same URL */
+static ViewerInstallerManifest *
+viewer_installer_manifest_fetch_load_cache (ManifestFetch *fetch,
+                                            GError **error)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+    g_autofree gchar *url = NULL;
+
+    if (!g_key_file_load_from_file (keyfile, fetch->state_file, G_KEY_FILE_NONE, error))
+        return NULL;
+
+    url = g_key_file_get_string (keyfile, FETCH_GROUP, "url", NULL);
+    if (g_strcmp0 (url, fetch->url) != 0)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No cached manifest for %s", fetch->url);
+        return NULL;
+    }
+
+    return viewer_installer_manifest_new_from_file (fetch->cache_file, error);
+}
+
+/* The state goes last, so it never describes another body. Kept even
+ * without validators, as the copy to use offline */
+static void
+viewer_installer_manifest_fetch_save_cache (ManifestFetch *fetch)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+    g_autofree gchar *dirname = g_path_get_dirname (fetch->cache_file);
+    g_autofree gchar *data = NULL;
+    g_autoptr(GError) error = NULL;
+
+    g_unlink (fetch->state_file);
+
+    if (g_mkdir_with_parents (dirname, 0700) != 0 ||
+        !g_file_set_contents (fetch->cache_file, (const gchar *) fetch->body->data, fetch->body->len, &error))
+    {
+        g_warning ("Could not cache the package manifest in %s: %s",
+                   dirname, error ? error->message : g_strerror (errno));
+        return;
+    }
+
+    g_key_file_set_string (keyfile, FETCH_GROUP, "url", fetch->url);
+    if (fetch->etag)
+        g_key_file_set_string (keyfile, FETCH_GROUP, "etag", fetch->etag);
+    if (fetch->last_modified)
+        g_key_file_set_string (keyfile, FETCH_GROUP, "last-modified", fetch->last_modified);
+
+    data = g_key_file_to_data (keyfile, NULL, NULL);
+    if (!g_file_set_contents (fetch->state_file, data, -1, NULL))
+        g_warning ("Could not save the manifest validators to %s", fetch->state_file);
+}
+
+/* Conditional request headers for the cached copy */
+static void
+viewer_installer_manifest_fetch_add_validators (ManifestFetch *fetch)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+    g_autofree gchar *url = NULL;
+    g_autofree gchar *etag = NULL;
+    g_autofree gchar *last_modified = NULL;
+
+    if (!g_key_file_load_from_file (keyfile, fetch->state_file, G_KEY_FILE_NONE, NULL) ||
+        !g_file_test (fetch->cache_file, G_FILE_TEST_IS_REGULAR))
+        return;
+
+    url = g_key_file_get_string (keyfile, FETCH_GROUP, "url", NULL);
+    if (g_strcmp0 (url, fetch->url) != 0)
+        return;
+
+    etag = g_key_file_get_string (keyfile, FETCH_GROUP, "etag", NULL);
+    last_modified = g_key_file_get_string (keyfile, FETCH_GROUP, "last-modified", NULL);
+
+    if (etag)
+    {
+        g_autofree gchar *header = g_strdup_printf ("If-None-Match: %s", etag);
+        fetch->headers = curl_slist_append (fetch->headers, header);
+    }
+    if (last_modified)
+    {
+        g_autofree gchar *header = g_strdup_printf ("If-Modified-Since: %s", last_modified);
+        fetch->headers = curl_slist_append (fetch->headers, header);
+    }
+}
+
+/* What the fetch could not get: the cached copy, then the bundled one */
+static void
+viewer_installer_manifest_fetch_fallback (GTask *task)
+{
+    ManifestFetch *fetch = g_task_get_task_data (task);
+    ViewerInstallerManifest *manifest;
+    GError *error = NULL;
+
+    manifest = viewer_installer_manifest_fetch_load_cache (fetch, NULL);
+    if (manifest == NULL)
+        manifest = viewer_installer_manifest_new_default (&error);
+
+    if (manifest == NULL)
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    g_task_return_pointer (task, manifest, (GDestroyNotify) viewer_installer_manifest_unref);
+}
+
+static void
+viewer_installer_manifest_fetch_done (CURL *curl,
+                                      CURLcode result,
+                                      gpointer user_data)
+{
+    g_autoptr(GTask) task = user_data;
+    ManifestFetch *fetch = g_task_get_task_data (task);
+    ViewerInstallerManifest *manifest = NULL;
+    GError *error = NULL;
+    long code = 0;
+
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+    g_clear_pointer (&fetch->curl, curl_easy_cleanup);
+
+    viewer_installer_trace_end (fetch->span, "manifest-fetch", fetch->url);
+
+    if (g_task_return_error_if_cancelled (task))
+        return;
+
+    if (!viewer_installer_transfer_propagate (result, NULL, &error))
+    {
+        g_warning ("Could not fetch the package manifest from %s: %s", fetch->url, error->message);
+        g_clear_error (&error);
+        viewer_installer_manifest_fetch_fallback (task);
+        return;
+    }
+
+    /* The cached copy is still current */
+    if (code == 304)
+    {
+        manifest = viewer_installer_manifest_fetch_load_cache (fetch, &error);
+        if (manifest == NULL)
+        {
+            g_warning ("Could not load the cached package manifest: %s", error->message);
+            g_clear_error (&error);
+            g_unlink (fetch->state_file);
+            viewer_installer_manifest_fetch_fallback (task);
+            return;
+        }
+
+        g_task_return_pointer (task, manifest, (GDestroyNotify) viewer_installer_manifest_unref);
+        return;
+    }
+
+    manifest = viewer_installer_manifest_new_from_data ((const gchar *) fetch->body->data, fetch->body->len, &error);
+    if (manifest == NULL)
+    {
+        g_warning ("%s: %s", fetch->url, error->message);
+        g_clear_error (&error);
+        viewer_installer_manifest_fetch_fallback (task);
+        return;
+    }
+
+    viewer_installer_manifest_fetch_save_cache (fetch);
+    g_task_return_pointer (task, manifest, (GDestroyNotify) viewer_installer_manifest_unref);
+}
+
+/* Fetches the manifest at @url on the transfer engine, https only, also
+ * after redirects. A copy is kept in the user's cache directory and
+ * revalidated with If-None-Match and If-Modified-Since, so an unchanged
+ * manifest costs a 304. When the fetch fails, the cached copy and then
+ * the bundled manifest are used instead */
+void
+viewer_installer_manifest_fetch_async (const gchar *url,
+                                       GCancellable *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer user_data)
+{
+    g_autoptr(GTask) task = NULL;
+    ManifestFetch *fetch;
+    g_autofree gchar *cache_dir = NULL;
+
+    g_return_if_fail (url != NULL);
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, viewer_installer_manifest_fetch_async);
+
+    /* It picks the package installed as root, so only over TLS */
+    if (g_ascii_strncasecmp (url, "https://", 8) != 0)
+    {
+        ViewerInstallerManifest *manifest;
+        GError *error = NULL;
+
+        g_warning ("Ignoring manifest URL %s, it is not https", url);
+
+        manifest = viewer_installer_manifest_new_default (&error);
+        if (manifest == NULL)
+            g_task_return_error (task, error);
+        else
+            g_task_return_pointer (task, manifest, (GDestroyNotify) viewer_installer_manifest_unref);
+        return;
+    }
+
+    cache_dir = g_build_filename (g_get_user_cache_dir (), "hancom-viewer-installer", NULL);
+
+    fetch = g_new0 (ManifestFetch, 1);
+    fetch->url = g_strdup (url);
+    fetch->cache_file = g_build_filename (cache_dir, "manifest.json", NULL);
+    fetch->state_file = g_build_filename (cache_dir, "manifest.state", NULL);
+    fetch->body = g_byte_array_new ();
+    g_task_set_task_data (task, fetch, (GDestroyNotify) manifest_fetch_free);
+
+    fetch->curl = curl_easy_init ();
+    if (!fetch->curl)
+    {
+        viewer_installer_manifest_fetch_fallback (task);
+        return;
+    }
+
+    viewer_installer_manifest_fetch_add_validators (fetch);
+
+    curl_easy_setopt (fetch->curl, CURLOPT_URL, fetch->url);
+    curl_easy_setopt (fetch->curl, CURLOPT_REFERER, VIEWER_REFERER);
+    curl_easy_setopt (fetch->curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt (fetch->curl, CURLOPT_FOLLOWLOCATION, 1L);
+#if LIBCURL_VERSION_NUM >= 0x075500
+    curl_easy_setopt (fetch->curl, CURLOPT_PROTOCOLS_STR, "https");
+    curl_easy_setopt (fetch->curl, CURLOPT_REDIR_PROTOCOLS_STR, "https");
+#else
+    curl_easy_setopt (fetch->curl, CURLOPT_PROTOCOLS, (long) CURLPROTO_HTTPS);
+    curl_easy_setopt (fetch->curl, CURLOPT_REDIR_PROTOCOLS, (long) CURLPROTO_HTTPS);
+#endif
+    curl_easy_setopt (fetch->curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt (fetch->curl, CURLOPT_CONNECTTIMEOUT, (long) FETCH_CONNECT_TIMEOUT);
+    curl_easy_setopt (fetch->curl, CURLOPT_TIMEOUT, (long) FETCH_TIMEOUT);
+    if (fetch->headers)
+        curl_easy_setopt (fetch->curl, CURLOPT_HTTPHEADER, fetch->headers);
+    curl_easy_setopt (fetch->curl, CURLOPT_HEADERFUNCTION, viewer_installer_manifest_fetch_header);
+    curl_easy_setopt (fetch->curl, CURLOPT_HEADERDATA, fetch);
+    curl_easy_setopt (fetch->curl, CURLOPT_WRITEFUNCTION, viewer_installer_manifest_fetch_write);
+    curl_easy_setopt (fetch->curl, CURLOPT_WRITEDATA, fetch);
+
+    fetch->span = viewer_installer_trace_begin ();
+    viewer_installer_transfer_add (viewer_installer_transfer_get_default (), fetch->curl, cancellable,
+                                   viewer_installer_manifest_fetch_done, g_steal_pointer (&task));
+}
+
+ViewerInstallerManifest *
+viewer_installer_manifest_fetch_finish (GAsyncResult *result,
+                                        GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+ViewerInstallerManifest *
+viewer_installer_manifest_ref (ViewerInstallerManifest *manifest)
+{
+    g_return_val_if_fail (manifest != NULL, NULL);
+
+    g_atomic_int_inc (&manifest->ref_count);
+    return manifest;
+}
+
+void
+viewer_installer_manifest_unref (ViewerInstallerManifest *manifest)
+{
+    g_return_if_fail (manifest != NULL);
+
+    if (!g_atomic_int_dec_and_test (&manifest->ref_count))
+        return;
+
+    g_ptr_array_unref (manifest->packages);
+    g_free (manifest);
+}
+
+guint
+viewer_installer_manifest_get_n_packages (ViewerInstallerManifest *manifest)
+{
+    return manifest->packages->len;
+}
+
+/* @index counts in install order */
+const ViewerInstallerPackage *
+viewer_installer_manifest_get_package (ViewerInstallerManifest *manifest,
+                                       guint index)
+{
+    g_return_val_if_fail (index < manifest->packages->len, NULL);
+
+    return g_ptr_array_index (manifest->packages, index);
+}
+
+const ViewerInstallerPackage *
+viewer_installer_manifest_lookup (ViewerInstallerManifest *manifest,
+                                  const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < manifest->packages->len; i++)
+    {
+        ViewerInstallerPackage *package = g_ptr_array_index (manifest->packages, i);
+        if (g_strcmp0 (package->name, name) == 0)
+            return package;
+    }
+
+    return NULL;
+}
+
+/* The package that is installed last, the one the others are there for */
+const ViewerInstallerPackage *
+viewer_installer_manifest_get_main (ViewerInstallerManifest *manifest)
+{
+    return g_ptr_array_index (manifest->packages, manifest->packages->len - 1);
+}
@@ -0,0 +1,84 @@
+/* viewer-installer-manifest.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define VIEWER_INSTALLER_TYPE_MANIFEST (viewer_installer_manifest_get_type ())
+
+/* A patch from an older version to the package, see viewer-installer-delta.c */
+typedef struct
+{
+    gchar     *from;
+    gchar     *format;
+    gchar     *file_name;
+    gchar     *sha256;
+    gchar     *source_sha256;
+} ViewerInstallerDelta;
+
+typedef struct
+{
+    gchar     *name;
+    gchar     *version;
+    gchar     *file_name;
+    gchar     *md5;
+    gchar     *sha256;
+
+    /* Names of the packages this one depends on, in or out of the
+     * manifest; only the ones in it order the install */
+    GPtrArray *depends;
+
+    GPtrArray *deltas;
+
+    /* SHA-256 of each block_size piece of the file, in order, or empty */
+    gint64     block_size;
+    GPtrArray *blocks;
+} ViewerInstallerPackage;
+
+typedef struct _ViewerInstallerManifest ViewerInstallerManifest;
+
+GType                         viewer_installer_manifest_get_type      (void) G_GNUC_CONST;
+
+ViewerInstallerManifest      *viewer_installer_manifest_new_default   (GError                  **error);
+ViewerInstallerManifest      *viewer_installer_manifest_new_from_file (const gchar              *filename,
+                                                                      GError                  **error);
+ViewerInstallerManifest      *viewer_installer_manifest_new_from_data (const gchar              *data,
+                                                                      gssize                    length,
+                                                                      GError                  **error);
+void                          viewer_installer_manifest_fetch_async   (const gchar              *url,
+                                                                      GCancellable             *cancellable,
+                                                                      GAsyncReadyCallback       callback,
+                                                                      gpointer                  user_data);
+ViewerInstallerManifest      *viewer_installer_manifest_fetch_finish  (GAsyncResult             *result,
+                                                                      GError                  **error);
+ViewerInstallerManifest      *viewer_installer_manifest_ref           (ViewerInstallerManifest  *manifest);
+void                          viewer_installer_manifest_unref         (ViewerInstallerManifest  *manifest);
+
+guint                         viewer_installer_manifest_get_n_packages (ViewerInstallerManifest *manifest);
+const ViewerInstallerPackage *viewer_installer_manifest_get_package    (ViewerInstallerManifest *manifest,
+                                                                        guint                    index);
+const ViewerInstallerPackage *viewer_installer_manifest_lookup         (ViewerInstallerManifest *manifest,
+                                                                        const gchar             *name);
+const ViewerInstallerPackage *viewer_installer_manifest_get_main       (ViewerInstallerManifest *manifest);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ViewerInstallerManifest, viewer_installer_manifest_unref)
+
+G_END_DECLS
@@ -0,0 +1,262 @@
+/* viewer-installer-metrics.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The last run in the text format of Prometheus, for node_exporter's
+ * textfile collector. The collector reads every *.prom file of its
+ * directory on each scrape. The file is written next to METRICS_FILE
+ * under a temporary name and renamed over it, so a scrape sees the
+ * previous run or this one, never half of it.
+ */
+
+#include "utils.h"
+#include "viewer-installer-dpkg.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-metrics.h"
+
+#define METRICS_PREFIX "hancom_viewer_installer_"
+
+/* What became of a package once the run is over */
+static const gchar *package_states[N_STATUS] =
+{
+    [STATUS_NORMAL]      = "pending",
+    [STATUS_DOWNLOADING] = "interrupted",
+    [STATUS_DOWNLOADED]  = "interrupted",
+    [STATUS_INSTALLING]  = "interrupted",
+    [STATUS_INSTALLED]   = "installed",
+    [STATUS_CANCEL]      = "cancelled",
+    [STATUS_ERROR]       = "error",
+};
+
+static void
+viewer_installer_metrics_family (GString *out,
+                                 const gchar *name,
+                                 const gchar *type,
+                                 const gchar *help)
+{
+    g_string_append_printf (out, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+    g_string_append_printf (out, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+}
+
+/* Appends name="value" to @labels, escaped as the format wants it */
+static void
+viewer_installer_metrics_label (GString *labels,
+                                const gchar *name,
+                                const gchar *value)
+{
+    const gchar *p;
+
+    if (labels->len)
+        g_string_append_c (labels, ',');
+
+    g_string_append_printf (labels, "%s=\"", name);
+    for (p = value; *p; p++)
+    {
+        if (*p == '\\' || *p == '"')
+            g_string_append_printf (labels, "\\%c", *p);
+        else if (*p == '\n')
+            g_string_append (labels, "\\n");
+        else
+            g_string_append_c (labels, *p);
+    }
+    g_string_append_c (labels, '"');
+}
+
+static void
+viewer_installer_metrics_sample (GString *out,
+                                 const gchar *name,
+                                 GString *labels,
+                                 gdouble value)
+{
+    gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_string_append (out, METRICS_PREFIX);
+    g_string_append (out, name);
+    if (labels && labels->len)
+        g_string_append_printf (out, "{%s}", labels->str);
+
+    /* Not printf, a decimal comma would break the file */
+    g_string_append_printf (out, " %s\n", g_ascii_dtostr (buffer, sizeof (buffer), value));
+}
+
+static void
+viewer_installer_metrics_run (GString *out,
+                              ViewerInstallerScheduler *scheduler)
+{
+    g_autoptr(GString) labels = g_string_new (NULL);
+    ViewerInstallerSchedulerTiming timing;
+    guint status;
+
+    g_object_get (scheduler, "status", &status, NULL);
+    viewer_installer_scheduler_get_timing (scheduler, &timing);
+
+    viewer_installer_metrics_family (out, "last_run_timestamp_seconds", "gauge",
+                                     "When the last run ended");
+    viewer_installer_metrics_sample (out, "last_run_timestamp_seconds", NULL,
+                                     g_get_real_time () / G_USEC_PER_SEC);
+
+    viewer_installer_metrics_family (out, "last_run_success", "gauge",
+                                     "Whether every package of the last run is installed");
+    viewer_installer_metrics_sample (out, "last_run_success", NULL, status == STATUS_INSTALLED);
+
+    viewer_installer_metrics_family (out, "last_run_info", "gauge",
+                                     "Outcome and error class of the last run");
+    viewer_installer_metrics_label (labels, "outcome", package_states[status]);
+    viewer_installer_metrics_label (labels, "error", status == STATUS_ERROR ?
+                                    install_error_to_string (viewer_installer_scheduler_get_error_class (scheduler)) :
+                                    "none");
+    viewer_installer_metrics_sample (out, "last_run_info", labels, 1);
+
+    viewer_installer_metrics_family (out, "last_run_duration_seconds", "gauge",
+                                     "Time of the last run, overall and with a download or an install running");
+    g_string_truncate (labels, 0);
+    viewer_installer_metrics_label (labels, "phase", "wall");
+    viewer_installer_metrics_sample (out, "last_run_duration_seconds", labels, timing.wall);
+    g_string_truncate (labels, 0);
+    viewer_installer_metrics_label (labels, "phase", "download");
+    viewer_installer_metrics_sample (out, "last_run_duration_seconds", labels, timing.download);
+    g_string_truncate (labels, 0);
+    viewer_installer_metrics_label (labels, "phase", "install");
+    viewer_installer_metrics_sample (out, "last_run_duration_seconds", labels, timing.install);
+    g_string_truncate (labels, 0);
+    viewer_installer_metrics_label (labels, "phase", "overlap");
+    viewer_installer_metrics_sample (out, "last_run_duration_seconds", labels, timing.overlap);
+
+    viewer_installer_metrics_family (out, "last_run_received_bytes", "gauge",
+                                     "Bytes received from the CDN and peers in the last run");
+    viewer_installer_metrics_sample (out, "last_run_received_bytes", NULL,
+                                     viewer_installer_scheduler_get_received_bytes (scheduler));
+}
+
+static void
+viewer_installer_metrics_packages (GString *out,
+                                   ViewerInstallerScheduler *scheduler)
+{
+    static const struct
+    {
+        const gchar *name;
+        const gchar *help;
+    } families[] =
+    {
+        { "package_state", "What became of the package in the last run" },
+        { "package_download_seconds", "Time all download attempts of the package took" },
+        { "package_install_seconds", "Time dpkg or apt took for the package" },
+        { "package_retries", "Download attempts after the first" },
+    };
+    ViewerInstallerManifest *manifest = viewer_installer_scheduler_get_manifest (scheduler);
+    GPtrArray *view_models = viewer_installer_scheduler_get_view_models (scheduler);
+    g_autoptr(GString) labels = g_string_new (NULL);
+    guint f, i;
+
+    if (!manifest)
+        return;
+
+    /* Families are kept together, as the format asks */
+    for (f = 0; f < G_N_ELEMENTS (families); f++)
+    {
+        viewer_installer_metrics_family (out, families[f].name, "gauge", families[f].help);
+
+        for (i = 0; i < view_models->len; i++)
+        {
+            const ViewerInstallerPackage *package = viewer_installer_manifest_get_package (manifest, i);
+            ViewerInstallerWindowViewModel *view_model = g_ptr_array_index (view_models, i);
+            guint status = STATUS_NORMAL;
+            gint64 install_time;
+
+            g_string_truncate (labels, 0);
+            viewer_installer_metrics_label (labels, "package", package->name);
+
+            if (f == 0)
+            {
+                if (view_model)
+                    g_object_get (view_model, "status", &status, NULL);
+                viewer_installer_metrics_label (labels, "state", view_model ? package_states[status] : "skipped");
+                viewer_installer_metrics_sample (out, families[f].name, labels, 1);
+                continue;
+            }
+
+            if (!view_model)
+                continue;
+
+            switch (f)
+            {
+                case 1:
+                    viewer_installer_metrics_sample (out, families[f].name, labels,
+                                                     viewer_installer_window_view_model_get_download_time (view_model));
+                    break;
+                case 2:
+                    install_time = viewer_installer_window_view_model_get_install_time (view_model);
+                    if (0 <= install_time)
+                        viewer_installer_metrics_sample (out, families[f].name, labels, install_time / 1000.0);
+                    break;
+                case 3:
+                    viewer_installer_metrics_sample (out, families[f].name, labels,
+                                                     viewer_installer_window_view_model_get_retries (view_model));
+                    break;
+            }
+        }
+    }
+}
+
+/* What dpkg has now, whatever the run did */
+static void
+viewer_installer_metrics_versions (GString *out,
+                                   ViewerInstallerScheduler *scheduler)
+{
+    ViewerInstallerManifest *manifest = viewer_installer_scheduler_get_manifest (scheduler);
+    g_autoptr(GString) labels = g_string_new (NULL);
+    guint i;
+
+    viewer_installer_metrics_family (out, "installed_version_info", "gauge",
+                                     "Version of the packages of the manifest dpkg has installed");
+
+    for (i = 0; manifest && i < viewer_installer_manifest_get_n_packages (manifest); i++)
+    {
+        const ViewerInstallerPackage *package = viewer_installer_manifest_get_package (manifest, i);
+        g_autofree gchar *version = viewer_installer_dpkg_get_version (package->name);
+
+        if (!version)
+            continue;
+
+        g_string_truncate (labels, 0);
+        viewer_installer_metrics_label (labels, "package", package->name);
+        viewer_installer_metrics_label (labels, "version", version);
+        viewer_installer_metrics_sample (out, "installed_version_info", labels, 1);
+    }
+}
+
+/* Writes METRICS_FILE into @directory for the finished run of @scheduler */
+gboolean
+viewer_installer_metrics_write (ViewerInstallerScheduler *scheduler,
+                                const gchar *directory,
+                                GError **error)
+{
+    g_autoptr(GString) out = g_string_new (NULL);
+    g_autofree gchar *path = NULL;
+
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), FALSE);
+    g_return_val_if_fail (directory != NULL, FALSE);
+
+    viewer_installer_metrics_run (out, scheduler);
+    viewer_installer_metrics_packages (out, scheduler);
+    viewer_installer_metrics_versions (out, scheduler);
+
+    /* Temporary file and rename(), see the top of the file */
+    path = g_build_filename (directory, METRICS_FILE, NULL);
+    return g_file_set_contents (path, out->str, out->len, error);
+}
@@ -0,0 +1,33 @@
+/* viewer-installer-metrics.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "viewer-installer-scheduler.h"
+
+G_BEGIN_DECLS
+
+#define METRICS_FILE "hancom-viewer-installer.prom"
+
+gboolean viewer_installer_metrics_write (ViewerInstallerScheduler  *scheduler,
+                                         const gchar               *directory,
+                                         GError                   **error);
+
+G_END_DECLS
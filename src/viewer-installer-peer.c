@@ -0,0 +1,561 @@
+/* viewer-installer-peer.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LAN peer cache.
+ *
+ * A peer serves the packages of its cache directory over plain HTTP as
+ * /<sha256>.deb, with HEAD and single byte ranges so the normal check and
+ * segmented download work against it unchanged. Clients find peers in a
+ * configured list and by multicasting "HVI-QUERY <sha256>"; every peer
+ * that has the file answers "HVI-PEER <port> <sha256>" to the sender.
+ * Nothing a peer sends is trusted, the download is verified against the
+ * manifest SHA-256 like any other.
+ */
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "define.h"
+#include "utils.h"
+#include "viewer-installer-cache.h"
+#include "viewer-installer-config.h"
+#include "viewer-installer-peer.h"
+
+#define PEER_QUERY          "HVI-QUERY"
+#define PEER_ANSWER         "HVI-PEER"
+#define PEER_MAX_THREADS    8
+#define PEER_BUFFER_SIZE    (64 * 1024)
+
+/* Seconds a client may stay silent, and what a request may take up;
+ * the download sends a request line and a few headers */
+#define PEER_TIMEOUT        5
+#define PEER_MAX_REQUEST    (8 * 1024)
+#define PEER_MAX_HEADERS    32
+
+typedef struct
+{
+    gchar    *cache_dir;
+    guint     port;
+
+    GSocket  *multicast;
+    GSource  *multicast_source;
+    GSocketService *service;
+} ViewerInstallerPeer;
+
+static gchar *
+viewer_installer_peer_find_file (ViewerInstallerPeer *peer,
+                                 const gchar *sha256)
+{
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *name = NULL;
+
+    path = viewer_installer_cache_get_path (sha256);
+    if (!path)
+        return NULL;
+
+    name = g_path_get_basename (path);
+    g_free (path);
+    path = g_build_filename (peer->cache_dir, name, NULL);
+
+    if (!g_file_test (path, G_FILE_TEST_IS_REGULAR))
+        return NULL;
+
+    return g_steal_pointer (&path);
+}
+
+static gboolean
+viewer_installer_peer_parse_range (const gchar *value,
+                                   goffset size,
+                                   goffset *start,
+                                   goffset *end)
+{
+    gchar *dash;
+    gchar *endptr;
+
+    if (!g_str_has_prefix (value, "bytes="))
+        return FALSE;
+
+    value += strlen ("bytes=");
+    dash = strchr (value, '-');
+    if (!dash || dash == value || strchr (value, ','))
+        return FALSE;
+
+    *start = g_ascii_strtoll (value, &endptr, 10);
+    if (endptr != dash)
+        return FALSE;
+
+    if (*(dash + 1) == '\0')
+    {
+        *end = size - 1;
+    }
+    else
+    {
+        *end = g_ascii_strtoll (dash + 1, &endptr, 10);
+        if (*endptr != '\0')
+            return FALSE;
+    }
+
+    *end = MIN (*end, size - 1);
+    return (0 <= *start && *start <= *end);
+}
+
+static void
+viewer_installer_peer_respond (GOutputStream *out,
+                               const gchar *status,
+                               const gchar *headers)
+{
+    g_autofree gchar *response = NULL;
+
+    response = g_strdup_printf ("HTTP/1.1 %s\r\n"
+                                "Server: " GETTEXT_PACKAGE "\r\n"
+                                "Connection: close\r\n"
+                                "%s\r\n",
+                                status, headers ? headers : "Content-Length: 0\r\n");
+    g_output_stream_write_all (out, response, strlen (response), NULL, NULL, NULL);
+}
+
+/* Reads up to the empty line ending the headers. NULL when the client
+ * went away or timed out, or with @too_large set when it sent more than
+ * PEER_MAX_REQUEST bytes without one */
+static gchar *
+viewer_installer_peer_read_request (GInputStream *in,
+                                    gboolean *too_large)
+{
+    g_autofree gchar *buffer = g_malloc (PEER_MAX_REQUEST + 1);
+    gsize len = 0;
+
+    *too_large = FALSE;
+
+    while (len < PEER_MAX_REQUEST)
+    {
+        gssize n = g_input_stream_read (in, buffer + len, PEER_MAX_REQUEST - len, NULL, NULL);
+        if (n <= 0)
+            return NULL;
+
+        len += n;
+        buffer[len] = '\0';
+
+        if (strstr (buffer, "\r\n\r\n") || strstr (buffer, "\n\n"))
+            return g_steal_pointer (&buffer);
+    }
+
+    *too_large = TRUE;
+    return NULL;
+}
+
+static gboolean
+viewer_installer_peer_handle (GThreadedSocketService *service,
+                              GSocketConnection *connection,
+                              GObject *source_object,
+                              gpointer user_data)
+{
+    ViewerInstallerPeer *peer = user_data;
+    GOutputStream *out;
+    GFileInfo *info;
+    goffset size, start, end;
+    gboolean ranged = FALSE;
+    g_auto(GStrv) request = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autofree gchar *text = NULL;
+    g_autofree gchar *range = NULL;
+    g_autofree gchar *sha256 = NULL;
+    g_autofree gchar *path = NULL;
+    g_autoptr(GString) headers = NULL;
+    g_autoptr(GFile) file = NULL;
+    g_autoptr(GFileInputStream) file_in = NULL;
+    gboolean too_large;
+    guint i;
+
+    /* Any host on the LAN can connect, an idle one must not hold a thread */
+    g_socket_set_timeout (g_socket_connection_get_socket (connection), PEER_TIMEOUT);
+    out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+    text = viewer_installer_peer_read_request (g_io_stream_get_input_stream (G_IO_STREAM (connection)), &too_large);
+    if (!text)
+    {
+        if (too_large)
+            viewer_installer_peer_respond (out, "400 Bad Request", NULL);
+        return TRUE;
+    }
+
+    lines = g_strsplit (text, "\n", -1);
+    request = g_strsplit (g_strstrip (lines[0]), " ", 3);
+    if (g_strv_length (request) != 3)
+    {
+        viewer_installer_peer_respond (out, "400 Bad Request", NULL);
+        return TRUE;
+    }
+
+    /* Only the Range header matters */
+    for (i = 1; lines[i] && *g_strstrip (lines[i]) != '\0'; i++)
+    {
+        if (PEER_MAX_HEADERS < i)
+        {
+            viewer_installer_peer_respond (out, "400 Bad Request", NULL);
+            return TRUE;
+        }
+
+        if (g_ascii_strncasecmp (lines[i], "Range:", 6) == 0)
+        {
+            g_free (range);
+            range = g_strdup (g_strstrip (lines[i] + 6));
+        }
+    }
+
+    if (g_strcmp0 (request[0], "GET") != 0 && g_strcmp0 (request[0], "HEAD") != 0)
+    {
+        viewer_installer_peer_respond (out, "405 Method Not Allowed", NULL);
+        return TRUE;
+    }
+
+    if (request[1][0] == '/' && g_str_has_suffix (request[1], ".deb"))
+        sha256 = g_strndup (request[1] + 1, strlen (request[1]) - strlen ("/.deb"));
+
+    path = sha256 ? viewer_installer_peer_find_file (peer, sha256) : NULL;
+    if (!path)
+    {
+        viewer_installer_peer_respond (out, "404 Not Found", NULL);
+        return TRUE;
+    }
+
+    file = g_file_new_for_path (path);
+    file_in = g_file_read (file, NULL, NULL);
+    info = file_in ? g_file_input_stream_query_info (file_in, G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL, NULL) : NULL;
+    if (!info)
+    {
+        viewer_installer_peer_respond (out, "404 Not Found", NULL);
+        return TRUE;
+    }
+
+    size = g_file_info_get_size (info);
+    g_object_unref (info);
+
+    start = 0;
+    end = size - 1;
+
+    if (range)
+    {
+        ranged = viewer_installer_peer_parse_range (range, size, &start, &end);
+        if (!ranged)
+        {
+            g_autofree gchar *invalid = NULL;
+            invalid = g_strdup_printf ("Content-Range: bytes */%" G_GINT64_FORMAT "\r\n"
+                                       "Content-Length: 0\r\n", size);
+            viewer_installer_peer_respond (out, "416 Range Not Satisfiable", invalid);
+            return TRUE;
+        }
+    }
+
+    /* Checksum is what viewer_download_check looks for, and the hash is
+     * the strongest validator there is for resuming */
+    headers = g_string_new ("Content-Type: application/vnd.debian.binary-package\r\n");
+    g_string_append_printf (headers, "Content-Length: %" G_GINT64_FORMAT "\r\n", end - start + 1);
+    if (ranged)
+        g_string_append_printf (headers, "Content-Range: bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "\r\n",
+                                start, end, size);
+    g_string_append_printf (headers, "Accept-Ranges: bytes\r\n"
+                                     "ETag: \"%s\"\r\n"
+                                     "Checksum: %s\r\n",
+                            sha256, sha256);
+
+    viewer_installer_peer_respond (out, ranged ? "206 Partial Content" : "200 OK", headers->str);
+
+    if (g_strcmp0 (request[0], "HEAD") == 0)
+        return TRUE;
+
+    if (!g_seekable_seek (G_SEEKABLE (file_in), start, G_SEEK_SET, NULL, NULL))
+        return TRUE;
+
+    {
+        goffset left = end - start + 1;
+        g_autofree guchar *buffer = g_malloc (PEER_BUFFER_SIZE);
+
+        while (0 < left)
+        {
+            gssize n;
+
+            n = g_input_stream_read (G_INPUT_STREAM (file_in), buffer, MIN (PEER_BUFFER_SIZE, left), NULL, NULL);
+            if (n <= 0)
+                break;
+
+            if (!g_output_stream_write_all (out, buffer, n, NULL, NULL, NULL))
+                break;
+
+            left -= n;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+viewer_installer_peer_multicast_cb (GSocket *socket,
+                                    GIOCondition condition,
+                                    gpointer user_data)
+{
+    ViewerInstallerPeer *peer = user_data;
+    gssize n;
+    gchar buffer[256];
+    g_auto(GStrv) fields = NULL;
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *answer = NULL;
+    g_autoptr(GSocketAddress) sender = NULL;
+
+    n = g_socket_receive_from (socket, &sender, buffer, sizeof (buffer) - 1, NULL, NULL);
+    if (n <= 0)
+        return G_SOURCE_CONTINUE;
+
+    buffer[n] = '\0';
+    fields = g_strsplit (g_strstrip (buffer), " ", -1);
+    if (g_strv_length (fields) != 2 || g_strcmp0 (fields[0], PEER_QUERY) != 0)
+        return G_SOURCE_CONTINUE;
+
+    path = viewer_installer_peer_find_file (peer, fields[1]);
+    if (!path)
+        return G_SOURCE_CONTINUE;
+
+    answer = g_strdup_printf ("%s %u %s", PEER_ANSWER, peer->port, fields[1]);
+    g_socket_send_to (socket, sender, answer, strlen (answer), NULL, NULL);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+viewer_installer_peer_start (ViewerInstallerPeer *peer,
+                             GError **error)
+{
+    g_autoptr(GInetAddress) any = NULL;
+    g_autoptr(GInetAddress) group = NULL;
+    g_autoptr(GSocketAddress) address = NULL;
+
+    peer->service = g_threaded_socket_service_new (PEER_MAX_THREADS);
+    if (!g_socket_listener_add_inet_port (G_SOCKET_LISTENER (peer->service), peer->port, NULL, error))
+        return FALSE;
+
+    g_signal_connect (peer->service, "run", G_CALLBACK (viewer_installer_peer_handle), peer);
+    g_socket_service_start (peer->service);
+
+    /* Several peers on one host share the multicast port */
+    peer->multicast = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, error);
+    if (!peer->multicast)
+        return FALSE;
+
+    any = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+    address = g_inet_socket_address_new (any, PEER_MULTICAST_PORT);
+    if (!g_socket_bind (peer->multicast, address, TRUE, error))
+        return FALSE;
+
+    group = g_inet_address_new_from_string (PEER_MULTICAST_GROUP);
+    if (!g_socket_join_multicast_group (peer->multicast, group, FALSE, NULL, error))
+        return FALSE;
+
+    peer->multicast_source = g_socket_create_source (peer->multicast, G_IO_IN, NULL);
+    g_source_set_callback (peer->multicast_source,
+                           (GSourceFunc) viewer_installer_peer_multicast_cb, peer, NULL);
+    g_source_attach (peer->multicast_source, NULL);
+
+    return TRUE;
+}
+
+static void
+viewer_installer_peer_stop (ViewerInstallerPeer *peer)
+{
+    if (peer->multicast_source)
+    {
+        g_source_destroy (peer->multicast_source);
+        g_source_unref (peer->multicast_source);
+        peer->multicast_source = NULL;
+    }
+
+    g_clear_object (&peer->multicast);
+
+    if (peer->service)
+    {
+        g_socket_service_stop (peer->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (peer->service));
+        g_clear_object (&peer->service);
+    }
+}
+
+static void
+viewer_installer_peer_add_unique (GPtrArray *peers, gchar *peer)
+{
+    guint i;
+
+    for (i = 0; i < peers->len; i++)
+    {
+        if (g_strcmp0 (g_ptr_array_index (peers, i), peer) == 0)
+        {
+            g_free (peer);
+            return;
+        }
+    }
+
+    g_ptr_array_add (peers, peer);
+}
+
+/* Returns "host:port" strings of the peers that may have @sha256: the
+ * configured ones first, then those answering a multicast query within
+ * @timeout_ms. Blocks for at most @timeout_ms, or until @cancellable is
+ * cancelled. */
+GPtrArray *
+viewer_installer_peer_discover (const gchar *sha256,
+                                const gchar * const *configured,
+                                guint timeout_ms,
+                                GCancellable *cancellable)
+{
+    gint64 deadline;
+    GPtrArray *peers;
+    g_autofree gchar *query = NULL;
+    g_autoptr(GSocket) socket = NULL;
+    g_autoptr(GInetAddress) any = NULL;
+    g_autoptr(GInetAddress) group = NULL;
+    g_autoptr(GSocketAddress) local = NULL;
+    g_autoptr(GSocketAddress) destination = NULL;
+
+    peers = g_ptr_array_new_with_free_func (g_free);
+
+    for (; configured && *configured; configured++)
+    {
+        if (**configured)
+            viewer_installer_peer_add_unique (peers, g_strdup (*configured));
+    }
+
+    if (timeout_ms == 0 || g_cancellable_is_cancelled (cancellable))
+        return peers;
+
+    socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+    if (!socket)
+        return peers;
+
+    any = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+    local = g_inet_socket_address_new (any, 0);
+    if (!g_socket_bind (socket, local, FALSE, NULL))
+        return peers;
+
+    g_socket_set_multicast_loopback (socket, TRUE);
+    g_socket_set_blocking (socket, FALSE);
+
+    group = g_inet_address_new_from_string (PEER_MULTICAST_GROUP);
+    destination = g_inet_socket_address_new (group, PEER_MULTICAST_PORT);
+    query = g_strdup_printf ("%s %s", PEER_QUERY, sha256);
+
+    if (g_socket_send_to (socket, destination, query, strlen (query), NULL, NULL) < 0)
+        return peers;
+
+    deadline = g_get_monotonic_time () + timeout_ms * G_TIME_SPAN_MILLISECOND;
+
+    while (g_get_monotonic_time () < deadline)
+    {
+        gssize n;
+        gchar buffer[256];
+        g_auto(GStrv) fields = NULL;
+        g_autoptr(GSocketAddress) sender = NULL;
+
+        if (!g_socket_condition_timed_wait (socket, G_IO_IN, deadline - g_get_monotonic_time (), cancellable, NULL))
+            break;
+
+        n = g_socket_receive_from (socket, &sender, buffer, sizeof (buffer) - 1, cancellable, NULL);
+        if (n <= 0 || !G_IS_INET_SOCKET_ADDRESS (sender))
+            continue;
+
+        buffer[n] = '\0';
+        fields = g_strsplit (g_strstrip (buffer), " ", -1);
+        if (g_strv_length (fields) == 3 &&
+            g_strcmp0 (fields[0], PEER_ANSWER) == 0 &&
+            g_ascii_strcasecmp (fields[2], sha256) == 0)
+        {
+            GInetAddress *address = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (sender));
+            g_autofree gchar *host = g_inet_address_to_string (address);
+            guint64 port;
+
+            if (g_ascii_string_to_unsigned (fields[1], 10, 1, G_MAXUINT16, &port, NULL))
+                viewer_installer_peer_add_unique (peers, g_strdup_printf ("%s:%u", host, (guint) port));
+        }
+    }
+
+    return peers;
+}
+
+gchar *
+viewer_installer_peer_get_uri (const gchar *peer,
+                               const gchar *sha256)
+{
+    g_autofree gchar *key = g_ascii_strdown (sha256, -1);
+
+    return g_strdup_printf ("http://%s/%s.deb", peer, key);
+}
+
+static gint option_port = 0;
+static gchar *option_cache_dir = NULL;
+static gboolean option_peer_cache = FALSE;
+
+static GOptionEntry peer_entries[] =
+{
+    { "peer-cache", 0, 0, G_OPTION_ARG_NONE, &option_peer_cache, "Serve cached packages to other machines", NULL },
+    { "peer-port", 0, 0, G_OPTION_ARG_INT, &option_port, "HTTP port to serve on", "PORT" },
+    { "peer-cache-dir", 0, 0, G_OPTION_ARG_FILENAME, &option_cache_dir, "Directory to serve packages from", "DIR" },
+    { NULL }
+};
+
+int
+viewer_installer_peer_main (int argc,
+                            char *argv[])
+{
+    ViewerInstallerPeer peer = { 0, };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GMainLoop) loop = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GSettings) settings = NULL;
+
+    context = g_option_context_new ("- serve the package cache on the LAN");
+    g_option_context_add_main_entries (context, peer_entries, GETTEXT_PACKAGE);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+
+    settings = viewer_installer_settings_new ();
+    peer.port = PEER_DEFAULT_PORT;
+    if (settings)
+        peer.port = g_settings_get_uint (settings, "peer-port");
+    if (0 < option_port && option_port <= G_MAXUINT16)
+        peer.port = option_port;
+
+    peer.cache_dir = option_cache_dir ? option_cache_dir : g_strdup (VIEWER_CACHE_PATH);
+
+    if (!viewer_installer_peer_start (&peer, &error))
+    {
+        g_printerr ("Could not serve the peer cache: %s\n", error->message);
+        viewer_installer_peer_stop (&peer);
+        g_free (peer.cache_dir);
+        return 1;
+    }
+
+    g_message ("Serving %s on port %u", peer.cache_dir, peer.port);
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_main_loop_run (loop);
+
+    viewer_installer_peer_stop (&peer);
+    g_free (peer.cache_dir);
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* viewer-installer-peer.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define PEER_DEFAULT_PORT     7373
+#define PEER_MULTICAST_GROUP  "239.255.73.73"
+#define PEER_MULTICAST_PORT   7374
+
+GPtrArray *viewer_installer_peer_discover (const gchar         *sha256,
+                                           const gchar * const *peers,
+                                           guint                timeout_ms,
+                                           GCancellable        *cancellable);
+gchar     *viewer_installer_peer_get_uri  (const gchar         *peer,
+                                           const gchar         *sha256);
+
+int        viewer_installer_peer_main     (int                  argc,
+                                           char                *argv[]);
+
+G_END_DECLS
@@ -0,0 +1,752 @@
+/* viewer-installer-scheduler.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs every package of the manifest through its own view model.
+ *
+ * Downloads share the transfer engine and run side by side, at most
+ * parallel-downloads at a time. Installs go one after the other in the
+ * manifest's install order, dependencies first, since dpkg holds a single
+ * lock anyway. Both are pipelined: a package is installed as soon as it
+ * is downloaded and the ones before it are in place, while the later ones
+ * are still downloading. Packages already on the system are skipped,
+ * unless the manifest has a newer version of them.
+ *
+ * The scheduler has the status and progress properties of a single view
+ * model, so the window follows it the same way; the per package view
+ * models are there for anyone who wants the details.
+ *
+ * With a manifest-url, the manifest is fetched while the window comes up
+ * and the view models only exist once it is there, see the manifest
+ * property. A run asked for before that starts as soon as it arrives.
+ */
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "utils.h"
+#include "viewer-installer-config.h"
+#include "viewer-installer-dpkg.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-metrics.h"
+#include "viewer-installer-scheduler.h"
+#include "viewer-installer-transfer.h"
+
+enum {
+    PROP_STATUS = 1,
+    PROP_PROGRESS,
+    PROP_MANIFEST,
+    PROP_LAST
+};
+
+struct _ViewerInstallerScheduler
+{
+    GObject  parent_instance;
+};
+
+typedef struct
+{
+    ViewerInstallerManifest *manifest;
+
+    /* Fetching the manifest, and whether run is waiting for it */
+    GCancellable *cancellable;
+    gboolean   loading;
+    gboolean   run_pending;
+
+    /* View models in install order, NULL for packages already installed */
+    GPtrArray *view_models;
+
+    guint      status;
+    guint      progress;
+    gchar     *error;
+    InstallError error_class;
+
+    guint      max_downloads;
+    guint      downloading;
+    guint      next_download;
+    guint      next_install;
+    gboolean   installing;
+
+    /* Time spent in each state of the pipeline, accounted up to mark */
+    gint64     start;
+    gint64     mark;
+    ViewerInstallerSchedulerTiming timing;
+
+    /* Engine totals when the run started, and what it received */
+    ViewerInstallerTransferStats transfer_stats;
+    guint64    received;
+
+    /* Textfile collector directory, or NULL */
+    gchar     *metrics_dir;
+} ViewerInstallerSchedulerPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ViewerInstallerScheduler, viewer_installer_scheduler, G_TYPE_OBJECT)
+
+static GParamSpec *properties[PROP_LAST] = { NULL, };
+
+static void
+viewer_installer_scheduler_view_model_free (gpointer view_model)
+{
+    if (view_model)
+        g_object_unref (view_model);
+}
+
+static void
+viewer_installer_scheduler_set_status (ViewerInstallerScheduler *scheduler,
+                                       guint status)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (priv->status == status)
+        return;
+
+    priv->status = status;
+    g_object_notify_by_pspec (G_OBJECT (scheduler), properties[PROP_STATUS]);
+}
+
+/* Adds the time since the last state change to what was running then */
+static void
+viewer_installer_scheduler_account (ViewerInstallerScheduler *scheduler)
+{
+    gint64 now = g_get_monotonic_time ();
+    gdouble elapsed;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (priv->start == 0)
+        return;
+
+    elapsed = (gdouble) (now - priv->mark) / G_USEC_PER_SEC;
+    priv->mark = now;
+
+    if (priv->downloading)
+        priv->timing.download += elapsed;
+    if (priv->installing)
+        priv->timing.install += elapsed;
+    if (priv->downloading && priv->installing)
+        priv->timing.overlap += elapsed;
+
+    priv->timing.wall = (gdouble) (now - priv->start) / G_USEC_PER_SEC;
+}
+
+static gboolean
+viewer_installer_scheduler_is_finished (ViewerInstallerScheduler *scheduler)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    return priv->status == STATUS_INSTALLED ||
+           priv->status == STATUS_CANCEL ||
+           priv->status == STATUS_ERROR;
+}
+
+static void
+viewer_installer_scheduler_write_metrics (ViewerInstallerScheduler *scheduler)
+{
+    g_autoptr(GError) error = NULL;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (!priv->metrics_dir)
+        return;
+
+    if (!viewer_installer_metrics_write (scheduler, priv->metrics_dir, &error))
+        g_warning ("Could not write the metrics: %s", error->message);
+}
+
+/* Ends the whole run and stops the packages still busy */
+static void
+viewer_installer_scheduler_finish (ViewerInstallerScheduler *scheduler,
+                                   guint status)
+{
+    ViewerInstallerTransferStats stats;
+    guint i;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (viewer_installer_scheduler_is_finished (scheduler))
+        return;
+
+    viewer_installer_scheduler_account (scheduler);
+    viewer_installer_transfer_get_stats (viewer_installer_transfer_get_default (), &stats);
+    priv->received = stats.bytes - priv->transfer_stats.bytes;
+    g_debug ("Pipeline took %.1f s: downloading %.1f s, installing %.1f s, both at once %.1f s",
+             priv->timing.wall, priv->timing.download, priv->timing.install, priv->timing.overlap);
+
+    /* Set first, the cancelled packages report back below */
+    viewer_installer_scheduler_set_status (scheduler, status);
+    viewer_installer_scheduler_write_metrics (scheduler);
+
+    if (status == STATUS_INSTALLED)
+        return;
+
+    for (i = 0; i < priv->view_models->len; i++)
+    {
+        ViewerInstallerWindowViewModel *view_model = g_ptr_array_index (priv->view_models, i);
+        if (view_model)
+            viewer_installer_window_view_model_cancel (view_model);
+    }
+}
+
+static void
+viewer_installer_scheduler_install_next (ViewerInstallerScheduler *scheduler);
+
+static void
+viewer_installer_scheduler_fill (ViewerInstallerScheduler *scheduler)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    viewer_installer_scheduler_account (scheduler);
+
+    while (priv->status == STATUS_DOWNLOADING &&
+           priv->downloading < priv->max_downloads &&
+           priv->next_download < priv->view_models->len)
+    {
+        ViewerInstallerWindowViewModel *view_model;
+        view_model = g_ptr_array_index (priv->view_models, priv->next_download++);
+
+        if (view_model == NULL)
+            continue;
+
+        /* Counted first, a cached package is downloaded right away */
+        priv->downloading++;
+        viewer_installer_window_view_model_download (view_model);
+    }
+
+    /* Only installs left */
+    if (priv->status == STATUS_DOWNLOADING &&
+        priv->downloading == 0 &&
+        priv->next_download == priv->view_models->len)
+        viewer_installer_scheduler_set_status (scheduler, STATUS_INSTALLING);
+}
+
+/* Starts the next install if nothing is installing and it is downloaded */
+static void
+viewer_installer_scheduler_install_next (ViewerInstallerScheduler *scheduler)
+{
+    guint status;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (priv->installing || viewer_installer_scheduler_is_finished (scheduler))
+        return;
+
+    while (priv->next_install < priv->view_models->len)
+    {
+        ViewerInstallerWindowViewModel *view_model;
+        view_model = g_ptr_array_index (priv->view_models, priv->next_install);
+
+        if (view_model)
+        {
+            g_object_get (view_model, "status", &status, NULL);
+            if (status != STATUS_DOWNLOADED)
+                return;
+
+            viewer_installer_scheduler_account (scheduler);
+            priv->installing = TRUE;
+            viewer_installer_window_view_model_install (view_model);
+            return;
+        }
+        priv->next_install++;
+    }
+
+    viewer_installer_scheduler_finish (scheduler, STATUS_INSTALLED);
+}
+
+static void
+viewer_installer_scheduler_notify_status (GObject *object,
+                                          GParamSpec *pspec,
+                                          gpointer user_data)
+{
+    ViewerInstallerScheduler *scheduler = user_data;
+    ViewerInstallerWindowViewModel *view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object);
+    guint status;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (viewer_installer_scheduler_is_finished (scheduler))
+        return;
+
+    g_object_get (object, "status", &status, NULL);
+
+    switch (status)
+    {
+        case STATUS_DOWNLOADED:
+            viewer_installer_scheduler_account (scheduler);
+            priv->downloading--;
+            viewer_installer_scheduler_fill (scheduler);
+            viewer_installer_scheduler_install_next (scheduler);
+            break;
+        case STATUS_INSTALLED:
+        {
+            gchar *package = viewer_installer_window_view_model_get_package (view_model);
+
+            viewer_installer_scheduler_account (scheduler);
+            priv->installing = FALSE;
+
+            /* Whatever comes next may depend on it */
+            if (!check_package (package))
+            {
+                g_free (priv->error);
+                priv->error = g_strdup (_("The Installation of Hangul 2020 Viewer Beta is failed"));
+                priv->error_class = INSTALL_ERROR_INSTALL;
+                viewer_installer_scheduler_finish (scheduler, STATUS_ERROR);
+                break;
+            }
+
+            priv->next_install++;
+            viewer_installer_scheduler_install_next (scheduler);
+            break;
+        }
+        case STATUS_CANCEL:
+            viewer_installer_scheduler_finish (scheduler, STATUS_CANCEL);
+            break;
+        case STATUS_ERROR:
+            g_free (priv->error);
+            priv->error = g_strdup (viewer_installer_window_view_model_get_error (view_model));
+            priv->error_class = viewer_installer_window_view_model_get_error_class (view_model);
+            g_warning ("%s: %s", viewer_installer_window_view_model_get_package (view_model), priv->error);
+            viewer_installer_scheduler_finish (scheduler, STATUS_ERROR);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Mean of the packages still to install */
+static void
+viewer_installer_scheduler_notify_progress (GObject *object,
+                                            GParamSpec *pspec,
+                                            gpointer user_data)
+{
+    ViewerInstallerScheduler *scheduler = user_data;
+    guint sum = 0;
+    guint count = 0;
+    guint progress;
+    guint i;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    for (i = 0; i < priv->view_models->len; i++)
+    {
+        ViewerInstallerWindowViewModel *view_model = g_ptr_array_index (priv->view_models, i);
+
+        if (view_model == NULL)
+            continue;
+
+        g_object_get (view_model, "progress", &progress, NULL);
+        sum += progress;
+        count++;
+    }
+
+    progress = count ? sum / count : 100;
+    if (priv->progress == progress)
+        return;
+
+    priv->progress = progress;
+    g_object_notify_by_pspec (G_OBJECT (scheduler), properties[PROP_PROGRESS]);
+}
+
+static void
+viewer_installer_scheduler_start (ViewerInstallerScheduler *scheduler)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    priv->downloading = 0;
+    priv->next_download = 0;
+    priv->next_install = 0;
+    priv->installing = FALSE;
+    priv->start = priv->mark = g_get_monotonic_time ();
+    memset (&priv->timing, 0, sizeof (priv->timing));
+    viewer_installer_transfer_get_stats (viewer_installer_transfer_get_default (), &priv->transfer_stats);
+    priv->received = 0;
+
+    viewer_installer_scheduler_set_status (scheduler, STATUS_DOWNLOADING);
+    viewer_installer_scheduler_fill (scheduler);
+
+    /* Nothing to download at all */
+    viewer_installer_scheduler_install_next (scheduler);
+}
+
+/* Downloads and installs every package, see the top of the file */
+void
+viewer_installer_scheduler_run (ViewerInstallerScheduler *scheduler)
+{
+    g_return_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler));
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (priv->manifest == NULL && !priv->loading)
+    {
+        viewer_installer_scheduler_set_status (scheduler, STATUS_ERROR);
+        viewer_installer_scheduler_write_metrics (scheduler);
+        return;
+    }
+
+    if (priv->status != STATUS_NORMAL)
+        return;
+
+    /* Shown as downloading already, it starts once the manifest is in */
+    if (priv->loading)
+    {
+        priv->run_pending = TRUE;
+        viewer_installer_scheduler_set_status (scheduler, STATUS_DOWNLOADING);
+        return;
+    }
+
+    viewer_installer_scheduler_start (scheduler);
+}
+
+void
+viewer_installer_scheduler_cancel (ViewerInstallerScheduler *scheduler)
+{
+    g_return_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler));
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    g_cancellable_cancel (priv->cancellable);
+    viewer_installer_scheduler_finish (scheduler, STATUS_CANCEL);
+}
+
+/* In install order, with NULL for the packages already installed */
+GPtrArray *
+viewer_installer_scheduler_get_view_models (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), NULL);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+    return priv->view_models;
+}
+
+gchar *
+viewer_installer_scheduler_get_package (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), NULL);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (priv->manifest == NULL)
+        return NULL;
+
+    return viewer_installer_manifest_get_main (priv->manifest)->name;
+}
+
+gchar *
+viewer_installer_scheduler_get_error (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), NULL);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+    return priv->error;
+}
+
+/* Up to now while running, the whole run once finished */
+void
+viewer_installer_scheduler_get_timing (ViewerInstallerScheduler *scheduler,
+                                       ViewerInstallerSchedulerTiming *timing)
+{
+    g_return_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler));
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    if (!viewer_installer_scheduler_is_finished (scheduler))
+        viewer_installer_scheduler_account (scheduler);
+
+    *timing = priv->timing;
+}
+
+ViewerInstallerManifest *
+viewer_installer_scheduler_get_manifest (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), NULL);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+    return priv->manifest;
+}
+
+/* Bytes the transfer engine received during the run, once finished */
+guint64
+viewer_installer_scheduler_get_received_bytes (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), 0);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+    return priv->received;
+}
+
+InstallError
+viewer_installer_scheduler_get_error_class (ViewerInstallerScheduler *scheduler)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_IS_SCHEDULER (scheduler), INSTALL_ERROR_NONE);
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+    return priv->error_class;
+}
+
+static void
+viewer_installer_scheduler_get_property (GObject *object,
+                                         guint property_id,
+                                         GValue *value,
+                                         GParamSpec *pspec)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (VIEWER_INSTALLER_SCHEDULER (object));
+
+    if (property_id == PROP_STATUS)
+    {
+        g_value_set_uint (value, priv->status);
+    }
+    else if (property_id == PROP_PROGRESS)
+    {
+        g_value_set_uint (value, priv->progress);
+    }
+    else if (property_id == PROP_MANIFEST)
+    {
+        g_value_set_boxed (value, priv->manifest);
+    }
+    else
+    {
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+viewer_installer_scheduler_dispose (GObject *object)
+{
+    guint i;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (VIEWER_INSTALLER_SCHEDULER (object));
+
+    if (priv->view_models)
+    {
+        for (i = 0; i < priv->view_models->len; i++)
+        {
+            ViewerInstallerWindowViewModel *view_model = g_ptr_array_index (priv->view_models, i);
+
+            if (view_model == NULL)
+                continue;
+
+            g_signal_handlers_disconnect_by_data (view_model, object);
+            viewer_installer_window_view_model_cancel (view_model);
+        }
+        g_ptr_array_unref (priv->view_models);
+        priv->view_models = NULL;
+    }
+
+    if (priv->manifest)
+    {
+        viewer_installer_manifest_unref (priv->manifest);
+        priv->manifest = NULL;
+    }
+
+    if (priv->error)
+    {
+        g_free (priv->error);
+        priv->error = NULL;
+    }
+
+    g_clear_pointer (&priv->metrics_dir, g_free);
+    g_clear_object (&priv->cancellable);
+
+    G_OBJECT_CLASS (viewer_installer_scheduler_parent_class)->dispose (object);
+}
+
+static void
+viewer_installer_scheduler_class_init (ViewerInstallerSchedulerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    object_class->dispose = viewer_installer_scheduler_dispose;
+    object_class->get_property = viewer_installer_scheduler_get_property;
+
+    properties[PROP_STATUS] = g_param_spec_uint ("status", "Status", "Install Status of all packages", STATUS_NORMAL, N_STATUS, STATUS_NORMAL, G_PARAM_READABLE);
+    properties[PROP_PROGRESS] = g_param_spec_uint ("progress", "Progress", "Download progress of all packages", 0, 100, 0, G_PARAM_READABLE);
+    properties[PROP_MANIFEST] = g_param_spec_boxed ("manifest", "Manifest", "Package manifest, NULL until loaded", VIEWER_INSTALLER_TYPE_MANIFEST, G_PARAM_READABLE);
+
+    g_object_class_install_properties (object_class, PROP_LAST, properties);
+}
+
+/* Installed, and at least at the manifest's version when it has one */
+static gboolean
+viewer_installer_scheduler_is_current (const ViewerInstallerPackage *package)
+{
+    g_autofree gchar *installed = NULL;
+
+    if (!check_package (package->name))
+        return FALSE;
+
+    if (!package->version)
+        return TRUE;
+
+    installed = viewer_installer_dpkg_get_version (package->name);
+    return installed && viewer_installer_dpkg_compare_versions (installed, package->version) >= 0;
+}
+
+static void
+viewer_installer_scheduler_manifest_error (ViewerInstallerScheduler *scheduler,
+                                           const GError *error)
+{
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    g_warning ("Could not load the package manifest: %s", error->message);
+    g_free (priv->error);
+    priv->error = g_strdup ("error, json");
+    priv->error_class = INSTALL_ERROR_CONFIG;
+}
+
+/* A view model for every package of the manifest not yet current */
+static void
+viewer_installer_scheduler_add_packages (ViewerInstallerScheduler *scheduler)
+{
+    guint i;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    for (i = 0; i < viewer_installer_manifest_get_n_packages (priv->manifest); i++)
+    {
+        const ViewerInstallerPackage *package = viewer_installer_manifest_get_package (priv->manifest, i);
+        ViewerInstallerWindowViewModel *view_model;
+
+        if (viewer_installer_scheduler_is_current (package))
+        {
+            g_ptr_array_add (priv->view_models, NULL);
+            continue;
+        }
+
+        view_model = viewer_installer_window_view_model_new_for_package (priv->manifest, package->name);
+        g_signal_connect (view_model, "notify::status",
+                          G_CALLBACK (viewer_installer_scheduler_notify_status), scheduler);
+        g_signal_connect (view_model, "notify::progress",
+                          G_CALLBACK (viewer_installer_scheduler_notify_progress), scheduler);
+        g_ptr_array_add (priv->view_models, view_model);
+    }
+}
+
+static void
+viewer_installer_scheduler_manifest_ready (GObject *source,
+                                           GAsyncResult *result,
+                                           gpointer user_data)
+{
+    g_autoptr(ViewerInstallerScheduler) scheduler = user_data;
+    g_autoptr(GError) error = NULL;
+
+    ViewerInstallerSchedulerPrivate *priv;
+    priv = viewer_installer_scheduler_get_instance_private (scheduler);
+
+    priv->loading = FALSE;
+    priv->manifest = viewer_installer_manifest_fetch_finish (result, &error);
+
+    /* Cancelled while fetching */
+    if (viewer_installer_scheduler_is_finished (scheduler))
+        return;
+
+    if (priv->manifest == NULL)
+    {
+        viewer_installer_scheduler_manifest_error (scheduler, error);
+        if (priv->run_pending)
+            viewer_installer_scheduler_finish (scheduler, STATUS_ERROR);
+        return;
+    }
+
+    viewer_installer_scheduler_add_packages (scheduler);
+    g_object_notify_by_pspec (G_OBJECT (scheduler), properties[PROP_MANIFEST]);
+
+    if (priv->run_pending)
+        viewer_installer_scheduler_start (scheduler);
+}
+
+static void
+viewer_installer_scheduler_init (ViewerInstallerScheduler *self)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *manifest_url = NULL;
+
+    ViewerInstallerSchedulerPrivate *priv = viewer_installer_scheduler_get_instance_private (self);
+    priv->status = STATUS_NORMAL;
+    priv->progress = 0;
+    priv->max_downloads = 2;
+    priv->start = 0;
+    priv->view_models = g_ptr_array_new_with_free_func (viewer_installer_scheduler_view_model_free);
+    priv->cancellable = g_cancellable_new ();
+
+    g_autoptr(GSettings) settings = viewer_installer_settings_new ();
+    if (settings)
+    {
+        g_autofree gchar *metrics_dir = g_settings_get_string (settings, "metrics-directory");
+
+        priv->max_downloads = g_settings_get_uint (settings, "parallel-downloads");
+        if (metrics_dir && *metrics_dir)
+            priv->metrics_dir = g_steal_pointer (&metrics_dir);
+        manifest_url = g_settings_get_string (settings, "manifest-url");
+    }
+
+#ifdef VIEWER_INSTALLER_DEBUG
+    /* The manifest decides what is installed as root, so the environment
+     * only gets a say in debug builds */
+    if (g_getenv ("VIEWER_INSTALLER_MANIFEST_URL"))
+    {
+        g_free (manifest_url);
+        manifest_url = g_strdup (g_getenv ("VIEWER_INSTALLER_MANIFEST_URL"));
+    }
+#endif
+
+    /* Runs on the main loop alongside the window coming up */
+    if (manifest_url && *manifest_url)
+    {
+        priv->loading = TRUE;
+        viewer_installer_manifest_fetch_async (manifest_url, priv->cancellable,
+                                               viewer_installer_scheduler_manifest_ready,
+                                               g_object_ref (self));
+        return;
+    }
+
+    priv->manifest = viewer_installer_manifest_new_default (&error);
+    if (priv->manifest == NULL)
+    {
+        viewer_installer_scheduler_manifest_error (self, error);
+        return;
+    }
+
+    viewer_installer_scheduler_add_packages (self);
+}
+
+ViewerInstallerScheduler *
+viewer_installer_scheduler_new (void)
+{
+    return g_object_new (VIEWER_INSTALLER_TYPE_SCHEDULER, NULL);
+}
@@ -0,0 +1,56 @@
+/* viewer-installer-scheduler.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "define.h"
+#include "viewer-installer-window-view-model.h"
+
+G_BEGIN_DECLS
+
+#define VIEWER_INSTALLER_TYPE_SCHEDULER (viewer_installer_scheduler_get_type())
+
+G_DECLARE_FINAL_TYPE (ViewerInstallerScheduler, viewer_installer_scheduler, VIEWER_INSTALLER, SCHEDULER, GObject)
+
+/* Where the time of a run went, in seconds. With downloads and installs
+ * pipelined, wall is close to download + install - overlap */
+typedef struct
+{
+    gdouble  wall;
+    gdouble  download;  /* at least one package downloading */
+    gdouble  install;   /* a package installing */
+    gdouble  overlap;   /* both at once */
+} ViewerInstallerSchedulerTiming;
+
+ViewerInstallerScheduler *viewer_installer_scheduler_new             (void);
+
+void                      viewer_installer_scheduler_run             (ViewerInstallerScheduler *scheduler);
+void                      viewer_installer_scheduler_cancel          (ViewerInstallerScheduler *scheduler);
+void                      viewer_installer_scheduler_get_timing      (ViewerInstallerScheduler       *scheduler,
+                                                                      ViewerInstallerSchedulerTiming *timing);
+
+GPtrArray                *viewer_installer_scheduler_get_view_models (ViewerInstallerScheduler *scheduler);
+gchar                    *viewer_installer_scheduler_get_package     (ViewerInstallerScheduler *scheduler);
+gchar                    *viewer_installer_scheduler_get_error       (ViewerInstallerScheduler *scheduler);
+InstallError              viewer_installer_scheduler_get_error_class (ViewerInstallerScheduler *scheduler);
+ViewerInstallerManifest  *viewer_installer_scheduler_get_manifest    (ViewerInstallerScheduler *scheduler);
+guint64                   viewer_installer_scheduler_get_received_bytes (ViewerInstallerScheduler *scheduler);
+
+G_END_DECLS
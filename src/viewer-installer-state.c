@@ -0,0 +1,286 @@
+/* viewer-installer-state.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every login runs the installer, and almost every time all it does is
+ * find the package already installed. hancom-viewer-installer
+ * --state-service answers that from memory on the system bus, where the
+ * logins of all users on a terminal server find the same instance. It
+ * is started by bus activation and runs unprivileged; the dpkg status
+ * file is world readable.
+ *
+ * Answers are kept until the status file changes. dpkg replaces the file
+ * with a rename, the file monitor (inotify) reports that as well as a
+ * change in place, and either drops everything the service knows.
+ *
+ * Whether this is a live session is left to the client: the service runs
+ * as nobody with the activation environment's PATH, which need not be
+ * the session's. After STATE_IDLE_TIMEOUT without a call the service
+ * exits; the next login activates it again.
+ */
+
+#include "viewer-installer-dpkg.h"
+#include "viewer-installer-state.h"
+
+/* Milliseconds the client waits, activation included, before checking itself */
+#define STATE_TIMEOUT 2000
+
+/* Seconds without a call before the service exits */
+#define STATE_IDLE_TIMEOUT 60
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='" STATE_INTERFACE "'>"
+    "    <method name='Check'>"
+    "      <arg type='s' name='package' direction='in'/>"
+    "      <arg type='b' name='installed' direction='out'/>"
+    "      <arg type='s' name='version' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+typedef struct
+{
+    gboolean  installed;
+    gchar    *version;
+} PackageState;
+
+typedef struct
+{
+    GDBusNodeInfo *introspection;
+    GFileMonitor  *monitor;
+    GMainLoop     *loop;
+
+    /* Package name to PackageState, filled as packages are asked for */
+    GHashTable    *packages;
+
+    guint          idle_id;
+} ViewerInstallerState;
+
+static void
+package_state_free (PackageState *state)
+{
+    g_free (state->version);
+    g_free (state);
+}
+
+static void
+viewer_installer_state_status_changed (GFileMonitor *monitor,
+                                       GFile *file,
+                                       GFile *other_file,
+                                       GFileMonitorEvent event_type,
+                                       gpointer user_data)
+{
+    ViewerInstallerState *state = user_data;
+
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+        return;
+
+    if (g_hash_table_size (state->packages))
+        g_debug ("dpkg status changed, forgetting what is installed");
+
+    g_hash_table_remove_all (state->packages);
+    viewer_installer_dpkg_reset ();
+}
+
+static gboolean
+viewer_installer_state_idle (gpointer user_data)
+{
+    ViewerInstallerState *state = user_data;
+
+    g_debug ("No calls for %d seconds, exiting", STATE_IDLE_TIMEOUT);
+    state->idle_id = 0;
+    g_main_loop_quit (state->loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Every call starts the idle time over */
+static void
+viewer_installer_state_reset_idle (ViewerInstallerState *state)
+{
+    if (state->idle_id)
+        g_source_remove (state->idle_id);
+
+    state->idle_id = g_timeout_add_seconds (STATE_IDLE_TIMEOUT, viewer_installer_state_idle, state);
+}
+
+static const PackageState *
+viewer_installer_state_lookup (ViewerInstallerState *state,
+                               const gchar *package)
+{
+    PackageState *package_state;
+
+    package_state = g_hash_table_lookup (state->packages, package);
+    if (package_state)
+        return package_state;
+
+    package_state = g_new0 (PackageState, 1);
+    package_state->installed = viewer_installer_dpkg_is_installed (package);
+    if (package_state->installed)
+        package_state->version = viewer_installer_dpkg_get_version (package);
+
+    g_hash_table_insert (state->packages, g_strdup (package), package_state);
+    return package_state;
+}
+
+static void
+viewer_installer_state_method_call (GDBusConnection *connection,
+                                    const gchar *sender,
+                                    const gchar *object_path,
+                                    const gchar *interface_name,
+                                    const gchar *method_name,
+                                    GVariant *parameters,
+                                    GDBusMethodInvocation *invocation,
+                                    gpointer user_data)
+{
+    ViewerInstallerState *state = user_data;
+    const PackageState *package_state;
+    const gchar *package;
+
+    if (g_strcmp0 (method_name, "Check") != 0)
+    {
+        g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                               "Unknown method %s", method_name);
+        return;
+    }
+
+    viewer_installer_state_reset_idle (state);
+
+    g_variant_get (parameters, "(&s)", &package);
+    package_state = viewer_installer_state_lookup (state, package);
+
+    g_dbus_method_invocation_return_value (invocation,
+                                           g_variant_new ("(bs)",
+                                                          package_state->installed,
+                                                          package_state->version ? package_state->version : ""));
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+    viewer_installer_state_method_call,
+    NULL,
+    NULL,
+};
+
+static void
+viewer_installer_state_bus_acquired (GDBusConnection *connection,
+                                     const gchar *name,
+                                     gpointer user_data)
+{
+    ViewerInstallerState *state = user_data;
+    g_autoptr(GError) error = NULL;
+
+    if (!g_dbus_connection_register_object (connection, STATE_OBJECT_PATH,
+                                            state->introspection->interfaces[0],
+                                            &interface_vtable, state, NULL, &error))
+    {
+        g_warning ("Could not export %s: %s", STATE_OBJECT_PATH, error->message);
+        g_main_loop_quit (state->loop);
+    }
+}
+
+static void
+viewer_installer_state_name_lost (GDBusConnection *connection,
+                                  const gchar *name,
+                                  gpointer user_data)
+{
+    ViewerInstallerState *state = user_data;
+
+    g_warning ("Lost the bus name %s", name);
+    g_main_loop_quit (state->loop);
+}
+
+/* The service side, run as hancom-viewer-installer --state-service */
+int
+viewer_installer_state_main (int argc,
+                             char *argv[])
+{
+    ViewerInstallerState state = { 0, };
+    g_autoptr(GFile) file = NULL;
+    g_autoptr(GError) error = NULL;
+    guint owner_id;
+
+    state.introspection = g_dbus_node_info_new_for_xml (introspection_xml, &error);
+    g_assert_no_error (error);
+
+    state.packages = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) package_state_free);
+    state.loop = g_main_loop_new (NULL, FALSE);
+
+    file = g_file_new_for_path (DPKG_ADMINDIR "/status");
+    state.monitor = g_file_monitor_file (file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+    if (!state.monitor)
+    {
+        /* Answers could go stale without it */
+        g_printerr ("Could not watch %s: %s\n", DPKG_ADMINDIR "/status", error->message);
+        return 1;
+    }
+    g_signal_connect (state.monitor, "changed",
+                      G_CALLBACK (viewer_installer_state_status_changed), &state);
+
+    owner_id = g_bus_own_name (G_BUS_TYPE_SYSTEM, STATE_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+                               viewer_installer_state_bus_acquired, NULL,
+                               viewer_installer_state_name_lost, &state, NULL);
+
+    /* Activated for a call that may never come */
+    viewer_installer_state_reset_idle (&state);
+
+    g_main_loop_run (state.loop);
+
+    if (state.idle_id)
+        g_source_remove (state.idle_id);
+    g_bus_unown_name (owner_id);
+    g_object_unref (state.monitor);
+    g_hash_table_unref (state.packages);
+    g_main_loop_unref (state.loop);
+    g_dbus_node_info_unref (state.introspection);
+
+    return 0;
+}
+
+/* Asks the service whether @package is installed. FALSE when the
+ * service cannot be reached; the caller checks for itself then */
+gboolean
+viewer_installer_state_query (const gchar *package,
+                              gboolean *installed)
+{
+    g_autoptr(GDBusConnection) bus = NULL;
+    g_autoptr(GVariant) reply = NULL;
+    g_autoptr(GError) error = NULL;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+    if (!bus)
+    {
+        g_debug ("No system bus: %s", error->message);
+        return FALSE;
+    }
+
+    reply = g_dbus_connection_call_sync (bus, STATE_BUS_NAME, STATE_OBJECT_PATH, STATE_INTERFACE,
+                                         "Check", g_variant_new ("(s)", package),
+                                         G_VARIANT_TYPE ("(bs)"), G_DBUS_CALL_FLAGS_NONE,
+                                         STATE_TIMEOUT, NULL, &error);
+    if (!reply)
+    {
+        g_debug ("%s: %s", STATE_BUS_NAME, error->message);
+        return FALSE;
+    }
+
+    g_variant_get (reply, "(bs)", installed, NULL);
+    return TRUE;
+}
@@ -0,0 +1,35 @@
+/* viewer-installer-state.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define STATE_BUS_NAME     "kr.hancom.ViewerInstaller.State"
+#define STATE_OBJECT_PATH  "/kr/hancom/ViewerInstaller/State"
+#define STATE_INTERFACE    "kr.hancom.ViewerInstaller.State"
+
+gboolean viewer_installer_state_query (const gchar *package,
+                                       gboolean    *installed);
+
+int      viewer_installer_state_main  (int          argc,
+                                       char        *argv[]);
+
+G_END_DECLS
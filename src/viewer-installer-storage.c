@@ -0,0 +1,513 @@
+/* viewer-installer-storage.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write-behind for the download. libcurl hands over 16 KiB chunks on the
+ * main loop; a pwrite() per chunk stalls every transfer whenever the disk
+ * does, which on eMMC and SD cards is often. Chunks are copied into
+ * STORAGE_BUFFER_SIZE buffers instead, one being filled per stream (a
+ * download segment), and a thread writes the full ones. After its first
+ * buffer a stream writes at multiples of STORAGE_BUFFER_SIZE, whole
+ * erase blocks for most flash.
+ *
+ * The main loop only waits for the disk once STORAGE_MAX_BUFFERS are
+ * queued, the network is then simply faster than the disk, and when it
+ * needs to read back what it wrote (flush).
+ *
+ * What counts as durable, and goes into the resume state, is what the
+ * thread wrote, or with a sync interval what it wrote and then forced to
+ * disk. A power cut can then not leave a resume state that claims data
+ * the file lost.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "viewer-installer-storage.h"
+
+/* The benchmark models slow flash by building this file with its own */
+#ifdef STORAGE_PWRITE
+ssize_t STORAGE_PWRITE    (int fd, const void *buf, size_t count, off_t offset);
+int     STORAGE_FDATASYNC (int fd);
+#else
+#define STORAGE_PWRITE    pwrite
+#define STORAGE_FDATASYNC fdatasync
+#endif
+
+/* Buffers queued for the thread before the main loop waits */
+#define STORAGE_MAX_BUFFERS 16
+
+typedef struct
+{
+    guint    stream;
+    goffset  offset;     /* of data[0] in the file */
+    gsize    len;
+    gsize    capacity;
+    guchar  *data;
+} StorageBuffer;
+
+typedef struct
+{
+    StorageBuffer *fill;     /* main loop only */
+    goffset        written;  /* end of what the thread wrote */
+    goffset        durable;  /* end of what counts as on disk */
+} StorageStream;
+
+struct _ViewerInstallerStorage
+{
+    int          fd;
+    goffset      sync_interval;
+
+    GThread     *thread;
+    GAsyncQueue *queue;      /* full buffers, then the stop marker */
+    GAsyncQueue *idle;       /* buffers to fill */
+
+    /* Shared with the thread */
+    GMutex       mutex;
+    GCond        cond;
+    GPtrArray   *streams;
+    guint        pending;    /* buffers queued or being written */
+    int          error;      /* first errno of the thread */
+    goffset      unsynced;
+};
+
+static StorageBuffer stop_marker;
+
+static void
+storage_buffer_free (StorageBuffer *buffer)
+{
+    free (buffer->data);
+    g_free (buffer);
+}
+
+static int
+viewer_installer_storage_pwrite (int fd, StorageBuffer *buffer)
+{
+    gsize done = 0;
+
+    while (done < buffer->len)
+    {
+        ssize_t n = STORAGE_PWRITE (fd, buffer->data + done, buffer->len - done, buffer->offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Everything written so far is on disk now. Called with the mutex held */
+static void
+viewer_installer_storage_mark_durable (ViewerInstallerStorage *storage)
+{
+    guint i;
+
+    for (i = 0; i < storage->streams->len; i++)
+    {
+        StorageStream *stream = g_ptr_array_index (storage->streams, i);
+        stream->durable = stream->written;
+    }
+    storage->unsynced = 0;
+}
+
+static gpointer
+viewer_installer_storage_thread (gpointer user_data)
+{
+    ViewerInstallerStorage *storage = user_data;
+    StorageBuffer *buffer;
+
+    while ((buffer = g_async_queue_pop (storage->queue)) != &stop_marker)
+    {
+        int error = viewer_installer_storage_pwrite (storage->fd, buffer);
+        gboolean synced = FALSE;
+        goffset unsynced;
+
+        /* A sync from the caller resets it */
+        g_mutex_lock (&storage->mutex);
+        unsynced = storage->unsynced;
+        g_mutex_unlock (&storage->mutex);
+
+        if (!error && storage->sync_interval &&
+            storage->sync_interval <= unsynced + (goffset) buffer->len)
+        {
+            if (STORAGE_FDATASYNC (storage->fd) == 0)
+                synced = TRUE;
+            else
+                error = errno;
+        }
+
+        g_mutex_lock (&storage->mutex);
+        if (error)
+        {
+            if (!storage->error)
+                storage->error = error;
+        }
+        else
+        {
+            StorageStream *stream = g_ptr_array_index (storage->streams, buffer->stream);
+
+            stream->written = buffer->offset + buffer->len;
+            storage->unsynced += buffer->len;
+
+            if (synced)
+                viewer_installer_storage_mark_durable (storage);
+            else if (!storage->sync_interval)
+                stream->durable = stream->written;
+        }
+        storage->pending--;
+        g_cond_broadcast (&storage->cond);
+        g_mutex_unlock (&storage->mutex);
+
+        buffer->len = 0;
+        g_async_queue_push (storage->idle, buffer);
+    }
+
+    return NULL;
+}
+
+static gboolean
+viewer_installer_storage_check (ViewerInstallerStorage *storage,
+                                GError **error)
+{
+    int saved_errno;
+
+    g_mutex_lock (&storage->mutex);
+    saved_errno = storage->error;
+    g_mutex_unlock (&storage->mutex);
+
+    if (!saved_errno)
+        return TRUE;
+
+    g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (saved_errno), g_strerror (saved_errno));
+    return FALSE;
+}
+
+static void
+viewer_installer_storage_submit (ViewerInstallerStorage *storage,
+                                 StorageBuffer *buffer)
+{
+    g_mutex_lock (&storage->mutex);
+    storage->pending++;
+    g_mutex_unlock (&storage->mutex);
+
+    g_async_queue_push (storage->queue, buffer);
+}
+
+static StorageBuffer *
+viewer_installer_storage_get_buffer (ViewerInstallerStorage *storage)
+{
+    StorageBuffer *buffer;
+
+    /* The disk is that far behind, only now the network waits */
+    g_mutex_lock (&storage->mutex);
+    while (STORAGE_MAX_BUFFERS <= storage->pending)
+        g_cond_wait (&storage->cond, &storage->mutex);
+    g_mutex_unlock (&storage->mutex);
+
+    buffer = g_async_queue_try_pop (storage->idle);
+    if (buffer)
+        return buffer;
+
+    buffer = g_new0 (StorageBuffer, 1);
+    if (posix_memalign ((void **) &buffer->data, STORAGE_BUFFER_SIZE, STORAGE_BUFFER_SIZE) != 0)
+        g_error ("Could not allocate a %d byte write buffer", STORAGE_BUFFER_SIZE);
+
+    return buffer;
+}
+
+/* Checks that @size bytes fit and allocates them for the file behind @fd.
+ * What a resumed file has allocated already is not asked for again */
+gboolean
+viewer_installer_storage_reserve (int fd,
+                                  const gchar *path,
+                                  goffset size,
+                                  GError **error)
+{
+    struct stat st;
+    struct statvfs vfs;
+    goffset needed;
+    int saved_errno;
+
+    if (size <= 0)
+        return TRUE;
+
+    if (fstat (fd, &st) != 0)
+        goto error;
+
+    needed = size - MIN ((goffset) st.st_blocks * 512, size);
+    if (fstatvfs (fd, &vfs) == 0 && (goffset) (vfs.f_bavail * vfs.f_frsize) < needed)
+    {
+        g_autofree gchar *needed_size = g_format_size (needed);
+        g_autofree gchar *free_size = g_format_size (vfs.f_bavail * vfs.f_frsize);
+
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                     "%s: needs %s, only %s free", path, needed_size, free_size);
+        return FALSE;
+    }
+
+    /* Segments then write into their own spot, and the file system can
+     * lay the file out in one piece */
+    if (fallocate (fd, 0, 0, size) == 0)
+        return TRUE;
+
+    /* posix_fallocate() would write the whole file once more to emulate
+     * it; a sparse file is cheaper, and the space was checked above */
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        goto error;
+
+    if (ftruncate (fd, size) == 0)
+        return TRUE;
+
+error:
+    saved_errno = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "%s: %s", path, g_strerror (saved_errno));
+    return FALSE;
+}
+
+/* The download-sync setting */
+ViewerInstallerStorageSync
+viewer_installer_storage_sync_from_string (const gchar *sync)
+{
+    if (g_strcmp0 (sync, "none") == 0)
+        return STORAGE_SYNC_NONE;
+
+    if (g_strcmp0 (sync, "finish") == 0)
+        return STORAGE_SYNC_FINISH;
+
+    return STORAGE_SYNC_CHECKPOINT;
+}
+
+/* Writes to @fd behind the caller's back. With a @sync_interval, data
+ * only counts as durable once forced to disk, which the thread does
+ * every @sync_interval bytes */
+ViewerInstallerStorage *
+viewer_installer_storage_new (int fd,
+                              goffset sync_interval)
+{
+    ViewerInstallerStorage *storage;
+
+    storage = g_new0 (ViewerInstallerStorage, 1);
+    storage->fd = fd;
+    storage->sync_interval = sync_interval;
+    storage->queue = g_async_queue_new ();
+    storage->idle = g_async_queue_new_full ((GDestroyNotify) storage_buffer_free);
+    storage->streams = g_ptr_array_new_with_free_func (g_free);
+    g_mutex_init (&storage->mutex);
+    g_cond_init (&storage->cond);
+
+    storage->thread = g_thread_new ("storage", viewer_installer_storage_thread, storage);
+
+    return storage;
+}
+
+/* Writes what is still buffered and stops the thread; @fd stays open */
+void
+viewer_installer_storage_free (ViewerInstallerStorage *storage)
+{
+    if (!storage)
+        return;
+
+    viewer_installer_storage_flush (storage, NULL);
+
+    g_async_queue_push (storage->queue, &stop_marker);
+    g_thread_join (storage->thread);
+
+    g_async_queue_unref (storage->queue);
+    g_async_queue_unref (storage->idle);
+    g_ptr_array_unref (storage->streams);
+    g_mutex_clear (&storage->mutex);
+    g_cond_clear (&storage->cond);
+    g_free (storage);
+}
+
+/* A run of writes that starts at @offset, such as a download segment */
+guint
+viewer_installer_storage_add_stream (ViewerInstallerStorage *storage,
+                                     goffset offset)
+{
+    StorageStream *stream;
+    guint index;
+
+    stream = g_new0 (StorageStream, 1);
+    stream->written = offset;
+    stream->durable = offset;
+
+    g_mutex_lock (&storage->mutex);
+    index = storage->streams->len;
+    g_ptr_array_add (storage->streams, stream);
+    g_mutex_unlock (&storage->mutex);
+
+    return index;
+}
+
+/* Copies @data, the thread writes it at @offset later. Fails once the
+ * thread could not write something */
+gboolean
+viewer_installer_storage_write (ViewerInstallerStorage *storage,
+                                guint index,
+                                goffset offset,
+                                const void *data,
+                                gsize len,
+                                GError **error)
+{
+    StorageStream *stream;
+    const guchar *p = data;
+
+    if (!viewer_installer_storage_check (storage, error))
+        return FALSE;
+
+    g_mutex_lock (&storage->mutex);
+    stream = g_ptr_array_index (storage->streams, index);
+    g_mutex_unlock (&storage->mutex);
+
+    while (0 < len)
+    {
+        StorageBuffer *buffer = stream->fill;
+        gsize n;
+
+        /* Not where the stream left off, the buffer goes as it is */
+        if (buffer && buffer->offset + (goffset) buffer->len != offset)
+        {
+            viewer_installer_storage_submit (storage, buffer);
+            buffer = stream->fill = NULL;
+        }
+
+        if (!buffer)
+        {
+            buffer = viewer_installer_storage_get_buffer (storage);
+            buffer->stream = index;
+            buffer->offset = offset;
+            buffer->len = 0;
+
+            /* Ends on a multiple of the buffer size, see the top */
+            buffer->capacity = STORAGE_BUFFER_SIZE - offset % STORAGE_BUFFER_SIZE;
+            stream->fill = buffer;
+        }
+
+        n = MIN (len, buffer->capacity - buffer->len);
+        memcpy (buffer->data + buffer->len, p, n);
+        buffer->len += n;
+        offset += n;
+        p += n;
+        len -= n;
+
+        if (buffer->len == buffer->capacity)
+        {
+            viewer_installer_storage_submit (storage, buffer);
+            stream->fill = NULL;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Waits until everything handed over is written to the file, so that
+ * it can be read back */
+gboolean
+viewer_installer_storage_flush (ViewerInstallerStorage *storage,
+                                GError **error)
+{
+    guint i;
+
+    for (i = 0; i < storage->streams->len; i++)
+    {
+        StorageStream *stream = g_ptr_array_index (storage->streams, i);
+
+        if (stream->fill)
+        {
+            viewer_installer_storage_submit (storage, stream->fill);
+            stream->fill = NULL;
+        }
+    }
+
+    g_mutex_lock (&storage->mutex);
+    while (0 < storage->pending)
+        g_cond_wait (&storage->cond, &storage->mutex);
+    g_mutex_unlock (&storage->mutex);
+
+    return viewer_installer_storage_check (storage, error);
+}
+
+/* End of what the thread has written for @index, readable back from the
+ * file without waiting for anything */
+goffset
+viewer_installer_storage_get_written (ViewerInstallerStorage *storage,
+                                      guint index)
+{
+    StorageStream *stream;
+    goffset written;
+
+    g_mutex_lock (&storage->mutex);
+    stream = g_ptr_array_index (storage->streams, index);
+    written = stream->written;
+    g_mutex_unlock (&storage->mutex);
+
+    return written;
+}
+
+/* Flushes and forces the file to disk; everything written is durable */
+gboolean
+viewer_installer_storage_sync (ViewerInstallerStorage *storage,
+                               GError **error)
+{
+    int saved_errno;
+
+    if (!viewer_installer_storage_flush (storage, error))
+        return FALSE;
+
+    if (STORAGE_FDATASYNC (storage->fd) != 0)
+    {
+        saved_errno = errno;
+        g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (saved_errno), g_strerror (saved_errno));
+        return FALSE;
+    }
+
+    g_mutex_lock (&storage->mutex);
+    viewer_installer_storage_mark_durable (storage);
+    g_mutex_unlock (&storage->mutex);
+
+    return TRUE;
+}
+
+/* End of the part of the stream a resume may count on */
+goffset
+viewer_installer_storage_get_durable (ViewerInstallerStorage *storage,
+                                      guint index)
+{
+    StorageStream *stream;
+    goffset durable;
+
+    g_mutex_lock (&storage->mutex);
+    stream = g_ptr_array_index (storage->streams, index);
+    durable = stream->durable;
+    g_mutex_unlock (&storage->mutex);
+
+    return durable;
+}
@@ -0,0 +1,65 @@
+/* viewer-installer-storage.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Size and alignment of a write-behind buffer */
+#define STORAGE_BUFFER_SIZE (1024 * 1024)
+
+/* When downloaded data is forced to disk */
+typedef enum
+{
+    STORAGE_SYNC_NONE = 0,     /* left to the kernel */
+    STORAGE_SYNC_FINISH,       /* before the finished file is renamed into place */
+    STORAGE_SYNC_CHECKPOINT,   /* also before the resume state counts it */
+} ViewerInstallerStorageSync;
+
+typedef struct _ViewerInstallerStorage ViewerInstallerStorage;
+
+gboolean                   viewer_installer_storage_reserve     (int           fd,
+                                                                 const gchar  *path,
+                                                                 goffset       size,
+                                                                 GError      **error);
+ViewerInstallerStorageSync viewer_installer_storage_sync_from_string (const gchar *sync);
+
+ViewerInstallerStorage    *viewer_installer_storage_new         (int           fd,
+                                                                 goffset       sync_interval);
+void                       viewer_installer_storage_free        (ViewerInstallerStorage *storage);
+
+guint                      viewer_installer_storage_add_stream  (ViewerInstallerStorage *storage,
+                                                                 goffset                 offset);
+gboolean                   viewer_installer_storage_write       (ViewerInstallerStorage *storage,
+                                                                 guint                   index,
+                                                                 goffset                 offset,
+                                                                 const void             *data,
+                                                                 gsize                   len,
+                                                                 GError                **error);
+gboolean                   viewer_installer_storage_flush       (ViewerInstallerStorage *storage,
+                                                                 GError                **error);
+gboolean                   viewer_installer_storage_sync        (ViewerInstallerStorage *storage,
+                                                                 GError                **error);
+goffset                    viewer_installer_storage_get_written (ViewerInstallerStorage *storage,
+                                                                 guint                   index);
+goffset                    viewer_installer_storage_get_durable (ViewerInstallerStorage *storage,
+                                                                 guint                   index);
+
+G_END_DECLS
@@ -0,0 +1,125 @@
+/* viewer-installer-trace.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every span is one complete ("X") event, written with a single append
+ * as soon as it ends, so nothing is lost when the process exits or is
+ * killed and several processes can share one file. The closing bracket
+ * of the array is never written; the trace viewers accept that. Times
+ * come from the monotonic clock, which all processes share.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <glib/gstdio.h>
+
+#include "viewer-installer-trace.h"
+
+gboolean viewer_installer_trace_enabled = FALSE;
+
+static int trace_fd = -1;
+
+static void
+viewer_installer_trace_append_escaped (GString *event, const gchar *text)
+{
+    const gchar *p;
+
+    for (p = text; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            g_string_append_printf (event, "\\%c", *p);
+        else if ((guchar) *p < 0x20)
+            g_string_append_printf (event, "\\u%04x", (guchar) *p);
+        else
+            g_string_append_c (event, *p);
+    }
+}
+
+static void
+viewer_installer_trace_write (GString *event)
+{
+    g_string_append (event, ",\n");
+
+    /* O_APPEND keeps events from different processes whole */
+    if (write (trace_fd, event->str, event->len) < 0)
+        g_warning ("%s: %s", TRACE_ENV, g_strerror (errno));
+}
+
+void
+viewer_installer_trace_init (void)
+{
+    const gchar *path = g_getenv (TRACE_ENV);
+    g_autoptr(GString) event = NULL;
+    struct stat st;
+
+    if (!path || !*path || trace_fd >= 0)
+        return;
+
+    trace_fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0)
+    {
+        g_warning ("%s: %s", path, g_strerror (errno));
+        return;
+    }
+
+    if (fstat (trace_fd, &st) == 0 && st.st_size == 0 &&
+        write (trace_fd, "[\n", 2) < 0)
+        g_warning ("%s: %s", path, g_strerror (errno));
+
+    /* Labels the process in the viewer */
+    event = g_string_new (NULL);
+    g_string_append_printf (event, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"",
+                            getpid ());
+    viewer_installer_trace_append_escaped (event, g_get_prgname () ? g_get_prgname () : "installer");
+    g_string_append (event, "\"}}");
+    viewer_installer_trace_write (event);
+
+    viewer_installer_trace_enabled = TRUE;
+}
+
+void
+viewer_installer_trace_mark (gint64       begin,
+                             gint64       end,
+                             const gchar *name,
+                             const gchar *detail)
+{
+    g_autoptr(GString) event = NULL;
+
+    if (trace_fd < 0)
+        return;
+
+    event = g_string_sized_new (160);
+    g_string_append_printf (event,
+                            "{\"name\":\"%s\",\"cat\":\"installer\",\"ph\":\"X\","
+                            "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+                            "\"pid\":%d,\"tid\":%ld",
+                            name, begin, MAX (end - begin, 0), getpid (), (long) syscall (SYS_gettid));
+
+    if (detail)
+    {
+        g_string_append (event, ",\"args\":{\"detail\":\"");
+        viewer_installer_trace_append_escaped (event, detail);
+        g_string_append (event, "\"}");
+    }
+
+    g_string_append_c (event, '}');
+    viewer_installer_trace_write (event);
+}
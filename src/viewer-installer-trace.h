@@ -0,0 +1,54 @@
+/* viewer-installer-trace.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Names the file spans are appended to, in Chrome trace event format */
+#define TRACE_ENV "VIEWER_INSTALLER_TRACE"
+
+extern gboolean viewer_installer_trace_enabled;
+
+void viewer_installer_trace_init  (void);
+void viewer_installer_trace_mark  (gint64       begin,
+                                   gint64       end,
+                                   const gchar *name,
+                                   const gchar *detail);
+
+/* Start of a span, 0 when tracing is off */
+static inline gint64
+viewer_installer_trace_begin (void)
+{
+    return G_UNLIKELY (viewer_installer_trace_enabled) ? g_get_monotonic_time () : 0;
+}
+
+/* Ends the span started at @begin; does nothing for a span begun while
+ * tracing was off. @detail shows up in the span's arguments */
+static inline void
+viewer_installer_trace_end (gint64       begin,
+                            const gchar *name,
+                            const gchar *detail)
+{
+    if (G_UNLIKELY (begin != 0))
+        viewer_installer_trace_mark (begin, g_get_monotonic_time (), name, detail);
+}
+
+G_END_DECLS
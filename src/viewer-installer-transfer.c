@@ -0,0 +1,691 @@
+/* viewer-installer-transfer.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * One curl_multi handle for every transfer of the process.
+ *
+ * libcurl tells us which sockets it waits on and when its next timeout
+ * is due; each socket becomes a unix fd source and the timeout a timer
+ * source on the main context, so any number of transfers run without a
+ * thread of their own and without polling.
+ *
+ * The multi handle pools connections, and a share handle keeps resolved
+ * names and TLS sessions, so the HEAD check, the download segments and
+ * anything fetched later from the same host skip most of the setup.
+ *
+ * All transfers draw from one token bucket when a rate limit is set. The
+ * progress callback books what each handle received; once the bucket is
+ * empty the receiving handles are paused until the timer has refilled it.
+ * The limit is either fixed or a share of the link rate, measured over
+ * the seconds nothing was held back.
+ */
+
+#include <glib-unix.h>
+
+#include "viewer-installer-transfer.h"
+
+/* Seconds of traffic the bucket holds at most */
+#define BUCKET_DEPTH 0.25
+#define BUCKET_MIN_SIZE (16 * 1024)
+
+/* Weight of the newest second in the link rate estimate */
+#define LINK_RATE_SMOOTHING 0.3
+
+typedef struct
+{
+    ViewerInstallerTransfer     *transfer;
+    CURL                        *curl;
+
+    GCancellable                *cancellable;
+    gulong                       cancelled_id;
+    GSource                     *cancel_source;
+
+    ViewerInstallerTransferFunc  func;
+    gpointer                     user_data;
+
+    curl_off_t                   received;
+    gboolean                     paused;
+} TransferRequest;
+
+struct _ViewerInstallerTransfer
+{
+    CURLM        *multi;
+    CURLSH       *share;
+    GMainContext *context;
+    GSource      *timer;
+    GHashTable   *requests;     /* CURL * -> TransferRequest */
+
+    GHashTable   *handshakes;   /* "ip:port" -> gdouble, setup time of a fresh connection */
+    ViewerInstallerTransferStats stats;
+
+    /* Rate limit, 0 for none */
+    guint64       max_rate;
+    gdouble       max_share;
+    gdouble       tokens;
+    gint64        refilled;
+    GSource      *refill;
+
+    /* Link rate measurement, per second of traffic */
+    gint64        window_start;
+    guint64       window_bytes;
+    gboolean      window_throttled;
+    gdouble       link_rate;
+};
+
+static void viewer_installer_transfer_check_done (ViewerInstallerTransfer *transfer);
+
+static void
+transfer_request_free (TransferRequest *request)
+{
+    if (request->cancelled_id)
+        g_cancellable_disconnect (request->cancellable, request->cancelled_id);
+
+    if (request->cancel_source)
+    {
+        g_source_destroy (request->cancel_source);
+        g_source_unref (request->cancel_source);
+    }
+
+    g_clear_object (&request->cancellable);
+    g_free (request);
+}
+
+/* Books what setting up the connection cost @curl, or saved it */
+static void
+viewer_installer_transfer_account (ViewerInstallerTransfer *transfer,
+                                   CURL *curl)
+{
+    double namelookup = 0, connect = 0, appconnect = 0;
+    curl_off_t downloaded = 0;
+    long connects = 0;
+    long port = 0;
+    char *ip = NULL;
+    gdouble *baseline;
+    gdouble cost;
+    g_autofree gchar *key = NULL;
+
+    curl_easy_getinfo (curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo (curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+    curl_easy_getinfo (curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo (curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+    curl_easy_getinfo (curl, CURLINFO_PRIMARY_IP, &ip);
+    curl_easy_getinfo (curl, CURLINFO_PRIMARY_PORT, &port);
+    curl_easy_getinfo (curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+
+    transfer->stats.bytes += MAX (downloaded, 0);
+
+    if (!ip || !*ip)
+        return;
+
+    /* The times are cumulative, and appconnect stays 0 without TLS */
+    cost = MAX (connect, appconnect);
+
+    key = g_strdup_printf ("%s:%ld", ip, port);
+    baseline = g_hash_table_lookup (transfer->handshakes, key);
+
+    transfer->stats.transfers++;
+
+    if (connects == 0)
+    {
+        transfer->stats.reused++;
+        if (baseline)
+            transfer->stats.saved_time += *baseline;
+        return;
+    }
+
+    transfer->stats.connections += connects;
+    transfer->stats.dns_time += namelookup;
+    transfer->stats.connect_time += connect - namelookup;
+    if (0 < appconnect)
+        transfer->stats.tls_time += appconnect - connect;
+
+    /* A new connection can still have skipped the lookup and the full
+     * TLS handshake through the share */
+    if (!baseline)
+    {
+        baseline = g_new (gdouble, 1);
+        *baseline = cost;
+        g_hash_table_insert (transfer->handshakes, g_steal_pointer (&key), baseline);
+    }
+    else if (cost < *baseline)
+    {
+        transfer->stats.saved_time += *baseline - cost;
+    }
+}
+
+/* Bytes per second all transfers together may receive, 0 for no limit */
+static gdouble
+viewer_installer_transfer_get_rate (ViewerInstallerTransfer *transfer)
+{
+    gdouble rate = transfer->max_rate;
+
+    if (0 < transfer->max_share && 0 < transfer->link_rate)
+    {
+        gdouble share = transfer->max_share * transfer->link_rate;
+        rate = (rate == 0) ? share : MIN (rate, share);
+    }
+
+    return rate;
+}
+
+static void
+viewer_installer_transfer_refill_tokens (ViewerInstallerTransfer *transfer,
+                                         gdouble rate)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    transfer->tokens += rate * (now - transfer->refilled) / G_USEC_PER_SEC;
+    transfer->tokens = MIN (transfer->tokens, MAX (rate * BUCKET_DEPTH, BUCKET_MIN_SIZE));
+    transfer->refilled = now;
+}
+
+static void
+viewer_installer_transfer_resume_all (ViewerInstallerTransfer *transfer)
+{
+    GHashTableIter iter;
+    TransferRequest *request;
+    g_autoptr(GPtrArray) paused = g_ptr_array_new ();
+    guint i;
+
+    /* Unpausing delivers buffered data, which may pause the handle again */
+    g_hash_table_iter_init (&iter, transfer->requests);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+    {
+        if (request->paused)
+        {
+            request->paused = FALSE;
+            g_ptr_array_add (paused, request->curl);
+        }
+    }
+
+    for (i = 0; i < paused->len; i++)
+        curl_easy_pause (g_ptr_array_index (paused, i), CURLPAUSE_CONT);
+}
+
+static gboolean
+viewer_installer_transfer_refill (gpointer user_data)
+{
+    ViewerInstallerTransfer *transfer = user_data;
+    gdouble rate = viewer_installer_transfer_get_rate (transfer);
+
+    g_clear_pointer (&transfer->refill, g_source_unref);
+
+    if (0 < rate)
+        viewer_installer_transfer_refill_tokens (transfer, rate);
+
+    viewer_installer_transfer_resume_all (transfer);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+viewer_installer_transfer_schedule_refill (ViewerInstallerTransfer *transfer,
+                                           gdouble rate)
+{
+    guint delay;
+
+    if (transfer->refill)
+        return;
+
+    /* Until the debt is paid off */
+    delay = MAX (1, (guint) (-transfer->tokens * 1000 / rate) + 1);
+
+    transfer->refill = g_timeout_source_new (delay);
+    g_source_set_callback (transfer->refill, viewer_installer_transfer_refill, transfer, NULL);
+    g_source_set_name (transfer->refill, "[viewer-installer] curl refill");
+    g_source_attach (transfer->refill, transfer->context);
+}
+
+static void
+viewer_installer_transfer_measure (ViewerInstallerTransfer *transfer,
+                                   guint64 bytes)
+{
+    gint64 now = g_get_monotonic_time ();
+    gdouble elapsed;
+
+    if (transfer->window_start == 0)
+        transfer->window_start = now;
+
+    transfer->window_bytes += bytes;
+
+    elapsed = (gdouble) (now - transfer->window_start) / G_USEC_PER_SEC;
+    if (elapsed < 1)
+        return;
+
+    /* Only a second at full speed says something about the link */
+    if (!transfer->window_throttled)
+    {
+        gdouble rate = transfer->window_bytes / elapsed;
+
+        if (transfer->link_rate == 0)
+            transfer->link_rate = rate;
+        else
+            transfer->link_rate += LINK_RATE_SMOOTHING * (rate - transfer->link_rate);
+    }
+
+    transfer->window_start = now;
+    transfer->window_bytes = 0;
+    transfer->window_throttled = FALSE;
+}
+
+/* Called by libcurl for every handle as data comes in */
+static int
+viewer_installer_transfer_xferinfo_cb (void *clientp,
+                                       curl_off_t dltotal,
+                                       curl_off_t dlnow,
+                                       curl_off_t ultotal,
+                                       curl_off_t ulnow)
+{
+    TransferRequest *request = clientp;
+    ViewerInstallerTransfer *transfer = request->transfer;
+    guint64 bytes;
+    gdouble rate;
+
+    if (dlnow <= request->received)
+        return 0;
+
+    bytes = dlnow - request->received;
+    request->received = dlnow;
+
+    viewer_installer_transfer_measure (transfer, bytes);
+
+    rate = viewer_installer_transfer_get_rate (transfer);
+    if (rate == 0)
+        return 0;
+
+    viewer_installer_transfer_refill_tokens (transfer, rate);
+    transfer->tokens -= bytes;
+
+    if (0 <= transfer->tokens)
+        return 0;
+
+    transfer->window_throttled = TRUE;
+
+    if (!request->paused)
+    {
+        request->paused = TRUE;
+        curl_easy_pause (request->curl, CURLPAUSE_RECV);
+    }
+    viewer_installer_transfer_schedule_refill (transfer, rate);
+
+    return 0;
+}
+
+/* Takes @curl out of the engine, and tells the owner if @notify is set */
+static void
+viewer_installer_transfer_finish (ViewerInstallerTransfer *transfer,
+                                  CURL *curl,
+                                  CURLcode result,
+                                  gboolean notify)
+{
+    TransferRequest *request;
+
+    request = g_hash_table_lookup (transfer->requests, curl);
+    if (!request)
+        return;
+
+    g_hash_table_steal (transfer->requests, curl);
+    curl_multi_remove_handle (transfer->multi, curl);
+
+    if (notify && result != CURLE_ABORTED_BY_CALLBACK)
+        viewer_installer_transfer_account (transfer, curl);
+
+    if (notify && request->func)
+        request->func (curl, result, request->user_data);
+
+    transfer_request_free (request);
+}
+
+static void
+viewer_installer_transfer_action (ViewerInstallerTransfer *transfer,
+                                  curl_socket_t fd,
+                                  int flags)
+{
+    int running = 0;
+    CURLMcode res;
+
+    res = curl_multi_socket_action (transfer->multi, fd, flags, &running);
+    if (res != CURLM_OK)
+        g_warning ("curl_multi_socket_action: %s", curl_multi_strerror (res));
+
+    viewer_installer_transfer_check_done (transfer);
+}
+
+static void
+viewer_installer_transfer_check_done (ViewerInstallerTransfer *transfer)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read (transfer->multi, &left)))
+    {
+        CURL *curl;
+        CURLcode result;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        /* The message does not survive the handle being removed */
+        curl = msg->easy_handle;
+        result = msg->data.result;
+
+        viewer_installer_transfer_finish (transfer, curl, result, TRUE);
+    }
+}
+
+static gboolean
+viewer_installer_transfer_socket_ready (gint fd,
+                                        GIOCondition condition,
+                                        gpointer user_data)
+{
+    int flags = 0;
+
+    if (condition & G_IO_IN)
+        flags |= CURL_CSELECT_IN;
+    if (condition & G_IO_OUT)
+        flags |= CURL_CSELECT_OUT;
+    if (condition & (G_IO_ERR | G_IO_HUP))
+        flags |= CURL_CSELECT_ERR;
+
+    viewer_installer_transfer_action (user_data, fd, flags);
+
+    /* libcurl removes the source itself once it is done with the socket */
+    return G_SOURCE_CONTINUE;
+}
+
+static int
+viewer_installer_transfer_socket_cb (CURL *curl,
+                                     curl_socket_t fd,
+                                     int what,
+                                     void *userp,
+                                     void *socketp)
+{
+    ViewerInstallerTransfer *transfer = userp;
+    GSource *source = socketp;
+    GIOCondition condition = 0;
+
+    if (source)
+    {
+        g_source_destroy (source);
+        g_source_unref (source);
+        source = NULL;
+    }
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        curl_multi_assign (transfer->multi, fd, NULL);
+        return 0;
+    }
+
+    if (what & CURL_POLL_IN)
+        condition |= G_IO_IN;
+    if (what & CURL_POLL_OUT)
+        condition |= G_IO_OUT;
+
+    source = g_unix_fd_source_new (fd, condition | G_IO_ERR | G_IO_HUP);
+    g_source_set_callback (source, (GSourceFunc) viewer_installer_transfer_socket_ready, transfer, NULL);
+    g_source_set_name (source, "[viewer-installer] curl socket");
+    g_source_attach (source, transfer->context);
+
+    curl_multi_assign (transfer->multi, fd, source);
+    return 0;
+}
+
+static gboolean
+viewer_installer_transfer_timeout (gpointer user_data)
+{
+    ViewerInstallerTransfer *transfer = user_data;
+
+    /* The action below may arm a new timer */
+    g_clear_pointer (&transfer->timer, g_source_unref);
+
+    viewer_installer_transfer_action (transfer, CURL_SOCKET_TIMEOUT, 0);
+
+    return G_SOURCE_REMOVE;
+}
+
+static int
+viewer_installer_transfer_timer_cb (CURLM *multi,
+                                    long timeout_ms,
+                                    void *userp)
+{
+    ViewerInstallerTransfer *transfer = userp;
+
+    if (transfer->timer)
+    {
+        g_source_destroy (transfer->timer);
+        g_clear_pointer (&transfer->timer, g_source_unref);
+    }
+
+    /* -1 deletes the timer. A zero timeout is still deferred to the main
+     * loop, socket_action must not be called from inside this callback */
+    if (timeout_ms < 0)
+        return 0;
+
+    transfer->timer = g_timeout_source_new (timeout_ms);
+    g_source_set_callback (transfer->timer, viewer_installer_transfer_timeout, transfer, NULL);
+    g_source_set_name (transfer->timer, "[viewer-installer] curl timer");
+    g_source_attach (transfer->timer, transfer->context);
+
+    return 0;
+}
+
+static gboolean
+viewer_installer_transfer_cancel_idle (gpointer user_data)
+{
+    TransferRequest *request = user_data;
+
+    g_clear_pointer (&request->cancel_source, g_source_unref);
+    viewer_installer_transfer_finish (request->transfer, request->curl, CURLE_ABORTED_BY_CALLBACK, TRUE);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* May run in whichever thread cancelled, so only schedule the abort */
+static void
+viewer_installer_transfer_cancelled (GCancellable *cancellable,
+                                     gpointer user_data)
+{
+    TransferRequest *request = user_data;
+    GSource *source;
+
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_DEFAULT);
+    g_source_set_callback (source, viewer_installer_transfer_cancel_idle, request, NULL);
+    g_source_set_name (source, "[viewer-installer] curl cancel");
+
+    if (g_atomic_pointer_compare_and_exchange (&request->cancel_source, NULL, source))
+        g_source_attach (source, request->transfer->context);
+    else
+        g_source_unref (source);
+}
+
+static ViewerInstallerTransfer *
+viewer_installer_transfer_new (GMainContext *context)
+{
+    ViewerInstallerTransfer *transfer;
+
+    transfer = g_new0 (ViewerInstallerTransfer, 1);
+    transfer->context = g_main_context_ref (context);
+    transfer->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+    transfer->handshakes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    transfer->multi = curl_multi_init ();
+
+    /* Every handle runs on the engine's thread, no lock functions needed */
+    transfer->share = curl_share_init ();
+    curl_share_setopt (transfer->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (transfer->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    curl_multi_setopt (transfer->multi, CURLMOPT_SOCKETFUNCTION, viewer_installer_transfer_socket_cb);
+    curl_multi_setopt (transfer->multi, CURLMOPT_SOCKETDATA, transfer);
+    curl_multi_setopt (transfer->multi, CURLMOPT_TIMERFUNCTION, viewer_installer_transfer_timer_cb);
+    curl_multi_setopt (transfer->multi, CURLMOPT_TIMERDATA, transfer);
+
+    return transfer;
+}
+
+/* The engine of the main context, shared by everything in the process.
+ * Must only be used from the main context's thread */
+ViewerInstallerTransfer *
+viewer_installer_transfer_get_default (void)
+{
+    static gsize initialized = 0;
+    static ViewerInstallerTransfer *transfer = NULL;
+
+    if (g_once_init_enter (&initialized))
+    {
+        transfer = viewer_installer_transfer_new (g_main_context_default ());
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return transfer;
+}
+
+/* Starts @curl. The engine does not take ownership of the handle; it is
+ * the caller's again once @func has been called or after _remove () */
+void
+viewer_installer_transfer_add (ViewerInstallerTransfer *transfer,
+                               CURL *curl,
+                               GCancellable *cancellable,
+                               ViewerInstallerTransferFunc func,
+                               gpointer user_data)
+{
+    TransferRequest *request;
+    CURLMcode res;
+
+    g_return_if_fail (transfer != NULL);
+    g_return_if_fail (curl != NULL);
+    g_return_if_fail (g_hash_table_lookup (transfer->requests, curl) == NULL);
+
+    request = g_new0 (TransferRequest, 1);
+    request->transfer = transfer;
+    request->curl = curl;
+    request->func = func;
+    request->user_data = user_data;
+
+    curl_easy_setopt (curl, CURLOPT_SHARE, transfer->share);
+
+    /* For the rate limit, which can be set at any time */
+    curl_easy_setopt (curl, CURLOPT_XFERINFOFUNCTION, viewer_installer_transfer_xferinfo_cb);
+    curl_easy_setopt (curl, CURLOPT_XFERINFODATA, request);
+    curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 0L);
+
+    g_hash_table_insert (transfer->requests, curl, request);
+
+    res = curl_multi_add_handle (transfer->multi, curl);
+    if (res != CURLM_OK)
+    {
+        g_warning ("curl_multi_add_handle: %s", curl_multi_strerror (res));
+        g_hash_table_steal (transfer->requests, curl);
+        transfer_request_free (request);
+
+        if (func)
+            func (curl, CURLE_FAILED_INIT, user_data);
+        return;
+    }
+
+    /* Connected last, an already cancelled transfer is aborted from the
+     * main loop like any other */
+    if (cancellable)
+    {
+        request->cancellable = g_object_ref (cancellable);
+        request->cancelled_id = g_cancellable_connect (cancellable,
+                                                       G_CALLBACK (viewer_installer_transfer_cancelled),
+                                                       request, NULL);
+    }
+}
+
+/* Stops @curl without calling its callback */
+void
+viewer_installer_transfer_remove (ViewerInstallerTransfer *transfer,
+                                  CURL *curl)
+{
+    g_return_if_fail (transfer != NULL);
+
+    viewer_installer_transfer_finish (transfer, curl, CURLE_OK, FALSE);
+}
+
+/* Caps what all transfers together receive to @max_rate bytes per second
+ * and to @max_share of the measured link rate, whichever is lower. Zero
+ * lifts either limit. Applies to the running transfers right away */
+void
+viewer_installer_transfer_set_limit (ViewerInstallerTransfer *transfer,
+                                     guint64 max_rate,
+                                     gdouble max_share)
+{
+    g_return_if_fail (transfer != NULL);
+    g_return_if_fail (0 <= max_share && max_share <= 1);
+
+    transfer->max_rate = max_rate;
+    transfer->max_share = max_share;
+    transfer->refilled = g_get_monotonic_time ();
+    transfer->tokens = 0;
+
+    if (viewer_installer_transfer_get_rate (transfer) == 0)
+    {
+        if (transfer->refill)
+        {
+            g_source_destroy (transfer->refill);
+            g_clear_pointer (&transfer->refill, g_source_unref);
+        }
+        viewer_installer_transfer_resume_all (transfer);
+    }
+}
+
+/* Bytes per second, 0 until a second of unthrottled traffic was seen */
+gdouble
+viewer_installer_transfer_get_link_rate (ViewerInstallerTransfer *transfer)
+{
+    g_return_val_if_fail (transfer != NULL, 0);
+
+    return transfer->link_rate;
+}
+
+guint
+viewer_installer_transfer_get_running (ViewerInstallerTransfer *transfer)
+{
+    g_return_val_if_fail (transfer != NULL, 0);
+
+    return g_hash_table_size (transfer->requests);
+}
+
+void
+viewer_installer_transfer_get_stats (ViewerInstallerTransfer *transfer,
+                                     ViewerInstallerTransferStats *stats)
+{
+    g_return_if_fail (transfer != NULL);
+    g_return_if_fail (stats != NULL);
+
+    *stats = transfer->stats;
+}
+
+/* Turns the result of a finished transfer into a GError */
+gboolean
+viewer_installer_transfer_propagate (CURLcode result,
+                                     GCancellable *cancellable,
+                                     GError **error)
+{
+    if (result == CURLE_OK)
+        return TRUE;
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, curl_easy_strerror (result));
+    return FALSE;
+}
@@ -0,0 +1,69 @@
+/* viewer-installer-transfer.h
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <curl/curl.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ViewerInstallerTransfer ViewerInstallerTransfer;
+
+/* Connection setup paid by finished transfers, times in seconds */
+typedef struct
+{
+    guint64  bytes;         /* body bytes received */
+    guint    transfers;
+    guint    connections;   /* new connections opened */
+    guint    reused;        /* transfers that went over a pooled connection */
+    gdouble  dns_time;
+    gdouble  connect_time;
+    gdouble  tls_time;
+    gdouble  saved_time;    /* estimated DNS, TCP and TLS time avoided */
+} ViewerInstallerTransferStats;
+
+/* Called on the engine's main context once @curl is finished and no
+ * longer part of the engine. A cancelled transfer ends with
+ * CURLE_ABORTED_BY_CALLBACK */
+typedef void (*ViewerInstallerTransferFunc) (CURL     *curl,
+                                             CURLcode  result,
+                                             gpointer  user_data);
+
+ViewerInstallerTransfer *viewer_installer_transfer_get_default (void);
+
+void                     viewer_installer_transfer_add         (ViewerInstallerTransfer     *transfer,
+                                                                CURL                        *curl,
+                                                                GCancellable                *cancellable,
+                                                                ViewerInstallerTransferFunc  func,
+                                                                gpointer                     user_data);
+void                     viewer_installer_transfer_remove      (ViewerInstallerTransfer     *transfer,
+                                                                CURL                        *curl);
+void                     viewer_installer_transfer_set_limit   (ViewerInstallerTransfer     *transfer,
+                                                                guint64                      max_rate,
+                                                                gdouble                      max_share);
+gdouble                  viewer_installer_transfer_get_link_rate (ViewerInstallerTransfer   *transfer);
+guint                    viewer_installer_transfer_get_running (ViewerInstallerTransfer     *transfer);
+void                     viewer_installer_transfer_get_stats   (ViewerInstallerTransfer      *transfer,
+                                                                ViewerInstallerTransferStats *stats);
+
+gboolean                 viewer_installer_transfer_propagate   (CURLcode                     result,
+                                                                GCancellable                *cancellable,
+                                                                GError                     **error);
+
+G_END_DECLS
@@ -19,19 +19,50 @@
 #include <gio/gio.h>
 #include <glib/gi18n.h>
 #include <curl/curl.h>
-#include <json-glib/json-glib.h>
 
 #include "define.h"
+#include "utils.h"
+#include "viewer-installer-cache.h"
+#include "viewer-installer-delta.h"
 #include "viewer-installer-config.h"
+#include "viewer-installer-download.h"
+#include "viewer-installer-dpkg.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-peer.h"
+#include "viewer-installer-trace.h"
+#include "viewer-installer-transfer.h"
 #include "viewer-installer-window-view-model.h"
 
 #define OUT_PATH "/var/tmp"
-#define JSON_FILE "hancom-viewer-installer/viewer-installer-infos.json"
+
+/* Seconds to wait for the network before a suspended download fails */
+#define RESUME_TIMEOUT 60
+
+/* Milliseconds to wait for peers to answer a multicast query */
+#define PEER_DISCOVERY_TIMEOUT 500
+
+/* Telemetry updates per second while downloading */
+#define TELEMETRY_RATE 10
+
+/* Weight of the newest sample in the bytes/sec moving average */
+#define TELEMETRY_SMOOTHING 0.2
+
+/* Seconds without a single byte before a download counts as stalled,
+ * and how often a stalled download is restarted before giving up */
+#define STALL_TIMEOUT 30
+#define STALL_RETRIES 3
 
 enum
 {
     PROP_STATUS= 1,
     PROP_PROGRESS,
+    PROP_BYTES_PER_SECOND,
+    PROP_ETA,
+    PROP_RECEIVED_BYTES,
+    PROP_TOTAL_BYTES,
+    PROP_STALLED,
+    PROP_MANIFEST,
+    PROP_NAME,
     PROP_LAST
 };
 
@@ -43,57 +74,234 @@ enum {
 typedef struct 
 {
     gchar     *error;
+    InstallError error_class;
     gchar     *package;
     gchar     *file_name;
     gchar     *sha256;
     gchar     *md5;
+    gchar     *etag;
+    gchar     *last_modified;
+    gchar     *package_path;
+    gchar     *install_method;
+
+    /* Pre-Depends and Depends of the downloaded archive, read as it streamed by */
+    gchar     *package_depends;
 
     guint     status;
     guint     progress;
     guint     install_id;
+    guint     connections;
+    guint     resume_id;
+    guint     cache_size;
+    ViewerInstallerStorageSync download_sync;
 
-    gboolean  is_valid;
+    goffset   content_length;
+    gint64    install_time;
 
-    GThread   *download_thread;
-    GThread   *install_thread;
-    GPtrArray *dependencies;
+    gboolean  is_valid;
+    gboolean  accept_ranges;
+    gboolean  suspended;
+    gboolean  peer_enabled;
+    gboolean  from_peer;
+    gboolean  peer_failed;
+    gboolean  delta_failed;
+
+    /* Set while the download fetches a patch instead of the package */
+    const ViewerInstallerDelta *delta;
+    gchar     *delta_source;
+    gint      cancelled;
+
+    gchar     **peer_list;
+    gchar     *install_url;
+
+    /* Set while a download or install job runs */
+    GCancellable *cancellable;
+
+    /* Trace span of the running download attempt */
+    gint64    download_span;
+
+    /* Download attempts so far and the time they took, for the metrics */
+    guint     attempts;
+    gint64    download_start;
+    gint64    download_time;
+
+    /* Engine totals when the download job started */
+    ViewerInstallerTransferStats transfer_stats;
+
+    /* Telemetry, fed by the download and published at TELEMETRY_RATE */
+    guint     telemetry_id;
+    goffset   received;
+    goffset   total;
+    gint64    last_activity;
+    gint64    sample_time;
+    goffset   sample_bytes;
+    gdouble   bytes_per_second;
+    gint64    eta;
+    gboolean  stalled;
+    gboolean  stall_abort;
+    guint     stall_retries;
+
+    ViewerInstallerManifest *manifest;
 
 }ViewerInstallerWindowViewModelPrivate;
 
+/* Task data of a download job, which goes through peer discovery,
+ * the HEAD check and the download itself on the transfer engine */
+typedef struct
+{
+    gchar                   *out_file;
+    gchar                   *package_file;  /* rebuilt from out_file, or NULL */
+
+    /* The delta to rebuild it with, copied for the patch worker */
+    gchar                   *delta_format;
+    gchar                   *delta_from;
+    gchar                   *delta_source;
+    gchar                   *sha256;
+    CURL                    *check;
+    GPtrArray               *peers;
+    guint                    next_peer;
+    ViewerInstallerDownload *download;
+    gint64                   span;          /* trace span of the current phase */
+} DownloadJob;
+
 G_DEFINE_TYPE_WITH_PRIVATE (ViewerInstallerWindowViewModel, viewer_installer_window_view_model, G_TYPE_OBJECT)
 
 static GParamSpec *pspec = NULL;
-static GMutex thread_mutex;
-static gboolean viewer_installer_window_view_model_status_gui (gpointer user_data);
-static gboolean viewer_installer_window_view_model_progress_gui (gpointer user_data);
 
-static size_t
-viewer_download_write (void *ptr, size_t size, size_t nmemb, FILE *stream)
+/* Called for every chunk written, the telemetry tick publishes it */
+static void
+viewer_download_progress (goffset now, goffset total, gpointer user_data)
 {
-    size_t written = fwrite(ptr, size, nmemb, stream);
-    return written;
+    g_return_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL(user_data));
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (user_data);
+
+    /* A resumed download starts counting at what is already on disk */
+    if (priv->sample_time == 0)
+    {
+        priv->sample_time = g_get_monotonic_time ();
+        priv->sample_bytes = now;
+    }
+
+    priv->received = now;
+    priv->total = total;
+    priv->last_activity = g_get_monotonic_time ();
 }
 
-static int
-viewer_download_progress (void *user_data,
-                          curl_off_t dltotal, curl_off_t dlnow,
-                          curl_off_t ultotal, curl_off_t ulnow)
+static gboolean
+viewer_installer_window_view_model_telemetry_tick (gpointer user_data)
 {
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL(user_data), 0);
+    GObject *object = G_OBJECT (user_data);
+    gint64 now = g_get_monotonic_time ();
+    gdouble elapsed;
+    gint64 eta = -1;
+    guint progress;
 
-    guint p;
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (user_data);
 
-    p = ((double)dlnow / (double)dltotal ) * 100;
+    g_object_freeze_notify (object);
+
+    if (priv->sample_time)
+    {
+        elapsed = (gdouble) (now - priv->sample_time) / G_USEC_PER_SEC;
+        if (0 < elapsed)
+        {
+            gdouble rate = (priv->received - priv->sample_bytes) / elapsed;
+
+            if (priv->bytes_per_second == 0)
+                priv->bytes_per_second = rate;
+            else
+                priv->bytes_per_second += TELEMETRY_SMOOTHING * (rate - priv->bytes_per_second);
+
+            priv->sample_time = now;
+            priv->sample_bytes = priv->received;
+            g_object_notify (object, "bytes-per-second");
+            g_object_notify (object, "received-bytes");
+        }
+    }
+
+    if (0 < priv->total && 1 <= priv->bytes_per_second)
+        eta = (priv->total - priv->received) / priv->bytes_per_second;
+    if (priv->eta != eta)
+    {
+        priv->eta = eta;
+        g_object_notify (object, "eta");
+    }
+
+    if (0 < priv->total)
+    {
+        progress = ((gdouble) priv->received / (gdouble) priv->total) * 100;
+        if (priv->progress != progress)
+            g_object_set (object, "progress", progress, NULL);
+    }
+
+    g_object_notify (object, "total-bytes");
+
+    if (!priv->stalled && STALL_TIMEOUT * G_USEC_PER_SEC < now - priv->last_activity)
+    {
+        priv->stalled = TRUE;
+        g_object_notify (object, "stalled");
+
+        /* Restarted from download_done, with the partial file kept */
+        if (priv->cancellable)
+        {
+            g_debug ("No data for %d seconds, restarting the download", STALL_TIMEOUT);
+            priv->stall_abort = TRUE;
+            g_cancellable_cancel (priv->cancellable);
+        }
+    }
+
+    g_object_thaw_notify (object);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+viewer_installer_window_view_model_telemetry_start (ViewerInstallerWindowViewModel *view_model)
+{
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    priv->received = 0;
+    priv->sample_time = 0;
+    priv->sample_bytes = 0;
+    priv->bytes_per_second = 0;
+    priv->eta = -1;
+    priv->last_activity = g_get_monotonic_time ();
+
+    if (priv->stalled)
+    {
+        priv->stalled = FALSE;
+        g_object_notify (G_OBJECT (view_model), "stalled");
+    }
+
+    if (!priv->telemetry_id)
+        priv->telemetry_id = g_timeout_add (1000 / TELEMETRY_RATE,
+                                            viewer_installer_window_view_model_telemetry_tick,
+                                            view_model);
+}
+
+static void
+viewer_installer_window_view_model_telemetry_stop (ViewerInstallerWindowViewModel *view_model)
+{
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    if (priv->progress != p)
+    if (priv->telemetry_id)
     {
-        priv->progress = p;
-        g_idle_add (viewer_installer_window_view_model_progress_gui, user_data);
+        /* Publish the last state */
+        viewer_installer_window_view_model_telemetry_tick (view_model);
+        g_source_remove (priv->telemetry_id);
+        priv->telemetry_id = 0;
     }
 
-    return 0;
+    if (priv->bytes_per_second != 0)
+    {
+        priv->bytes_per_second = 0;
+        g_object_notify (G_OBJECT (view_model), "bytes-per-second");
+    }
 }
 
 static size_t
@@ -107,16 +315,43 @@ viewer_download_check_cb (char* buffer, size_t size, size_t nmemb, void *user_da
     if (buffer)
     {
         gchar **data;
-        gchar *sha256;
-        data = g_strsplit (buffer, ":", -1);
+        gchar *value;
+        g_autofree gchar *line = NULL;
 
-        if (g_str_has_suffix (data[0], "Checksum"))
+        /* header lines are not nul-terminated */
+        line = g_strndup (buffer, size * nmemb);
+        data = g_strsplit (line, ":", 2);
+
+        if (data[0] && data[1])
         {
-            sha256 = g_strstrip (data[1]);
+            value = g_strstrip (data[1]);
 
-            if (g_strcmp0 (sha256, priv->sha256) == 0)
+            if (g_str_has_suffix (data[0], "Checksum"))
             {
-                priv->is_valid = TRUE;
+                const gchar *sha256 = priv->delta ? priv->delta->sha256 : priv->sha256;
+
+                if (sha256 && g_ascii_strcasecmp (value, sha256) == 0)
+                {
+                    priv->is_valid = TRUE;
+                }
+            }
+            else if (g_ascii_strcasecmp (data[0], "Content-Length") == 0)
+            {
+                priv->content_length = g_ascii_strtoll (value, NULL, 10);
+            }
+            else if (g_ascii_strcasecmp (data[0], "Accept-Ranges") == 0)
+            {
+                priv->accept_ranges = (g_ascii_strcasecmp (value, "bytes") == 0);
+            }
+            else if (g_ascii_strcasecmp (data[0], "ETag") == 0)
+            {
+                g_free (priv->etag);
+                priv->etag = g_strdup (value);
+            }
+            else if (g_ascii_strcasecmp (data[0], "Last-Modified") == 0)
+            {
+                g_free (priv->last_modified);
+                priv->last_modified = g_strdup (value);
             }
         }
 
@@ -128,246 +363,750 @@ viewer_download_check_cb (char* buffer, size_t size, size_t nmemb, void *user_da
     return nmemb * size;
 }
 
-static gboolean
-viewer_download_check (void *user_data, gchar* uri)
+static void
+download_job_free (DownloadJob *job)
 {
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL(user_data), FALSE);
+    if (job->check)
+        curl_easy_cleanup (job->check);
+
+    if (job->peers)
+        g_ptr_array_unref (job->peers);
+
+    viewer_installer_download_free (job->download);
+    g_free (job->out_file);
+    g_free (job->package_file);
+    g_free (job->delta_format);
+    g_free (job->delta_from);
+    g_free (job->delta_source);
+    g_free (job->sha256);
+    g_free (job);
+}
 
-    CURL *curl;
-    CURLcode res;
-    gboolean result = FALSE;
+static void viewer_download_check (GTask *task, const gchar *uri);
+
+/* Rebuilds the package from the downloaded patch */
+static void
+viewer_download_patch_thread (GTask *task,
+                              gpointer source_object,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+    DownloadJob *job = task_data;
+    GError *error = NULL;
+    gboolean applied;
+    gint64 span = viewer_installer_trace_begin ();
+
+    /* Job data only, the main loop resets the delta of the view model */
+    applied = viewer_installer_delta_apply (job->delta_format, job->delta_source, job->out_file,
+                                            job->package_file, job->sha256, cancellable, &error);
+
+    /* Done with, whether it applied or not */
+    unlink (job->out_file);
+
+    viewer_installer_trace_end (span, "delta-apply", job->delta_from);
+
+    if (applied)
+        g_task_return_boolean (task, TRUE);
+    else
+        g_task_return_error (task, error);
+}
+
+static void
+viewer_download_finished (GObject *source,
+                          GAsyncResult *result,
+                          gpointer user_data)
+{
+    GTask *task = user_data;
+    DownloadJob *job = g_task_get_task_data (task);
+    GError *error = NULL;
+
+    viewer_installer_trace_end (job->span, "transfer", job->out_file);
+
+    if (!viewer_installer_download_run_finish (job->download, result, &error))
+    {
+        g_task_return_error (task, error);
+    }
+    else if (job->package_file)
+    {
+        g_task_run_in_thread (task, viewer_download_patch_thread);
+    }
+    else
+    {
+        gpointer view_model = g_task_get_source_object (task);
+        const gchar *pre_depends = viewer_installer_download_get_field (job->download, "Pre-Depends");
+        const gchar *depends = viewer_installer_download_get_field (job->download, "Depends");
+
+        ViewerInstallerWindowViewModelPrivate *priv;
+        priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+        /* Known only when the control file was read, empty for none */
+        g_free (priv->package_depends);
+        priv->package_depends = NULL;
+        if (viewer_installer_download_get_field (job->download, "Package"))
+            priv->package_depends = g_strjoin (pre_depends && depends ? ", " : "",
+                                               pre_depends ? pre_depends : "",
+                                               depends ? depends : "", NULL);
+
+        g_task_return_boolean (task, TRUE);
+    }
+
+    g_object_unref (task);
+}
+
+static void
+viewer_download_start (GTask *task, const gchar *uri)
+{
+    DownloadJob *job = g_task_get_task_data (task);
+    gpointer view_model = g_task_get_source_object (task);
 
     ViewerInstallerWindowViewModelPrivate *priv;
-    priv = viewer_installer_window_view_model_get_instance_private (user_data);
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    curl = curl_easy_init ();
-    if (curl)
+    job->download = viewer_installer_download_new (uri, job->out_file);
+    viewer_installer_download_set_handle (job->download, g_steal_pointer (&job->check));
+    if (priv->delta)
+    {
+        viewer_installer_download_set_sha256 (job->download, priv->delta->sha256);
+    }
+    else
     {
-        curl_easy_setopt(curl, CURLOPT_URL, uri);
-        curl_easy_setopt(curl, CURLOPT_REFERER, VIEWER_REFERER);
-        if (priv->md5)
-            curl_easy_setopt(curl, CURLOPT_SSH_HOST_PUBLIC_KEY_MD5, priv->md5);
-        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, viewer_download_check_cb);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, user_data);
+        const ViewerInstallerPackage *package = viewer_installer_manifest_lookup (priv->manifest, priv->package);
 
-        res = curl_easy_perform(curl);
+        viewer_installer_download_set_md5 (job->download, priv->md5);
+        viewer_installer_download_set_sha256 (job->download, priv->sha256);
+        viewer_installer_download_set_package (job->download, priv->package, package ? package->version : NULL);
+        if (package)
+            viewer_installer_download_set_blocks (job->download, package->block_size, package->blocks);
     }
+    viewer_installer_download_set_connections (job->download, priv->connections);
+    viewer_installer_download_set_sync (job->download, priv->download_sync);
+    viewer_installer_download_set_size (job->download, priv->content_length, priv->accept_ranges);
+    viewer_installer_download_set_validators (job->download, priv->etag, priv->last_modified);
+    viewer_installer_download_set_progress_func (job->download, viewer_download_progress, view_model);
+
+    job->span = viewer_installer_trace_begin ();
+    viewer_installer_download_run_async (job->download, g_task_get_cancellable (task),
+                                         viewer_download_finished, g_object_ref (task));
+}
 
-    if (res == CURLE_OK)
+/* Checks peers in turn and falls back to the CDN when none has the file */
+static void
+viewer_download_next_source (GTask *task)
+{
+    DownloadJob *job = g_task_get_task_data (task);
+    gpointer view_model = g_task_get_source_object (task);
+    g_autofree gchar *uri = NULL;
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    if (job->peers && job->next_peer < job->peers->len)
     {
-        result = priv->is_valid;
+        priv->from_peer = TRUE;
+        uri = viewer_installer_peer_get_uri (g_ptr_array_index (job->peers, job->next_peer++), priv->sha256);
+    }
+    else if (priv->delta)
+    {
+        priv->from_peer = FALSE;
+        uri = g_strdup_printf ("%s/%s", priv->install_url, priv->delta->file_name);
+    }
+    else
+    {
+        priv->from_peer = FALSE;
+        uri = g_strdup_printf ("%s/%s", priv->install_url, priv->file_name);
     }
 
-    curl_easy_cleanup(curl);
-
-    return result;
+    viewer_download_check (task, uri);
 }
 
-static gpointer
-viewer_download_func (gpointer user_data)
+static void
+viewer_download_check_done (CURL *curl,
+                            CURLcode result,
+                            gpointer user_data)
 {
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL(user_data), NULL);
+    GTask *task = user_data;
+    DownloadJob *job = g_task_get_task_data (task);
+    gpointer view_model = g_task_get_source_object (task);
+    GError *error = NULL;
+    gchar *uri = NULL;
 
-    FILE *fp;
-    CURL *curl;
-    CURLcode res;
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    g_autofree gchar *uri;
-    g_autofree gchar *out_file;
+    curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &uri);
+    uri = g_strdup (uri);
 
-    ViewerInstallerWindowViewModelPrivate *priv;
-    priv = viewer_installer_window_view_model_get_instance_private (user_data);
+    viewer_installer_trace_end (job->span, "head", uri);
 
-    uri = g_strdup_printf ("%s/%s", VIEWER_INSTALL_URL, priv->file_name);
-    out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
+    /* Kept for the download when the check passes */
+    if (result != CURLE_OK || !priv->is_valid)
+        g_clear_pointer (&job->check, curl_easy_cleanup);
 
-    curl = curl_easy_init ();
-    if (curl)
+    if (g_task_return_error_if_cancelled (task))
     {
-        fp = fopen (out_file, "wb");
-        curl_easy_setopt(curl, CURLOPT_URL, uri);
-        curl_easy_setopt(curl, CURLOPT_USERNAME, "HancomGooroom");
-        curl_easy_setopt(curl, CURLOPT_REFERER, VIEWER_REFERER);
-
-        if (priv->md5)
-            curl_easy_setopt(curl, CURLOPT_SSH_HOST_PUBLIC_KEY_MD5, priv->md5);
+        g_free (uri);
+        g_object_unref (task);
+        return;
+    }
 
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, viewer_download_progress);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, user_data);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, viewer_download_write);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-        res = curl_easy_perform(curl);
+    if (result == CURLE_OK && priv->is_valid)
+    {
+        if (priv->from_peer)
+            g_debug ("Downloading from peer %s", uri);
+        viewer_download_start (task, uri);
+    }
+    else if (priv->from_peer)
+    {
+        viewer_download_next_source (task);
+    }
+    else
+    {
+        if (!viewer_installer_transfer_propagate (result, NULL, &error))
+            g_warning ("HEAD %s: %s", uri, error->message);
+        g_clear_error (&error);
 
-        curl_easy_cleanup(curl);
-        fclose(fp);
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                 "%s: checksum does not match", uri);
     }
 
-    if (res != CURLE_OK)
+    g_free (uri);
+    g_object_unref (task);
+}
+
+/* HEAD request on the transfer engine; the headers tell whether the file
+ * is the one we expect and whether it can be fetched in ranges */
+static void
+viewer_download_check (GTask *task, const gchar *uri)
+{
+    DownloadJob *job = g_task_get_task_data (task);
+    gpointer view_model = g_task_get_source_object (task);
+    CURL *curl;
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    priv->is_valid = FALSE;
+    priv->content_length = -1;
+    priv->accept_ranges = FALSE;
+    g_clear_pointer (&priv->etag, g_free);
+    g_clear_pointer (&priv->last_modified, g_free);
+
+    curl = curl_easy_init ();
+    if (!curl)
     {
-        priv->status = STATUS_ERROR;
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "curl_easy_init failed");
+        return;
     }
-    else
+
+    curl_easy_setopt(curl, CURLOPT_URL, uri);
+    curl_easy_setopt(curl, CURLOPT_REFERER, VIEWER_REFERER);
+    if (priv->md5 && !priv->delta)
+        curl_easy_setopt(curl, CURLOPT_SSH_HOST_PUBLIC_KEY_MD5, priv->md5);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, viewer_download_check_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, view_model);
+
+    job->check = curl;
+    job->span = viewer_installer_trace_begin ();
+    viewer_installer_transfer_add (viewer_installer_transfer_get_default (), curl,
+                                   g_task_get_cancellable (task),
+                                   viewer_download_check_done, g_object_ref (task));
+}
+
+/* Multicast discovery waits for answers, so it runs on a worker */
+static void
+viewer_download_discover_thread (GTask *task,
+                                 gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
+{
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (source_object);
+
+    g_task_return_pointer (task,
+                           viewer_installer_peer_discover (priv->sha256,
+                                                           (const gchar * const *) priv->peer_list,
+                                                           PEER_DISCOVERY_TIMEOUT,
+                                                           cancellable),
+                           (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+viewer_download_discovered (GObject *source,
+                            GAsyncResult *result,
+                            gpointer user_data)
+{
+    GTask *task = user_data;
+    DownloadJob *job = g_task_get_task_data (task);
+
+    job->peers = g_task_propagate_pointer (G_TASK (result), NULL);
+    viewer_installer_trace_end (job->span, "peer-discovery", NULL);
+
+    if (!g_task_return_error_if_cancelled (task))
+        viewer_download_next_source (task);
+
+    g_object_unref (task);
+}
+
+/* How the install script installed the package, from its last lines */
+typedef struct
+{
+    gchar    *method;
+    gint64    time;      /* ms, -1 if not reported */
+} InstallReport;
+
+static void
+install_report_free (InstallReport *report)
+{
+    g_free (report->method);
+    g_free (report);
+}
+
+static InstallReport *
+viewer_install_parse_report (const gchar *output)
+{
+    InstallReport *report;
+    gchar **lines;
+    guint i;
+
+    report = g_new0 (InstallReport, 1);
+    report->time = -1;
+
+    if (!output)
+        return report;
+
+    lines = g_strsplit (output, "\n", -1);
+    for (i = 0; lines[i]; i++)
     {
-        priv->status = STATUS_DOWNLOADED;
+        if (g_str_has_prefix (lines[i], "install-method: "))
+        {
+            g_free (report->method);
+            report->method = g_strstrip (g_strdup (lines[i] + 16));
+        }
+        else if (g_str_has_prefix (lines[i], "install-time: "))
+        {
+            report->time = g_ascii_strtoll (lines[i] + 14, NULL, 10);
+        }
     }
+    g_strfreev (lines);
 
-    g_idle_add (viewer_installer_window_view_model_status_gui, user_data);
-    return NULL;
+    return report;
 }
 
-static gpointer
-viewer_install_func  (gpointer user_data)
+static void
+viewer_install_thread (GTask *task,
+                       gpointer source_object,
+                       gpointer task_data,
+                       GCancellable *cancellable)
 {
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL(user_data), NULL);
+    gpointer user_data = source_object;
 
     gchar **args;
+    gint exit_status;
     g_autofree gchar *file;
     g_autofree gchar *command;
+    g_autofree gchar *options = NULL;
+    g_autofree gchar *output = NULL;
 
     GError *error = NULL;
+    gint64 span = viewer_installer_trace_begin ();
+    gint64 spawn_span;
 
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (user_data);
-#if 0
-    int i;
-    gchar *param = g_strdup ("");
-    if (priv->dependencies && 0 < priv->dependencies->len)
-    {
-        for (i = 0; i < priv->dependencies->len; i++)
-        {
-            gchar *tmp = g_strdup (param);
-            const gchar *val = g_ptr_array_index (priv->dependencies, i);
-            param = g_strdup_printf ("%s%s ", tmp, val);
-            g_free (tmp);
-        }
-    }
-    g_free (param);
-#endif
+    file = g_strdup (priv->package_path);
 
-    file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
-    command = g_strdup_printf ("pkexec %s/%s/%s %s", LIBDIR, GETTEXT_PACKAGE, VIEWER_SCRIPT, file);
-
-    args = g_strsplit (command, " ", -1);
+    /* Nothing for apt to resolve, dpkg can take the archive as it is.
+     * The fields are at hand when the archive was just downloaded */
+    if (priv->package_depends ? viewer_installer_dpkg_depends_satisfied (priv->package_depends)
+                              : viewer_installer_dpkg_deb_depends_satisfied (file))
+        options = g_strdup ("--dpkg ");
+    else
+        options = g_strdup ("");
 
-    if (!g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, &error))
+    /* The script keeps a root-owned copy of what it installed */
+    if (priv->sha256 && 0 < priv->cache_size)
     {
-        priv->error = g_strdup (error->message);
-        g_error_free (error);
-        priv->status = STATUS_ERROR;
+        g_autofree gchar *key = g_ascii_strdown (priv->sha256, -1);
+        command = g_strdup_printf ("pkexec %s/%s/%s %s--cache-key %s --cache-size %u %s",
+                                   LIBDIR, GETTEXT_PACKAGE, VIEWER_SCRIPT, options, key, priv->cache_size, file);
     }
     else
+        command = g_strdup_printf ("pkexec %s/%s/%s %s%s", LIBDIR, GETTEXT_PACKAGE, VIEWER_SCRIPT, options, file);
+
+    args = g_strsplit (command, " ", -1);
+
+    /* Once the script runs, dpkg is left to finish */
+    if (!g_task_return_error_if_cancelled (task))
     {
-        priv->status = STATUS_INSTALLED;
+        spawn_span = viewer_installer_trace_begin ();
+
+        if (!g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &output, NULL, &exit_status, &error) ||
+            !g_spawn_check_exit_status (exit_status, &error))
+        {
+            viewer_installer_trace_end (spawn_span, "pkexec", NULL);
+            g_task_return_error (task, error);
+        }
+        else
+        {
+            InstallReport *report;
+
+            viewer_installer_trace_end (spawn_span, "pkexec", NULL);
+            report = viewer_install_parse_report (output);
+
+            /* The script times dpkg or apt itself, what is left of
+             * the pkexec span is the prompt and the script around it */
+            if (spawn_span && 0 <= report->time)
+            {
+                gint64 end = g_get_monotonic_time ();
+                viewer_installer_trace_mark (end - report->time * 1000, end, "apt", report->method);
+            }
 
+            /* The main thread reads the fields, install_done sets them */
+            g_task_return_pointer (task, report, (GDestroyNotify) install_report_free);
+        }
     }
 
-    unlink (file);
+    if (g_str_has_prefix (file, OUT_PATH "/"))
+        unlink (file);
     g_strfreev (args);
 
-    g_idle_add (viewer_installer_window_view_model_status_gui, user_data);
-
-    return NULL;
+    viewer_installer_trace_end (span, "install", priv->package);
 }
 
 static gboolean
-viewer_installer_window_view_model_progress_gui (gpointer user_data)
+viewer_installer_window_view_model_resume_timeout (gpointer user_data)
 {
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (user_data);
 
-    g_mutex_lock (&thread_mutex);
-    g_object_set (G_OBJECT (user_data), "progress", priv->progress, NULL);
-    g_mutex_unlock (&thread_mutex);
-    return FALSE;
+    priv->resume_id = 0;
+    priv->suspended = FALSE;
+
+    if (priv->cancellable)
+    {
+        g_cancellable_cancel (priv->cancellable);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_free (priv->error);
+    priv->error = g_strdup (_("Network is not active"));
+    priv->error_class = INSTALL_ERROR_NETWORK;
+    g_object_set (G_OBJECT (user_data), "status", STATUS_ERROR, NULL);
+
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean
-viewer_installer_window_view_model_status_gui (gpointer user_data)
+static void
+viewer_installer_window_view_model_resume (ViewerInstallerWindowViewModel *view_model)
 {
     ViewerInstallerWindowViewModelPrivate *priv;
-    priv = viewer_installer_window_view_model_get_instance_private (user_data);
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    priv->suspended = FALSE;
+    if (priv->resume_id)
+    {
+        g_source_remove (priv->resume_id);
+        priv->resume_id = 0;
+    }
 
-    g_mutex_lock (&thread_mutex);
-    g_object_set (G_OBJECT (user_data), "status", priv->status, NULL);
-    g_mutex_unlock (&thread_mutex);
-    return FALSE;
+    viewer_installer_window_view_model_download (view_model);
 }
 
+static GTask *
+viewer_installer_window_view_model_job_new (ViewerInstallerWindowViewModel *view_model,
+                                            GAsyncReadyCallback callback)
+{
+    GApplication *app = g_application_get_default ();
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    priv->cancellable = g_cancellable_new ();
+    g_atomic_int_set (&priv->cancelled, FALSE);
+
+    /* Closing the window must not end the process under a running job */
+    if (app)
+        g_application_hold (app);
+
+    return g_task_new (view_model, priv->cancellable, callback, NULL);
+}
 
 static void
-viewer_installer_window_view_model_infos_init (ViewerInstallerWindowViewModel *view_model)
+viewer_installer_window_view_model_job_done (ViewerInstallerWindowViewModel *view_model)
 {
-    g_return_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model));
+    GApplication *app = g_application_get_default ();
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    GError *error;
-    gchar *filename;
-    JsonNode *json_root;
-    JsonObject *json_item;
-    JsonNode *json_node;
-    g_autoptr(JsonParser) json_parser = NULL;
+    g_clear_object (&priv->cancellable);
 
-    ViewerInstallerWindowViewModelPrivate *priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    if (app)
+        g_application_release (app);
+}
+
+/* Removes the downloaded package and whatever a partial download left */
+static void
+viewer_installer_window_view_model_discard (ViewerInstallerWindowViewModel *view_model)
+{
+    g_autofree gchar *out_file = NULL;
+    ViewerInstallerDownload *download;
 
-    error = NULL;
-    json_parser = json_parser_new ();
-    filename = g_strdup_printf ("%s/%s", LIBDIR, JSON_FILE);
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    if (!json_parser_load_from_file (json_parser, filename, &error))
-        goto error;
+    if (priv->package_path && g_str_has_prefix (priv->package_path, OUT_PATH "/"))
+        unlink (priv->package_path);
+
+    out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
+    download = viewer_installer_download_new (NULL, out_file);
+    viewer_installer_download_discard (download);
+    viewer_installer_download_free (download);
+}
+
+/* What the download job paid for DNS, TCP and TLS, and what reusing
+ * connections and sessions saved it */
+static void
+viewer_installer_window_view_model_log_transfer (ViewerInstallerWindowViewModel *view_model)
+{
+    ViewerInstallerTransferStats now;
+    ViewerInstallerTransferStats *start;
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    start = &priv->transfer_stats;
+    viewer_installer_transfer_get_stats (viewer_installer_transfer_get_default (), &now);
+
+    g_debug ("Connection setup: %u transfers, %u new connections, %u reused, "
+             "dns %.1f ms, connect %.1f ms, tls %.1f ms, saved %.1f ms",
+             now.transfers - start->transfers,
+             now.connections - start->connections,
+             now.reused - start->reused,
+             (now.dns_time - start->dns_time) * 1000,
+             (now.connect_time - start->connect_time) * 1000,
+             (now.tls_time - start->tls_time) * 1000,
+             (now.saved_time - start->saved_time) * 1000);
+}
+
+static void
+viewer_installer_window_view_model_download_done (GObject *source,
+                                                  GAsyncResult *result,
+                                                  gpointer user_data)
+{
+    GError *error = NULL;
+    ViewerInstallerWindowViewModel *view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (source);
 
-    json_root = json_parser_get_root (json_parser);
-    if (json_root == NULL)
-        goto error;
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    if (json_node_get_node_type (json_root) != JSON_NODE_OBJECT)
-        goto error;
+    viewer_installer_window_view_model_job_done (view_model);
+    viewer_installer_window_view_model_telemetry_stop (view_model);
+    viewer_installer_window_view_model_log_transfer (view_model);
 
-    json_item = json_node_get_object (json_root);
-    if (json_item == NULL)
-        goto error;
+    /* One span per attempt, a fallback starts the next */
+    viewer_installer_trace_end (priv->download_span, "download", priv->package);
+    priv->download_span = 0;
+    priv->download_time += g_get_monotonic_time () - priv->download_start;
 
-    if (json_object_has_member (json_item, "package"))
+    if (g_task_propagate_boolean (G_TASK (result), &error))
     {
-        json_item = json_object_get_object_member (json_item, "package");
-        json_node = json_object_get_member (json_item, "name");
-        if (json_node != NULL)
-            priv->package = g_strdup (json_node_get_string (json_node));
+        if (priv->delta)
+            g_debug ("Rebuilt %s from %s", priv->file_name, priv->delta->from);
+        priv->delta = NULL;
+        g_clear_pointer (&priv->delta_source, g_free);
+        priv->stall_retries = 0;
+        g_object_set (G_OBJECT (view_model), "status", STATUS_DOWNLOADED, NULL);
+        return;
+    }
 
-        json_node = json_object_get_member (json_item, "file-name");
-        if (json_node != NULL)
-            priv->file_name = g_strdup (json_node_get_string (json_node));
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        GNetworkMonitor *monitor = g_network_monitor_get_default ();
 
-        json_node = json_object_get_member (json_item, "MD5");
-        if (json_node != NULL)
-            priv->md5 = g_strdup (json_node_get_string (json_node));
+        g_error_free (error);
 
-        json_node = json_object_get_member (json_item, "SHA256");
-        if (json_node != NULL)
-            priv->sha256 = g_strdup (json_node_get_string (json_node));
+        if (g_atomic_int_get (&priv->cancelled))
+        {
+            viewer_installer_window_view_model_discard (view_model);
+            g_object_set (G_OBJECT (view_model), "status", STATUS_CANCEL, NULL);
+            return;
+        }
 
-        if (json_object_has_member (json_item, "dependency"))
+        /* Stalled: a silent peer is dropped for the CDN, the CDN is
+         * asked again from where the partial file ends */
+        if (priv->stall_abort && !priv->suspended)
         {
-            int i;
-            gchar *dependency;
-            JsonArray *array = json_object_get_array_member (json_item, "dependency");
-            for (i = 0; i < json_array_get_length (array); i++)
+            priv->stall_abort = FALSE;
+
+            if (priv->from_peer)
+            {
+                priv->from_peer = FALSE;
+                priv->peer_failed = TRUE;
+                viewer_installer_window_view_model_download (view_model);
+                return;
+            }
+
+            if (priv->stall_retries++ < STALL_RETRIES)
             {
-                json_node = json_array_get_element (array, i);
-                if (json_node == NULL)
-                    continue;
-                dependency = g_strdup (json_node_get_string (json_node));
-                g_ptr_array_add (priv->dependencies, dependency);
+                viewer_installer_window_view_model_download (view_model);
+                return;
             }
+
+            priv->stall_retries = 0;
+            g_free (priv->error);
+            priv->error = g_strdup (_("Download failed"));
+            priv->error_class = INSTALL_ERROR_DOWNLOAD;
+            g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
+            return;
+        }
+        priv->stall_abort = FALSE;
+
+        /* The network came back while the transfer was winding down */
+        if (priv->suspended && g_network_monitor_get_network_available (monitor))
+        {
+            viewer_installer_window_view_model_resume (view_model);
+            return;
         }
+
+        /* Still waiting for the network, the partial file is kept */
+        if (priv->suspended)
+            return;
+
+        /* The resume timeout fired while the transfer was winding down */
+        g_free (priv->error);
+        priv->error = g_strdup (_("Network is not active"));
+        priv->error_class = INSTALL_ERROR_NETWORK;
+        g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
+        return;
+    }
+
+    g_warning ("Download failed: %s", error->message);
+
+    /* Patch missing, not applying or rebuilding something else */
+    if (priv->delta)
+    {
+        g_debug ("Delta from %s failed, downloading the full package", priv->delta->from);
+        g_error_free (error);
+        priv->delta = NULL;
+        g_clear_pointer (&priv->delta_source, g_free);
+        priv->delta_failed = TRUE;
+        viewer_installer_window_view_model_download (view_model);
+        return;
+    }
+
+    /* Whatever went wrong with the peer, the CDN still has the file */
+    if (priv->from_peer)
+    {
+        g_debug ("Download from peer failed, falling back to %s", priv->install_url);
+        g_error_free (error);
+        priv->from_peer = FALSE;
+        priv->peer_failed = TRUE;
+        viewer_installer_window_view_model_download (view_model);
         return;
     }
 
-error :
-    priv->error = g_strdup ("error, json");
+    g_free (priv->error);
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA))
+    {
+        priv->error = g_strdup (_("File is not valid"));
+        priv->error_class = INSTALL_ERROR_INVALID;
+    }
+    else
+    {
+        priv->error = g_strdup (_("Download failed"));
+        priv->error_class = INSTALL_ERROR_DOWNLOAD;
+    }
+    g_error_free (error);
+
+    g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
+}
+
+static void
+viewer_installer_window_view_model_install_done (GObject *source,
+                                                 GAsyncResult *result,
+                                                 gpointer user_data)
+{
+    GError *error = NULL;
+    InstallReport *report;
+    ViewerInstallerWindowViewModel *view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (source);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    viewer_installer_window_view_model_job_done (view_model);
+
+    report = g_task_propagate_pointer (G_TASK (result), &error);
+    if (report)
+    {
+        g_free (priv->install_method);
+        priv->install_method = g_steal_pointer (&report->method);
+        priv->install_time = report->time;
+        install_report_free (report);
+
+        if (priv->install_method)
+            g_debug ("Installed through %s in %" G_GINT64_FORMAT " ms", priv->install_method, priv->install_time);
+
+        g_object_set (G_OBJECT (view_model), "status", STATUS_INSTALLED, NULL);
+        return;
+    }
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free (error);
+        g_object_set (G_OBJECT (view_model), "status", STATUS_CANCEL, NULL);
+        return;
+    }
+
+    g_free (priv->error);
+    priv->error = g_strdup (error->message);
+    priv->error_class = INSTALL_ERROR_INSTALL;
     g_error_free (error);
-    return;
+
+    g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
+}
+
+static void
+viewer_installer_window_view_model_infos_init (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model));
+
+    GError *error = NULL;
+    const ViewerInstallerPackage *package;
+
+    ViewerInstallerWindowViewModelPrivate *priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    if (priv->manifest == NULL)
+        priv->manifest = viewer_installer_manifest_new_default (&error);
+
+    if (priv->manifest == NULL)
+    {
+        g_warning ("Could not load the package manifest: %s", error->message);
+        g_error_free (error);
+        priv->error = g_strdup ("error, json");
+        priv->error_class = INSTALL_ERROR_CONFIG;
+        return;
+    }
+
+    if (priv->package)
+        package = viewer_installer_manifest_lookup (priv->manifest, priv->package);
+    else
+        package = viewer_installer_manifest_get_main (priv->manifest);
+
+    if (package == NULL)
+    {
+        g_warning ("Package %s is not in the manifest", priv->package);
+        priv->error = g_strdup ("error, json");
+        priv->error_class = INSTALL_ERROR_CONFIG;
+        return;
+    }
+
+    g_free (priv->package);
+    priv->package = g_strdup (package->name);
+    priv->file_name = g_strdup (package->file_name);
+    priv->md5 = g_strdup (package->md5);
+    priv->sha256 = g_strdup (package->sha256);
 }
 
 static void
@@ -392,6 +1131,14 @@ viewer_installer_window_view_model_set_property (GObject *object,
     {
         priv->progress = g_value_get_uint (value);
     }
+    else if (property_id == PROP_MANIFEST)
+    {
+        priv->manifest = g_value_dup_boxed (value);
+    }
+    else if (property_id == PROP_NAME)
+    {
+        priv->package = g_value_dup_string (value);
+    }
 }
 
 static void
@@ -416,6 +1163,26 @@ viewer_installer_window_view_model_get_property (GObject *object,
     {
         g_value_set_uint (value, priv->progress);
     }
+    else if (property_id == PROP_BYTES_PER_SECOND)
+    {
+        g_value_set_double (value, priv->bytes_per_second);
+    }
+    else if (property_id == PROP_ETA)
+    {
+        g_value_set_int64 (value, priv->eta);
+    }
+    else if (property_id == PROP_RECEIVED_BYTES)
+    {
+        g_value_set_int64 (value, priv->received);
+    }
+    else if (property_id == PROP_TOTAL_BYTES)
+    {
+        g_value_set_int64 (value, priv->total);
+    }
+    else if (property_id == PROP_STALLED)
+    {
+        g_value_set_boolean (value, priv->stalled);
+    }
 }
 
 static void
@@ -432,16 +1199,34 @@ viewer_installer_window_view_model_network_changed (GNetworkMonitor *monitor,
     priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
     if (network_available)
+    {
+        if (priv->suspended && !priv->cancellable)
+            viewer_installer_window_view_model_resume (view_model);
         return;
+    }
 
     if (STATUS_INSTALLING <= priv->status)
         return;
 
-    g_autofree gchar *out_file;
-    out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
-    unlink (out_file);
+    /* Keep the partial file and wait for the network to come back */
+    if (priv->status == STATUS_DOWNLOADING)
+    {
+        if (priv->suspended)
+            return;
+
+        priv->suspended = TRUE;
+        if (priv->cancellable)
+            g_cancellable_cancel (priv->cancellable);
+
+        priv->resume_id = g_timeout_add_seconds (RESUME_TIMEOUT,
+                                                 viewer_installer_window_view_model_resume_timeout,
+                                                 view_model);
+        return;
+    }
 
+    g_free (priv->error);
     priv->error = g_strdup (_("Network is not active"));
+    priv->error_class = INSTALL_ERROR_NETWORK;
     g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
 }
 
@@ -456,16 +1241,73 @@ viewer_installer_window_view_model_dispose (GObject *object)
     view_model = VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object);
     priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    if (priv->download_thread)
+    /* A running job holds a reference, so this only happens between jobs */
+    if (priv->cancellable)
+    {
+        g_cancellable_cancel (priv->cancellable);
+        g_clear_object (&priv->cancellable);
+    }
+
+    if (priv->resume_id)
+    {
+        g_source_remove (priv->resume_id);
+        priv->resume_id = 0;
+    }
+
+    if (priv->telemetry_id)
+    {
+        g_source_remove (priv->telemetry_id);
+        priv->telemetry_id = 0;
+    }
+
+    g_signal_handlers_disconnect_by_data (g_network_monitor_get_default (), object);
+
+    if (priv->package_path)
+    {
+        g_free (priv->package_path);
+        priv->package_path = NULL;
+    }
+
+    if (priv->install_method)
+    {
+        g_free (priv->install_method);
+        priv->install_method = NULL;
+    }
+
+    if (priv->package_depends)
+    {
+        g_free (priv->package_depends);
+        priv->package_depends = NULL;
+    }
+
+    if (priv->delta_source)
+    {
+        g_free (priv->delta_source);
+        priv->delta_source = NULL;
+    }
+
+    if (priv->peer_list)
+    {
+        g_strfreev (priv->peer_list);
+        priv->peer_list = NULL;
+    }
+
+    if (priv->install_url)
+    {
+        g_free (priv->install_url);
+        priv->install_url = NULL;
+    }
+
+    if (priv->etag)
     {
-        g_thread_unref (priv->download_thread);
-        priv->download_thread = NULL;
+        g_free (priv->etag);
+        priv->etag = NULL;
     }
 
-    if (priv->install_thread)
+    if (priv->last_modified)
     {
-        g_thread_unref (priv->install_thread);
-        priv->install_thread = NULL;
+        g_free (priv->last_modified);
+        priv->last_modified = NULL;
     }
 
     if (priv->error)
@@ -486,10 +1328,10 @@ viewer_installer_window_view_model_dispose (GObject *object)
         priv->file_name = NULL;
     }
 
-    if (priv->dependencies)
+    if (priv->manifest)
     {
-        g_ptr_array_unref (priv->dependencies);
-        priv->dependencies = NULL;
+        viewer_installer_manifest_unref (priv->manifest);
+        priv->manifest = NULL;
     }
 
     if (priv->sha256)
@@ -504,7 +1346,6 @@ viewer_installer_window_view_model_dispose (GObject *object)
         priv->md5 = NULL;
     }
 
-    g_mutex_clear (&thread_mutex);
     G_OBJECT_CLASS (viewer_installer_window_view_model_parent_class)->dispose (object);
 }
 
@@ -514,10 +1355,20 @@ viewer_installer_window_view_model_finalize (GObject *object)
     G_OBJECT_CLASS (viewer_installer_window_view_model_parent_class)->finalize (object);
 }
 
+static void
+viewer_installer_window_view_model_constructed (GObject *object)
+{
+    G_OBJECT_CLASS (viewer_installer_window_view_model_parent_class)->constructed (object);
+
+    /* Needs the manifest and name construct properties */
+    viewer_installer_window_view_model_infos_init (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object));
+}
+
 static void
 viewer_installer_window_view_model_class_init (ViewerInstallerWindowViewModelClass *klass)
 {
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    object_class->constructed = viewer_installer_window_view_model_constructed;
     object_class->dispose = viewer_installer_window_view_model_dispose;
     object_class->finalize = viewer_installer_window_view_model_finalize;
     object_class->set_property = viewer_installer_window_view_model_set_property;
@@ -528,6 +1379,27 @@ viewer_installer_window_view_model_class_init (ViewerInstallerWindowViewModelCla
 
     pspec= g_param_spec_uint ("progress", "Progress", "Download progress", 0, 100, 0, G_PARAM_READWRITE);
     g_object_class_install_property (object_class, PROP_PROGRESS, pspec);
+
+    pspec= g_param_spec_double ("bytes-per-second", "Bytes per second", "Moving average of the download rate", 0, G_MAXDOUBLE, 0, G_PARAM_READABLE);
+    g_object_class_install_property (object_class, PROP_BYTES_PER_SECOND, pspec);
+
+    pspec= g_param_spec_int64 ("eta", "ETA", "Seconds until the download completes, -1 if unknown", -1, G_MAXINT64, -1, G_PARAM_READABLE);
+    g_object_class_install_property (object_class, PROP_ETA, pspec);
+
+    pspec= g_param_spec_int64 ("received-bytes", "Received bytes", "Bytes of the package on disk", 0, G_MAXINT64, 0, G_PARAM_READABLE);
+    g_object_class_install_property (object_class, PROP_RECEIVED_BYTES, pspec);
+
+    pspec= g_param_spec_int64 ("total-bytes", "Total bytes", "Size of the package, -1 if unknown", -1, G_MAXINT64, -1, G_PARAM_READABLE);
+    g_object_class_install_property (object_class, PROP_TOTAL_BYTES, pspec);
+
+    pspec= g_param_spec_boolean ("stalled", "Stalled", "Whether the download has stopped receiving data", FALSE, G_PARAM_READABLE);
+    g_object_class_install_property (object_class, PROP_STALLED, pspec);
+
+    pspec= g_param_spec_boxed ("manifest", "Manifest", "Package manifest, the installed one if unset", VIEWER_INSTALLER_TYPE_MANIFEST, G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_property (object_class, PROP_MANIFEST, pspec);
+
+    pspec= g_param_spec_string ("name", "Name", "Manifest package to install, the main one if unset", NULL, G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_property (object_class, PROP_NAME, pspec);
 }
 
 static void
@@ -540,49 +1412,105 @@ viewer_installer_window_view_model_init (ViewerInstallerWindowViewModel *self)
     priv->progress = 0;
     priv->package = NULL;
     priv->file_name = NULL;
-    priv->download_thread = NULL;
-    priv->install_thread = NULL;
-    priv->dependencies = g_ptr_array_new ();
+    priv->manifest = NULL;
+    priv->connections = 1;
+    priv->download_sync = STORAGE_SYNC_CHECKPOINT;
+    priv->content_length = -1;
+    priv->accept_ranges = FALSE;
+    priv->suspended = FALSE;
+    priv->resume_id = 0;
+    priv->cancellable = NULL;
+    priv->cancelled = FALSE;
+    priv->telemetry_id = 0;
+    priv->download_span = 0;
+    priv->attempts = 0;
+    priv->download_start = 0;
+    priv->download_time = 0;
+    priv->received = 0;
+    priv->total = -1;
+    priv->bytes_per_second = 0;
+    priv->eta = -1;
+    priv->stalled = FALSE;
+    priv->stall_abort = FALSE;
+    priv->stall_retries = 0;
+    priv->etag = NULL;
+    priv->last_modified = NULL;
+    priv->package_path = NULL;
+    priv->install_method = NULL;
+    priv->package_depends = NULL;
+    priv->install_time = -1;
+    priv->cache_size = 0;
+    priv->peer_enabled = FALSE;
+    priv->from_peer = FALSE;
+    priv->peer_failed = FALSE;
+    priv->delta_failed = FALSE;
+    priv->delta = NULL;
+    priv->delta_source = NULL;
+    priv->peer_list = NULL;
+
+    g_autoptr(GSettings) settings = viewer_installer_settings_new ();
+    if (settings)
+    {
+        g_autofree gchar *sync = g_settings_get_string (settings, "download-sync");
+
+        priv->connections = g_settings_get_uint (settings, "download-connections");
+        priv->download_sync = viewer_installer_storage_sync_from_string (sync);
+        priv->cache_size = g_settings_get_uint (settings, "cache-size");
+        priv->peer_enabled = g_settings_get_boolean (settings, "peer-cache");
+        priv->peer_list = g_settings_get_strv (settings, "peer-list");
+    }
+
+    /* Lets several instances be pointed at each other on one host */
+    if (g_getenv ("VIEWER_INSTALLER_PEERS"))
+    {
+        g_strfreev (priv->peer_list);
+        priv->peer_list = g_strsplit (g_getenv ("VIEWER_INSTALLER_PEERS"), ",", -1);
+        priv->peer_enabled = TRUE;
+    }
+
+    /* A mirror, or the stand-in CDN of the benchmarks */
+    if (g_getenv ("VIEWER_INSTALLER_URL"))
+        priv->install_url = g_strdup (g_getenv ("VIEWER_INSTALLER_URL"));
+    else
+        priv->install_url = g_strdup (VIEWER_INSTALL_URL);
 
     GNetworkMonitor *monitor = g_network_monitor_get_default();
     g_signal_connect (monitor, "network-changed", G_CALLBACK (viewer_installer_window_view_model_network_changed), self);
 
     g_object_notify_by_pspec (G_OBJECT(self), pspec);
-
-    g_mutex_init (&thread_mutex);
-    viewer_installer_window_view_model_infos_init (self);
 }
 
-gboolean
-viewer_installer_window_view_model_download_terminate (ViewerInstallerWindowViewModel *view_model)
+/* Stops whatever the view model is doing and ends in STATUS_CANCEL.
+ * A running job finishes asynchronously; an install can only be stopped
+ * before the privileged script has started. */
+void
+viewer_installer_window_view_model_cancel (ViewerInstallerWindowViewModel *view_model)
 {
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), FALSE);
+    g_return_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model));
 
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    if (priv->download_thread)
+    if (priv->resume_id)
     {
-        g_thread_unref (priv->download_thread);
-        priv->download_thread = NULL;
+        g_source_remove (priv->resume_id);
+        priv->resume_id = 0;
     }
-    return TRUE;
-}
-
-gboolean
-viewer_installer_window_view_model_install_terminate (ViewerInstallerWindowViewModel *view_model)
-{
-    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), FALSE);
-
-    ViewerInstallerWindowViewModelPrivate *priv;
-    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    priv->suspended = FALSE;
 
-    if (priv->install_thread)
+    if (priv->cancellable)
     {
-        g_thread_unref (priv->install_thread);
-        priv->install_thread = NULL;
+        g_atomic_int_set (&priv->cancelled, TRUE);
+        g_cancellable_cancel (priv->cancellable);
+        return;
     }
-    return TRUE;
+
+    if (STATUS_INSTALLED <= priv->status)
+        return;
+
+    /* Waiting for the network or for the install to be started */
+    viewer_installer_window_view_model_discard (view_model);
+    g_object_set (G_OBJECT (view_model), "status", STATUS_CANCEL, NULL);
 }
 
 gchar*
@@ -615,6 +1543,93 @@ viewer_installer_window_view_model_get_error (ViewerInstallerWindowViewModel *vi
     return priv->error;
 }
 
+InstallError
+viewer_installer_window_view_model_get_error_class (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), INSTALL_ERROR_NONE);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    return priv->error_class;
+}
+
+gchar*
+viewer_installer_window_view_model_get_install_method (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), NULL);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    return priv->install_method;
+}
+
+gint64
+viewer_installer_window_view_model_get_install_time (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), -1);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    return priv->install_time;
+}
+
+/* Download attempts after the first: restarts after a stall, fallbacks
+ * from a peer or a delta, and downloads started again by the user */
+guint
+viewer_installer_window_view_model_get_retries (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), 0);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    return priv->attempts ? priv->attempts - 1 : 0;
+}
+
+/* Seconds all download attempts took together */
+gdouble
+viewer_installer_window_view_model_get_download_time (ViewerInstallerWindowViewModel *view_model)
+{
+    g_return_val_if_fail (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (view_model), 0);
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+    return (gdouble) priv->download_time / G_USEC_PER_SEC;
+}
+
+static gboolean
+viewer_installer_window_view_model_cache_hit (ViewerInstallerWindowViewModel *view_model)
+{
+    g_autofree gchar *entry = NULL;
+    g_autofree gchar *out_file = NULL;
+
+    ViewerInstallerWindowViewModelPrivate *priv;
+    priv = viewer_installer_window_view_model_get_instance_private (view_model);
+
+    if (priv->cache_size == 0)
+        return FALSE;
+
+    entry = viewer_installer_cache_lookup (priv->sha256);
+    if (!entry)
+        return FALSE;
+
+    out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
+
+    g_free (priv->package_path);
+    if (viewer_installer_cache_checkout (entry, out_file))
+        priv->package_path = g_steal_pointer (&out_file);
+    else
+        priv->package_path = g_steal_pointer (&entry);
+
+    g_debug ("Installing %s from the package cache", priv->package_path);
+
+    g_object_set (G_OBJECT (view_model), "status", STATUS_DOWNLOADING, NULL);
+    priv->progress = 100;
+    g_object_set (G_OBJECT (view_model), "progress", priv->progress, NULL);
+    g_object_set (G_OBJECT (view_model), "status", STATUS_DOWNLOADED, NULL);
+
+    return TRUE;
+}
+
 void
 viewer_installer_window_view_model_download(ViewerInstallerWindowViewModel *view_model)
 {
@@ -625,19 +1640,34 @@ viewer_installer_window_view_model_download(ViewerInstallerWindowViewModel *view
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
+    /* Already running; a cache hit now would end it while it transfers */
+    if (priv->cancellable)
+        return;
+
+    /* Whatever is installed next comes out of this download */
+    g_clear_pointer (&priv->package_depends, g_free);
+
+    if (viewer_installer_window_view_model_cache_hit (view_model))
+        return;
+
     GNetworkMonitor *monitor = g_network_monitor_get_default();
     is_connected = g_network_monitor_get_network_available (monitor);
 
-    if (!is_connected)
+    /* A local mirror does not need a route to the internet */
+    if (!is_connected && g_strcmp0 (priv->install_url, VIEWER_INSTALL_URL) == 0)
     {
+        g_free (priv->error);
         priv->error = g_strdup (_("Network is not active"));
+        priv->error_class = INSTALL_ERROR_NETWORK;
         g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
         return;
     }
 
-    g_autofree gchar *uri;
-    g_autofree gchar *out_file;
+    gchar *out_file;
+    DownloadJob *job;
+    g_autoptr(GTask) task = NULL;
 
+    /* A partial download is kept next to it as .part and resumed */
     out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->file_name);
 
     if (g_file_test (out_file, G_FILE_TEST_EXISTS))
@@ -645,20 +1675,60 @@ viewer_installer_window_view_model_download(ViewerInstallerWindowViewModel *view
         unlink (out_file);
     }
 
-    uri = g_strdup_printf ("%s/%s", VIEWER_INSTALL_URL, priv->file_name);
-    if (!viewer_download_check (view_model, uri))
+    g_free (priv->package_path);
+    priv->package_path = g_strdup (out_file);
+
+    if (priv->status != STATUS_DOWNLOADING)
+        g_object_set (G_OBJECT (view_model), "status", STATUS_DOWNLOADING, NULL);
+
+    job = g_new0 (DownloadJob, 1);
+    job->out_file = out_file;
+
+    /* Only the patch from an older version when one applies here */
+    priv->delta = NULL;
+    g_clear_pointer (&priv->delta_source, g_free);
+    if (!priv->delta_failed)
+    {
+        const ViewerInstallerPackage *package = viewer_installer_manifest_lookup (priv->manifest, priv->package);
+
+        if (package)
+            priv->delta = viewer_installer_delta_find (package, &priv->delta_source);
+    }
+
+    if (priv->delta)
     {
-        priv->error = g_strdup (_("File is not valid"));
-        g_object_set (G_OBJECT (view_model), "status", STATUS_ERROR, NULL);
-        return;
+        g_debug ("Updating %s with the delta from %s", priv->package, priv->delta->from);
+        job->package_file = g_steal_pointer (&job->out_file);
+        job->out_file = g_strdup_printf ("%s/%s", OUT_PATH, priv->delta->file_name);
+        job->delta_format = g_strdup (priv->delta->format);
+        job->delta_from = g_strdup (priv->delta->from);
+        job->delta_source = g_strdup (priv->delta_source);
+        job->sha256 = g_strdup (priv->sha256);
     }
 
-    g_object_set (G_OBJECT (view_model), "status", STATUS_DOWNLOADING, NULL);
+    viewer_installer_transfer_get_stats (viewer_installer_transfer_get_default (), &priv->transfer_stats);
+    viewer_installer_window_view_model_telemetry_start (view_model);
+    priv->download_span = viewer_installer_trace_begin ();
+    priv->download_start = g_get_monotonic_time ();
+    priv->attempts++;
 
-    if (priv->download_thread)
-        g_thread_unref (priv->download_thread);
+    task = viewer_installer_window_view_model_job_new (view_model,
+                                                       viewer_installer_window_view_model_download_done);
+    g_task_set_task_data (task, job, (GDestroyNotify) download_job_free);
 
-    priv->download_thread = g_thread_new ("viewer-download", (GThreadFunc)viewer_download_func, view_model);
+    /* Peers serve whole packages only */
+    if (priv->peer_enabled && !priv->peer_failed && priv->sha256 && !priv->delta)
+    {
+        g_autoptr(GTask) discover = NULL;
+
+        job->span = viewer_installer_trace_begin ();
+        discover = g_task_new (view_model, g_task_get_cancellable (task),
+                               viewer_download_discovered, g_object_ref (task));
+        g_task_run_in_thread (discover, viewer_download_discover_thread);
+        return;
+    }
+
+    viewer_download_next_source (task);
 }
 
 void
@@ -669,12 +1739,18 @@ viewer_installer_window_view_model_install(ViewerInstallerWindowViewModel *view_
     ViewerInstallerWindowViewModelPrivate *priv;
     priv = viewer_installer_window_view_model_get_instance_private (view_model);
 
-    g_object_set (G_OBJECT (view_model), "status", STATUS_INSTALLING, NULL);
+    g_autoptr(GTask) task = NULL;
+
+    /* Cancelled while the window waited to start the install */
+    if (priv->status != STATUS_DOWNLOADED || priv->cancellable)
+        return;
 
-    if (priv->install_thread)
-        g_thread_unref (priv->install_thread);
+    /* The job first, so a cancel from a status handler reaches it */
+    task = viewer_installer_window_view_model_job_new (view_model,
+                                                       viewer_installer_window_view_model_install_done);
 
-    priv->install_thread = g_thread_new ("viewer-install", (GThreadFunc)viewer_install_func, view_model);
+    g_object_set (G_OBJECT (view_model), "status", STATUS_INSTALLING, NULL);
+    g_task_run_in_thread (task, viewer_install_thread);
 }
 
 
@@ -685,3 +1761,15 @@ viewer_installer_window_view_model_new (void)
     view_model = g_object_new (VIEWER_INSTALLER_TYPE_WINDOW_VIEW_MODEL, NULL);
     return view_model;
 }
+
+ViewerInstallerWindowViewModel *
+viewer_installer_window_view_model_new_for_package (ViewerInstallerManifest *manifest,
+                                                    const gchar *name)
+{
+    ViewerInstallerWindowViewModel *view_model;
+    view_model = g_object_new (VIEWER_INSTALLER_TYPE_WINDOW_VIEW_MODEL,
+                               "manifest", manifest,
+                               "name", name,
+                               NULL);
+    return view_model;
+}
@@ -22,6 +22,9 @@
 #include <gtk/gtk.h>
 #include <glib-object.h>
 
+#include "define.h"
+#include "viewer-installer-manifest.h"
+
 #define VIEWER_INSTALLER_TYPE_WINDOW_VIEW_MODEL (viewer_installer_window_view_model_get_type ())
 
 G_DECLARE_DERIVABLE_TYPE (ViewerInstallerWindowViewModel, viewer_installer_window_view_model, VIEWER_INSTALLER, WINDOW_VIEW_MODEL, GObject)
@@ -33,16 +36,30 @@ struct _ViewerInstallerWindowViewModelClass
 };
 
 ViewerInstallerWindowViewModel *viewer_installer_window_view_model_new (void);
+ViewerInstallerWindowViewModel *viewer_installer_window_view_model_new_for_package (ViewerInstallerManifest *manifest,
+                                                                                    const gchar             *name);
 
-gboolean
-viewer_installer_window_view_model_download_terminate (ViewerInstallerWindowViewModel *view_model);
-
-gboolean
-viewer_installer_window_view_model_install_terminate (ViewerInstallerWindowViewModel *view_model);
+void
+viewer_installer_window_view_model_cancel (ViewerInstallerWindowViewModel *view_model);
 
 gchar*
 viewer_installer_window_view_model_get_error (ViewerInstallerWindowViewModel *view_model);
 
+InstallError
+viewer_installer_window_view_model_get_error_class (ViewerInstallerWindowViewModel *view_model);
+
+gchar*
+viewer_installer_window_view_model_get_install_method (ViewerInstallerWindowViewModel *view_model);
+
+gint64
+viewer_installer_window_view_model_get_install_time (ViewerInstallerWindowViewModel *view_model);
+
+guint
+viewer_installer_window_view_model_get_retries (ViewerInstallerWindowViewModel *view_model);
+
+gdouble
+viewer_installer_window_view_model_get_download_time (ViewerInstallerWindowViewModel *view_model);
+
 gchar*
 viewer_installer_window_view_model_get_package (ViewerInstallerWindowViewModel *view_model);
 
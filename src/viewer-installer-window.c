@@ -22,7 +22,8 @@
 #include "define.h"
 #include "viewer-installer-config.h"
 #include "viewer-installer-window.h"
-#include "viewer-installer-window-view-model.h"
+#include "viewer-installer-scheduler.h"
+#include "viewer-installer-transfer.h"
 
 struct _ViewerInstallerWindow
 {
@@ -31,7 +32,7 @@ struct _ViewerInstallerWindow
 
 typedef struct
 {
-    ViewerInstallerWindowViewModel *view_model;
+    ViewerInstallerScheduler *scheduler;
 
     /* Template widgets */
     GtkImage            *main_image;
@@ -51,6 +52,10 @@ typedef struct
     GtkButton           *close_button;
 
     GtkProgressBar      *install_progressbar;
+
+    /* Bandwidth cap while the window is in the background */
+    guint64             background_rate;
+    gdouble             background_share;
 } ViewerInstallerWindowPrivate;
 
 
@@ -67,20 +72,7 @@ viewer_installer_window_button_install_clicked (GtkWidget *button, ViewerInstall
     g_return_if_fail (VIEWER_INSTALLER_WINDOW(win));
 
     ViewerInstallerWindowPrivate *priv = viewer_installer_window_get_instance_private (win);
-    viewer_installer_window_view_model_download(priv->view_model);
-}
-
-static gboolean
-viewer_installer_window_start_install (gpointer user_data)
-{
-    ViewerInstallerWindow *win = user_data;
-    ViewerInstallerWindowPrivate *priv;
-
-    priv = viewer_installer_window_get_instance_private (win);
-
-    viewer_installer_window_view_model_install(priv->view_model);
-
-    return G_SOURCE_REMOVE;
+    viewer_installer_scheduler_run(priv->scheduler);
 }
 
 static void
@@ -114,14 +106,6 @@ viewer_installer_window_notify_status (GObject *object,
             gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (priv->install_progressbar), 0);
             break;
         }
-        case STATUS_DOWNLOADED :
-        {
-            gchar *txt = g_strdup (_("Downloaded"));
-            gtk_label_set_text (priv->status_label, txt);
-            viewer_installer_window_view_model_download_terminate (priv->view_model);
-            g_timeout_add (1000, viewer_installer_window_start_install, data);
-            break;
-        }
         case STATUS_INSTALLING:
         {
             gchar *txt = g_strdup (_("Installing Hangul 2020 Viewer Beta"));
@@ -132,8 +116,7 @@ viewer_installer_window_notify_status (GObject *object,
         {
             gchar *txt;
             gchar *package;
-            viewer_installer_window_view_model_install_terminate (priv->view_model);
-            package = viewer_installer_window_view_model_get_package (priv->view_model);
+            package = viewer_installer_scheduler_get_package (priv->scheduler);
 
             if (check_package(package))
             {
@@ -150,10 +133,19 @@ viewer_installer_window_notify_status (GObject *object,
             g_object_freeze_notify (object);
             break;
         }
+        case STATUS_CANCEL :
+        {
+            gchar *txt = g_strdup (_("The installation of Hangul 2020 Viewer Beta is cancelled"));
+            gtk_label_set_text (priv->error_label, txt);
+            gtk_stack_set_visible_child (GTK_STACK (priv->bar_stack), priv->end_bar);
+            gtk_header_bar_set_show_close_button (GTK_HEADER_BAR(priv->header_bar), TRUE);
+            g_object_freeze_notify (object);
+            break;
+        }
         case STATUS_ERROR :
         {
             gchar *error;
-            error = viewer_installer_window_view_model_get_error (priv->view_model);
+            error = viewer_installer_scheduler_get_error (priv->scheduler);
             gtk_label_set_text (priv->error_label, error);
             gtk_stack_set_visible_child (GTK_STACK (priv->bar_stack), priv->end_bar);
             gtk_header_bar_set_show_close_button (GTK_HEADER_BAR(priv->header_bar), TRUE);
@@ -192,6 +184,24 @@ viewer_installer_window_constructed (GObject *self)
     G_OBJECT_CLASS (viewer_installer_window_parent_class)->constructed (self);
 }
 
+/* Full speed while the user watches, the background cap otherwise */
+static void
+viewer_installer_window_notify_is_active (GObject *object,
+                                          GParamSpec *pspec,
+                                          gpointer data)
+{
+    ViewerInstallerWindow *win = VIEWER_INSTALLER_WINDOW (object);
+    ViewerInstallerWindowPrivate *priv;
+
+    priv = viewer_installer_window_get_instance_private (win);
+
+    if (gtk_window_is_active (GTK_WINDOW (win)))
+        viewer_installer_transfer_set_limit (viewer_installer_transfer_get_default (), 0, 0);
+    else
+        viewer_installer_transfer_set_limit (viewer_installer_transfer_get_default (),
+                                             priv->background_rate, priv->background_share);
+}
+
 static void
 viewer_installer_window_dispose (GObject *self)
 {
@@ -203,10 +213,13 @@ viewer_installer_window_dispose (GObject *self)
     win = VIEWER_INSTALLER_WINDOW (self);
     priv = viewer_installer_window_get_instance_private (win);
 
-    if (priv->view_model)
+    /* Closed in the middle of a download or before the install */
+    if (priv->scheduler)
     {
-        g_object_unref (priv->view_model);
-        priv->view_model = NULL;
+        g_signal_handlers_disconnect_by_data (priv->scheduler, self);
+        viewer_installer_scheduler_cancel (priv->scheduler);
+        g_object_unref (priv->scheduler);
+        priv->scheduler = NULL;
     }
 
     G_OBJECT_CLASS (viewer_installer_window_parent_class)->dispose (self);
@@ -257,7 +270,14 @@ viewer_installer_window_init (ViewerInstallerWindow *self)
     pixbuf = gdk_pixbuf_new_from_resource ("/kr/hancom/viewer-installer/viewer-installer.svg", NULL);
     gtk_image_set_from_pixbuf (priv->main_image, pixbuf);
 
-    priv->view_model = viewer_installer_window_view_model_new ();
+    priv->scheduler = viewer_installer_scheduler_new ();
+
+    g_autoptr(GSettings) settings = viewer_installer_settings_new ();
+    if (settings)
+    {
+        priv->background_rate = (guint64) g_settings_get_uint (settings, "background-rate-limit") * 1024;
+        priv->background_share = g_settings_get_uint (settings, "background-rate-share") / 100.0;
+    }
 
     //viewer_installer_window_check_package (self);
  
@@ -265,8 +285,10 @@ viewer_installer_window_init (ViewerInstallerWindow *self)
               G_CALLBACK (viewer_installer_window_button_close_clicked), self);
     g_signal_connect (priv->install_button, "clicked",
               G_CALLBACK (viewer_installer_window_button_install_clicked), self);
-    g_signal_connect (priv->view_model, "notify::status",
+    g_signal_connect (priv->scheduler, "notify::status",
               G_CALLBACK (viewer_installer_window_notify_status), self);
-    g_signal_connect (priv->view_model, "notify::progress",
+    g_signal_connect (priv->scheduler, "notify::progress",
               G_CALLBACK (viewer_installer_window_notify_progress), self);
+    g_signal_connect (self, "notify::is-active",
+              G_CALLBACK (viewer_installer_window_notify_is_active), NULL);
 }
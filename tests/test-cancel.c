@@ -0,0 +1,456 @@
+/* test-cancel.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Cancels the view model in each state of a download and install against
+ * the stand-in CDN of the benchmarks, and checks that it ends in
+ * STATUS_CANCEL with nothing left in OUT_PATH. pkexec and debpatch are
+ * replaced by scripts on PATH, the installed version of the package by a
+ * dpkg status file in DPKG_ADMINDIR. */
+
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+
+#include "define.h"
+#include "bench-stand-in.h"
+#include "viewer-installer-manifest.h"
+#include "viewer-installer-window-view-model.h"
+
+/* Where the view model downloads to */
+#define OUT_PATH "/var/tmp"
+
+#define PACKAGE_SIZE (4 * 1024 * 1024)
+
+/* Seconds before a run counts as hung, and how long to keep the main
+ * loop going after the cancel for anything that would still happen */
+#define RUN_TIMEOUT 30
+#define SETTLE_MS 300
+
+/* Delays of the stand-in that hold the job in one state */
+#define HEAD_RTT_MS 2000
+#define HEAD_CANCEL_MS 100
+#define CHUNK_DELAY_MS 50
+
+/* Well under the half second the view model waits for peers */
+#define DISCOVERY_CANCEL_MS 50
+
+typedef struct
+{
+    guint     rtt_ms;
+    guint     chunk_delay_ms;
+    gboolean  peers;
+    gboolean  delta;
+} CancelCase;
+
+typedef struct
+{
+    StandIn                         cdn;
+    gchar                          *dir;
+    gchar                          *bin;
+    ViewerInstallerManifest        *manifest;
+    ViewerInstallerWindowViewModel *view_model;
+    GMainLoop                      *loop;
+    guint                           timeout_id;
+
+    /* What the view model writes, the patch only with a delta */
+    gchar                          *package_file;
+    gchar                          *patch_file;
+} Fixture;
+
+static gchar *original_path = NULL;
+
+static void
+write_script (const gchar *path, const gchar *contents)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!g_file_set_contents (path, contents, -1, &error))
+        g_error ("%s", error->message);
+    g_chmod (path, 0755);
+}
+
+static void
+notify_status (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+    Fixture *f = user_data;
+    guint status;
+
+    g_object_get (object, "status", &status, NULL);
+
+    if (status == STATUS_DOWNLOADED || status == STATUS_INSTALLED ||
+        status == STATUS_CANCEL || status == STATUS_ERROR)
+        g_main_loop_quit (f->loop);
+}
+
+static void
+fixture_setup (Fixture *f, gconstpointer data)
+{
+    const CancelCase *test_case = data;
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *base = NULL;
+    g_autofree gchar *json = NULL;
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *status = NULL;
+    g_autofree gchar *script = NULL;
+    g_autofree gchar *file_name = NULL;
+
+    f->dir = g_dir_make_tmp ("test-cancel-XXXXXX", &error);
+    if (!f->dir)
+        g_error ("%s", error->message);
+
+    /* Stand-ins for the programs the view model runs */
+    f->bin = g_build_filename (f->dir, "bin", NULL);
+    g_mkdir (f->bin, 0755);
+
+    script = g_build_filename (f->bin, "pkexec", NULL);
+    write_script (script, "#!/bin/sh\n: > \"$0.ran\"\nexit 1\n");
+    g_free (script);
+
+    script = g_build_filename (f->bin, "debpatch", NULL);
+    write_script (script, "#!/bin/sh\n: > \"$0.ran\"\nsleep 1\ncat \"$1\" > \"$3\"\n");
+
+    path = g_strdup_printf ("%s:%s", f->bin, original_path);
+    g_setenv ("PATH", path, TRUE);
+
+    /* An older version installed, for the delta */
+    status = g_build_filename (f->dir, "status", NULL);
+    if (!g_file_set_contents (status,
+                              "Package: " STAND_IN_PACKAGE "\n"
+                              "Status: install ok installed\n"
+                              "Version: 0.9\n\n", -1, &error))
+        g_error ("%s", error->message);
+    g_setenv ("DPKG_ADMINDIR", f->dir, TRUE);
+
+    f->cdn.rtt_ms = test_case->rtt_ms;
+    f->cdn.chunk_delay_ms = test_case->chunk_delay_ms;
+    stand_in_make_package (&f->cdn, f->dir, PACKAGE_SIZE);
+    stand_in_start (&f->cdn);
+
+    base = g_strdup_printf ("http://127.0.0.1:%u", f->cdn.port);
+    g_setenv ("VIEWER_INSTALLER_URL", base, TRUE);
+
+    /* Any peer turns discovery on; nobody answers at this one */
+    if (test_case->peers)
+        g_setenv ("VIEWER_INSTALLER_PEERS", "127.0.0.1:9", TRUE);
+    else
+        g_unsetenv ("VIEWER_INSTALLER_PEERS");
+
+    /* With a delta, the stand-in serves the patch and the package is
+     * rebuilt from it under its own name */
+    if (test_case->delta)
+    {
+        file_name = g_strdup_printf ("%s_%d_rebuilt.deb", STAND_IN_PACKAGE, getpid ());
+        json = g_strdup_printf ("{ \"package\" : { \"name\" : \"%s\", \"version\" : \"1.0\", "
+                                "\"file-name\" : \"%s\", \"SHA256\" : \"%s\", "
+                                "\"deltas\" : [ { \"from\" : \"0.9\", \"format\" : \"debdelta\", "
+                                "\"file-name\" : \"%s\", \"SHA256\" : \"%s\" } ] } }",
+                                STAND_IN_PACKAGE, file_name, f->cdn.sha256,
+                                f->cdn.file_name, f->cdn.sha256);
+        f->patch_file = g_build_filename (OUT_PATH, f->cdn.file_name, NULL);
+    }
+    else
+    {
+        file_name = g_strdup (f->cdn.file_name);
+        json = g_strdup_printf ("{ \"package\" : { \"name\" : \"%s\", \"file-name\" : \"%s\", \"SHA256\" : \"%s\" } }",
+                                STAND_IN_PACKAGE, file_name, f->cdn.sha256);
+    }
+    f->package_file = g_build_filename (OUT_PATH, file_name, NULL);
+
+    f->manifest = viewer_installer_manifest_new_from_data (json, -1, &error);
+    g_assert_no_error (error);
+
+    f->loop = g_main_loop_new (NULL, FALSE);
+    f->view_model = viewer_installer_window_view_model_new_for_package (f->manifest, STAND_IN_PACKAGE);
+    g_signal_connect (f->view_model, "notify::status", G_CALLBACK (notify_status), f);
+}
+
+static void
+remove_file (const gchar *dir, const gchar *name)
+{
+    g_autofree gchar *path = g_build_filename (dir, name, NULL);
+
+    g_unlink (path);
+}
+
+static void
+fixture_teardown (Fixture *f, gconstpointer data)
+{
+    g_signal_handlers_disconnect_by_data (f->view_model, f);
+    g_object_unref (f->view_model);
+    g_main_loop_unref (f->loop);
+    viewer_installer_manifest_unref (f->manifest);
+
+    stand_in_stop (&f->cdn);
+    stand_in_clear (&f->cdn);
+
+    /* Only what a failed test left behind */
+    if (f->patch_file)
+        g_unlink (f->patch_file);
+    g_unlink (f->package_file);
+
+    remove_file (f->bin, "pkexec");
+    remove_file (f->bin, "pkexec.ran");
+    remove_file (f->bin, "debpatch");
+    remove_file (f->bin, "debpatch.ran");
+    g_rmdir (f->bin);
+    remove_file (f->dir, "status");
+    g_rmdir (f->dir);
+
+    g_free (f->patch_file);
+    g_free (f->package_file);
+    g_free (f->bin);
+    g_free (f->dir);
+}
+
+static gboolean
+run_timeout (gpointer user_data)
+{
+    Fixture *f = user_data;
+
+    f->timeout_id = 0;
+    g_main_loop_quit (f->loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Until the job ends or @timeout_ms passes */
+static void
+fixture_run (Fixture *f, guint timeout_ms)
+{
+    f->timeout_id = g_timeout_add (timeout_ms, run_timeout, f);
+    g_main_loop_run (f->loop);
+
+    if (f->timeout_id)
+    {
+        g_source_remove (f->timeout_id);
+        f->timeout_id = 0;
+    }
+}
+
+static guint
+get_status (Fixture *f)
+{
+    guint status;
+
+    g_object_get (f->view_model, "status", &status, NULL);
+    return status;
+}
+
+static void
+assert_missing (const gchar *file, const gchar *suffix)
+{
+    g_autofree gchar *path = g_strconcat (file, suffix, NULL);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS))
+        g_error ("%s was left behind", path);
+}
+
+static void
+assert_not_ran (Fixture *f, const gchar *program)
+{
+    g_autofree gchar *marker = g_strdup_printf ("%s/%s.ran", f->bin, program);
+
+    if (g_file_test (marker, G_FILE_TEST_EXISTS))
+        g_error ("%s ran", program);
+}
+
+/* Ends in STATUS_CANCEL, stays there, and leaves nothing behind */
+static void
+assert_cancelled (Fixture *f)
+{
+    if (get_status (f) == STATUS_DOWNLOADING || get_status (f) == STATUS_INSTALLING)
+        fixture_run (f, RUN_TIMEOUT * 1000);
+    g_assert_cmpuint (get_status (f), ==, STATUS_CANCEL);
+
+    fixture_run (f, SETTLE_MS);
+    g_assert_cmpuint (get_status (f), ==, STATUS_CANCEL);
+
+    assert_missing (f->package_file, "");
+    assert_missing (f->package_file, ".part");
+    assert_missing (f->package_file, ".part.state");
+
+    if (f->patch_file)
+    {
+        assert_missing (f->patch_file, "");
+        assert_missing (f->patch_file, ".part");
+        assert_missing (f->patch_file, ".part.state");
+    }
+
+    assert_not_ran (f, "pkexec");
+}
+
+static gboolean
+cancel_cb (gpointer user_data)
+{
+    Fixture *f = user_data;
+
+    viewer_installer_window_view_model_cancel (f->view_model);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* The discovery worker stops waiting for answers at the cancel */
+static void
+test_cancel_discovery (Fixture *f, gconstpointer data)
+{
+    gint64 start;
+
+    viewer_installer_window_view_model_download (f->view_model);
+    g_assert_cmpuint (get_status (f), ==, STATUS_DOWNLOADING);
+
+    start = g_get_monotonic_time ();
+    viewer_installer_window_view_model_cancel (f->view_model);
+    fixture_run (f, RUN_TIMEOUT * 1000);
+    g_assert_cmpuint (get_status (f), ==, STATUS_CANCEL);
+    g_assert_cmpint ((g_get_monotonic_time () - start) / 1000, <, DISCOVERY_CANCEL_MS);
+
+    assert_cancelled (f);
+}
+
+/* The stand-in holds the HEAD answer back */
+static void
+test_cancel_head (Fixture *f, gconstpointer data)
+{
+    viewer_installer_window_view_model_download (f->view_model);
+    g_assert_cmpuint (get_status (f), ==, STATUS_DOWNLOADING);
+
+    g_timeout_add (HEAD_CANCEL_MS, cancel_cb, f);
+    assert_cancelled (f);
+}
+
+static void
+notify_received (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+    gint64 received;
+
+    g_object_get (object, "received-bytes", &received, NULL);
+    if (0 < received)
+    {
+        g_signal_handlers_disconnect_by_func (object, notify_received, user_data);
+        g_idle_add (cancel_cb, user_data);
+    }
+}
+
+/* The stand-in sends the body slowly, part of it is on disk */
+static void
+test_cancel_transfer (Fixture *f, gconstpointer data)
+{
+    g_signal_connect (f->view_model, "notify::received-bytes", G_CALLBACK (notify_received), f);
+
+    viewer_installer_window_view_model_download (f->view_model);
+    g_assert_cmpuint (get_status (f), ==, STATUS_DOWNLOADING);
+
+    assert_cancelled (f);
+}
+
+static gboolean
+poll_debpatch (gpointer user_data)
+{
+    Fixture *f = user_data;
+    g_autofree gchar *marker = g_build_filename (f->bin, "debpatch.ran", NULL);
+
+    if (!g_file_test (marker, G_FILE_TEST_EXISTS))
+        return G_SOURCE_CONTINUE;
+
+    viewer_installer_window_view_model_cancel (f->view_model);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* The fake debpatch takes a second to rebuild the package */
+static void
+test_cancel_delta_apply (Fixture *f, gconstpointer data)
+{
+    guint poll_id;
+
+    poll_id = g_timeout_add (10, poll_debpatch, f);
+
+    viewer_installer_window_view_model_download (f->view_model);
+    g_assert_cmpuint (get_status (f), ==, STATUS_DOWNLOADING);
+
+    assert_cancelled (f);
+
+    /* Cancelled somewhere else than in the rebuild */
+    if (g_main_context_find_source_by_id (NULL, poll_id))
+    {
+        g_source_remove (poll_id);
+        g_error ("debpatch did not run");
+    }
+}
+
+static void
+notify_installing (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+    guint status;
+
+    g_object_get (object, "status", &status, NULL);
+    if (status == STATUS_INSTALLING)
+        viewer_installer_window_view_model_cancel (VIEWER_INSTALLER_WINDOW_VIEW_MODEL (object));
+}
+
+/* As soon as the install job exists, before its worker gets to pkexec */
+static void
+test_cancel_install (Fixture *f, gconstpointer data)
+{
+    viewer_installer_window_view_model_download (f->view_model);
+    fixture_run (f, RUN_TIMEOUT * 1000);
+    g_assert_cmpuint (get_status (f), ==, STATUS_DOWNLOADED);
+
+    g_signal_connect (f->view_model, "notify::status", G_CALLBACK (notify_installing), f);
+    viewer_installer_window_view_model_install (f->view_model);
+
+    assert_cancelled (f);
+}
+
+static const CancelCase discovery_case = { 0, 0, TRUE, FALSE };
+static const CancelCase head_case = { HEAD_RTT_MS, 0, FALSE, FALSE };
+static const CancelCase transfer_case = { 0, CHUNK_DELAY_MS, FALSE, FALSE };
+static const CancelCase delta_case = { 0, 0, FALSE, TRUE };
+static const CancelCase install_case = { 0, 0, FALSE, FALSE };
+
+int
+main (int argc, char *argv[])
+{
+    gint result;
+
+    g_test_init (&argc, &argv, NULL);
+
+    /* Schema defaults, whatever the user running the tests has set */
+    g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+    original_path = g_strdup (g_getenv ("PATH"));
+
+    curl_global_init (CURL_GLOBAL_DEFAULT);
+
+    g_test_add ("/cancel/peer-discovery", Fixture, &discovery_case,
+                fixture_setup, test_cancel_discovery, fixture_teardown);
+    g_test_add ("/cancel/head", Fixture, &head_case,
+                fixture_setup, test_cancel_head, fixture_teardown);
+    g_test_add ("/cancel/transfer", Fixture, &transfer_case,
+                fixture_setup, test_cancel_transfer, fixture_teardown);
+    g_test_add ("/cancel/delta-apply", Fixture, &delta_case,
+                fixture_setup, test_cancel_delta_apply, fixture_teardown);
+    g_test_add ("/cancel/before-pkexec", Fixture, &install_case,
+                fixture_setup, test_cancel_install, fixture_teardown);
+
+    result = g_test_run ();
+
+    curl_global_cleanup ();
+    g_free (original_path);
+
+    return result;
+}
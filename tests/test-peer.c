@@ -0,0 +1,248 @@
+/* test-peer.c
+ *
+ * Copyright (C) 2020 Hancom Gooroom <gooroom@hancom.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Starts two peer caches of the installer given on the command line on
+ * one host, each on its own port and directory, and checks that multicast
+ * discovery over loopback finds both and that each serves byte ranges of
+ * the package it has. */
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <curl/curl.h>
+
+#include "viewer-installer-peer.h"
+
+#define N_PEERS 2
+#define PACKAGE_SIZE (1024 * 1024)
+
+/* Longer than the view model waits, the peers answer on a busy host */
+#define DISCOVERY_TIMEOUT 2000
+
+/* Across a read buffer boundary of the peer */
+#define RANGE_START 1000
+#define RANGE_LENGTH (100 * 1000)
+
+static const gchar *installer = NULL;
+
+typedef struct
+{
+    gchar       *dir;
+    gchar       *path;
+    guint16      port;
+    GSubprocess *process;
+} Peer;
+
+/* A port nothing listens on right now */
+static guint16
+free_port (void)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GSocket) socket = NULL;
+    g_autoptr(GInetAddress) any = NULL;
+    g_autoptr(GSocketAddress) address = NULL;
+    g_autoptr(GSocketAddress) bound = NULL;
+
+    socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &error);
+    g_assert_no_error (error);
+
+    any = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+    address = g_inet_socket_address_new (any, 0);
+    g_socket_bind (socket, address, FALSE, &error);
+    g_assert_no_error (error);
+
+    bound = g_socket_get_local_address (socket, &error);
+    g_assert_no_error (error);
+
+    return g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (bound));
+}
+
+/* Returns once the peer serves, it says so on stderr */
+static void
+peer_start (Peer *peer, GBytes *package, const gchar *sha256)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GDataInputStream) err = NULL;
+    g_autofree gchar *name = NULL;
+    g_autofree gchar *port = NULL;
+    gchar *line;
+
+    peer->dir = g_dir_make_tmp ("test-peer-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    /* Named as the package cache names it */
+    name = g_strdup_printf ("%s.deb", sha256);
+    peer->path = g_build_filename (peer->dir, name, NULL);
+    g_file_set_contents (peer->path, g_bytes_get_data (package, NULL), g_bytes_get_size (package), &error);
+    g_assert_no_error (error);
+
+    peer->port = free_port ();
+    port = g_strdup_printf ("%u", peer->port);
+
+    peer->process = g_subprocess_new (G_SUBPROCESS_FLAGS_STDERR_PIPE, &error,
+                                      installer, "--peer-cache",
+                                      "--peer-port", port,
+                                      "--peer-cache-dir", peer->dir,
+                                      NULL);
+    g_assert_no_error (error);
+
+    err = g_data_input_stream_new (g_subprocess_get_stderr_pipe (peer->process));
+    while ((line = g_data_input_stream_read_line (err, NULL, NULL, NULL)))
+    {
+        gboolean serving = (strstr (line, "Serving") != NULL);
+
+        g_test_message ("peer %u: %s", peer->port, line);
+        g_free (line);
+
+        if (serving)
+            return;
+    }
+
+    g_error ("Peer cache on port %u did not start", peer->port);
+}
+
+static void
+peer_stop (Peer *peer)
+{
+    if (peer->process)
+    {
+        g_subprocess_force_exit (peer->process);
+        g_subprocess_wait (peer->process, NULL, NULL);
+        g_clear_object (&peer->process);
+    }
+
+    g_unlink (peer->path);
+    g_rmdir (peer->dir);
+    g_free (peer->path);
+    g_free (peer->dir);
+}
+
+static const gchar *
+find_peer (GPtrArray *peers, guint16 port)
+{
+    g_autofree gchar *suffix = g_strdup_printf (":%u", port);
+    guint i;
+
+    for (i = 0; i < peers->len; i++)
+    {
+        if (g_str_has_suffix (g_ptr_array_index (peers, i), suffix))
+            return g_ptr_array_index (peers, i);
+    }
+
+    return NULL;
+}
+
+static size_t
+append_cb (char *ptr, size_t size, size_t nmemb, void *user_data)
+{
+    g_byte_array_append (user_data, (const guint8 *) ptr, size * nmemb);
+    return size * nmemb;
+}
+
+/* RANGE_LENGTH bytes from RANGE_START, as the download asks for a segment */
+static void
+assert_range (const gchar *peer, const gchar *sha256, GBytes *package)
+{
+    g_autoptr(GByteArray) body = g_byte_array_new ();
+    g_autofree gchar *uri = viewer_installer_peer_get_uri (peer, sha256);
+    g_autofree gchar *range = g_strdup_printf ("%d-%d", RANGE_START, RANGE_START + RANGE_LENGTH - 1);
+    const guint8 *data = g_bytes_get_data (package, NULL);
+    CURL *curl;
+    CURLcode result;
+    long code = 0;
+
+    curl = curl_easy_init ();
+    curl_easy_setopt (curl, CURLOPT_URL, uri);
+    curl_easy_setopt (curl, CURLOPT_RANGE, range);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, append_cb);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, body);
+
+    result = curl_easy_perform (curl);
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_cleanup (curl);
+
+    g_assert_cmpint (result, ==, CURLE_OK);
+    g_assert_cmpint (code, ==, 206);
+    g_assert_cmpuint (body->len, ==, RANGE_LENGTH);
+    g_assert_true (memcmp (body->data, data + RANGE_START, RANGE_LENGTH) == 0);
+}
+
+static void
+test_peer_discover (void)
+{
+    Peer peers[N_PEERS] = { { 0, }, };
+    g_autoptr(GPtrArray) found = NULL;
+    g_autoptr(GBytes) package = NULL;
+    g_autofree gchar *sha256 = NULL;
+    guint32 *data;
+    guint i;
+
+    data = g_malloc (PACKAGE_SIZE);
+    for (i = 0; i < PACKAGE_SIZE / sizeof (guint32); i++)
+        data[i] = g_random_int ();
+    package = g_bytes_new_take (data, PACKAGE_SIZE);
+    sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, package);
+
+    for (i = 0; i < N_PEERS; i++)
+        peer_start (&peers[i], package, sha256);
+
+    found = viewer_installer_peer_discover (sha256, NULL, DISCOVERY_TIMEOUT, NULL);
+
+    for (i = 0; i < found->len; i++)
+        g_test_message ("found %s", (const gchar *) g_ptr_array_index (found, i));
+
+    for (i = 0; i < N_PEERS; i++)
+    {
+        const gchar *peer = find_peer (found, peers[i].port);
+
+        if (!peer)
+            g_error ("Peer on port %u was not discovered", peers[i].port);
+
+        assert_range (peer, sha256, package);
+    }
+
+    for (i = 0; i < N_PEERS; i++)
+        peer_stop (&peers[i]);
+}
+
+int
+main (int argc, char *argv[])
+{
+    gint result;
+
+    g_test_init (&argc, &argv, NULL);
+
+    if (argc < 2)
+    {
+        g_printerr ("Usage: %s INSTALLER\n", argv[0]);
+        return 1;
+    }
+    installer = argv[1];
+
+    /* Schema defaults for the peers, whatever the user has set */
+    g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+    curl_global_init (CURL_GLOBAL_DEFAULT);
+
+    g_test_add_func ("/peer/discover", test_peer_discover);
+
+    result = g_test_run ();
+
+    curl_global_cleanup ();
+
+    return result;
+}